@@ -1,5 +1,6 @@
 .section .text
 .global _start
+.global _start_secondary
 
 # a0 - current hart id
 # a1 - pointer to flattened device tree
@@ -8,6 +9,9 @@ _start:
     la sp, stack_top
     mv fp, sp
 
+    # The kernel keeps the hart id in tp
+    mv tp, a0
+
     # Save arguments
     addi sp, sp, -16
     sd a0, 8(sp)
@@ -27,13 +31,16 @@ _start:
     la a0, welcome_msg5
     jal console_puts
 
-    # Set supervisor trap vector
-    la t0, interrupt_handler
+    # Set supervisor trap vector in vectored mode
+    la t0, interrupt_vector
+    ori t0, t0, 1
     csrw stvec, t0
 
     # Set up mmu
     ld a0, 0(sp)
     jal init_heap_metadata
+    ld a0, 0(sp)
+    jal mmu_init_mode
     jal create_mmu_top
     csrw sscratch, a0
     ld a1, 0(sp)
@@ -41,9 +48,7 @@ _start:
     csrr a0, sscratch
 
     # Enable the mmu
-    li t0, 0x8000000000000000
-    srli a0, a0, 12
-    or a0, a0, t0
+    jal mmu_make_satp
     csrw satp, a0
     sfence.vma zero, zero
 
@@ -63,6 +68,34 @@ _start:
 finish:
     j finish
 
+# a0 - current hart id
+# a1 - pointer to the hart's boot information (stack top, satp)
+_start_secondary:
+    # Initialise stack pointer
+    ld sp, 0(a1)
+    mv fp, sp
+
+    # The kernel keeps the hart id in tp
+    mv tp, a0
+
+    # Set supervisor trap vector in vectored mode
+    la t0, interrupt_vector
+    ori t0, t0, 1
+    csrw stvec, t0
+
+    # Enable the mmu with the kernel page table
+    ld t0, 8(a1)
+    csrw satp, t0
+    sfence.vma zero, zero
+
+    # Allow access to user memory, as on the boot hart
+    li t0, 0x40000
+    csrs sstatus, t0
+
+    # Initialise this hart with a0 and a1 as given; this becomes its idle loop and never returns
+    jal kinit_secondary
+    j finish
+
 
 .section .rodata
 welcome_msg0:
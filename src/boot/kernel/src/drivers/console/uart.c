@@ -1,5 +1,6 @@
 #include "uart.h"
 
+#include "../../lib/lock.h"
 #include "../../lib/string.h"
 #include "../../lib/memory.h"
 #include "../../interrupts.h"
@@ -31,8 +32,8 @@ typedef struct {
     void* callback_data;
 } uart_tx_queue_entry_t;
 
-// TODO: make atomic
 struct s_uart_mmio {
+    spinlock_t lock;
     volatile void* base;
     unsigned long long reg_shift;
 
@@ -74,7 +75,10 @@ void uart_enqueue_received_data(uart_mmio_t* mmio, char data) {
     // TODO: reallocate queue if too smol
 }
 
-void uart_put_next_character_into_tx(uart_mmio_t* mmio) {
+// uart_put_next_character_into_tx(uart_mmio_t*) -> uart_tx_queue_entry_t
+// Writes the next queued character to the uart. If that finishes an entry, the entry is removed from the queue and returned so its callback can be called without the lock held; otherwise the returned entry has no callback.
+uart_tx_queue_entry_t uart_put_next_character_into_tx(uart_mmio_t* mmio) {
+    uart_tx_queue_entry_t done = { 0 };
     if (mmio->tx_queue_length != 0) {
         uart_tx_queue_entry_t* entry = &mmio->tx_queue[mmio->tx_queue_front];
         asm volatile("csrrw %0, satp, %0" : "=r" (entry->mmu) : "r" (entry->mmu));
@@ -84,18 +88,19 @@ void uart_put_next_character_into_tx(uart_mmio_t* mmio) {
         entry->data++;
 
         if (entry->length == 0) {
-            asm volatile("csrrw %0, satp, %0" : "=r" (entry->mmu) : "r" (entry->mmu));
-            entry->callback_fn(entry->callback_data);
-            asm volatile("csrrw %0, satp, %0" : "=r" (entry->mmu) : "r" (entry->mmu));
+            done = *entry;
             mmio->tx_queue_front++;
             mmio->tx_queue_front %= mmio->tx_queue_capacity;
             mmio->tx_queue_length--;
         }
     }
+    return done;
 }
 
 void uart_mei_handler(unsigned int _, void* callback_data) {
     uart_mmio_t* mmio = callback_data;
+    unsigned long long flags = spinlock_acquire_irqsave(&mmio->lock);
+    uart_tx_queue_entry_t done = { 0 };
 
     uart_interrupt_status_t status = *UART_INTERRUPT_STATUS_REGISTER(*mmio);
     switch (status) {
@@ -115,7 +120,7 @@ void uart_mei_handler(unsigned int _, void* callback_data) {
             break;
 
         case UART_INTERRUPT_STATUS_TRANSMITTER_HOLDING_REGISTER_EMPTY:
-            uart_put_next_character_into_tx(mmio);
+            done = uart_put_next_character_into_tx(mmio);
             break;
 
         case UART_INTERRUPT_STATUS_MODEM_STATUS:
@@ -128,6 +133,14 @@ void uart_mei_handler(unsigned int _, void* callback_data) {
         case UART_INTERRUPT_STATUS_DMA_TRANSMISSION_EOT:
             break;
     }
+    spinlock_release_irqrestore(&mmio->lock, flags);
+
+    // The callback may queue more output, which takes the lock again
+    if (done.callback_fn != (void*) 0) {
+        asm volatile("csrrw %0, satp, %0" : "=r" (done.mmu) : "r" (done.mmu));
+        done.callback_fn(done.callback_data);
+        asm volatile("csrrw %0, satp, %0" : "=r" (done.mmu) : "r" (done.mmu));
+    }
 }
 
 uart_mmio_t* init_ns16550(fdt_t* fdt, void* node) {
@@ -136,13 +149,10 @@ uart_mmio_t* init_ns16550(fdt_t* fdt, void* node) {
     struct fdt_property reg_shift_raw = fdt_get_property(fdt, node, "reg-shift");
     unsigned long long reg_shift = reg_shift_raw.data ? be_to_le(32, reg_shift_raw.data) : 0;
 
-    unsigned long long mmu;
-    mmu_level_1_t* top = (void*) 0;
-    asm volatile("csrr %0, satp" : "=r" (mmu));
-    top = (void*) ((mmu & 0x00000fffffffffff) << 12);
-    mmu_map_range_identity(top, (void*) addr, (void*) (addr + (7 << reg_shift)), MMU_FLAG_READ | MMU_FLAG_WRITE);
+    mmu_map_range_identity(kernel_mmu, (void*) addr, (void*) (addr + (7 << reg_shift)), MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
 
     mmio = (uart_mmio_t) {
+        .lock = { 0 },
         .base = (void*) addr,
         .reg_shift = reg_shift,
         .type = UART_TYPE_NS16550,
@@ -206,8 +216,11 @@ uart_mmio_t* init_uart(fdt_t* fdt, char* path) {
 // uart_write_str(uart_mmio_t*, char*, unsigned long long, void (*)(void*), void*) -> int
 // Writes a string to the uart. Returns 0 on success.
 int uart_write_str(uart_mmio_t* mmio, char* data, unsigned long long length, void (*callback_fn)(void*), void* callback_data) {
-    if (mmio->tx_queue_length >= mmio->tx_queue_capacity)
+    unsigned long long flags = spinlock_acquire_irqsave(&mmio->lock);
+    if (mmio->tx_queue_length >= mmio->tx_queue_capacity) {
+        spinlock_release_irqrestore(&mmio->lock, flags);
         return -1;
+    }
 
     unsigned long long mmu;
     asm volatile("csrr %0, satp" : "=r" (mmu));
@@ -220,6 +233,7 @@ int uart_write_str(uart_mmio_t* mmio, char* data, unsigned long long length, voi
     };
     mmio->tx_queue_rear %= mmio->tx_queue_capacity;
     mmio->tx_queue_length++;
+    spinlock_release_irqrestore(&mmio->lock, flags);
     return 0;
 }
 
@@ -190,6 +190,17 @@ void generic_dir_append_entry(generic_file_t* dir, struct s_dir_entry entry) {
     entry.file->parent = dir;
 }
 
+// generic_dir_find_cached(generic_file_t*, char*) -> struct s_dir_entry*
+// Returns the cached entry of a directory with the given name, or null if there is none.
+static struct s_dir_entry* generic_dir_find_cached(generic_file_t* file, char* name) {
+    generic_dir_t dir = *file->dir;
+    for (unsigned long long i = 0; i < dir->length; i++) {
+        if (dir->entries[i].name != (void*) 0 && !strcmp(dir->entries[i].name, name))
+            return &dir->entries[i];
+    }
+    return (void*) 0;
+}
+
 // generic_dir_lookup_dir(generic_file_t*, generic_dir_t*, char*) -> struct s_dir_entry*
 // Returns an entry with the same name if found. Returns a zeroed out structure if not found.
 struct s_dir_entry generic_dir_lookup_dir(generic_file_t* file, char* name) {
@@ -206,21 +217,27 @@ struct s_dir_entry generic_dir_lookup_dir(generic_file_t* file, char* name) {
         };
 
     // Check cached entries first
-    generic_dir_t dir = *file->dir;
-    struct s_dir_entry* entries = dir->entries;
-    unsigned long long length = dir->length;
-    for (unsigned long long i = 0; i < length; i++) {
-        if (!strcmp(entries[i].name, name))
-            return entries[i];
-    }
+    struct s_dir_entry* cached = generic_dir_find_cached(file, name);
+    if (cached != (void*) 0)
+        return *cached;
 
     // Lookup via file system driver
+    if (file->fs == (void*) 0 || file->fs->lookup == (void*) 0)
+        return (struct s_dir_entry) { 0 };
     struct s_dir_entry entry = file->fs->lookup(file, name);
     if (entry.file != (void*) 0) {
         entry.file->fs = file->fs;
         file->fs->rc++;
-        if (entry.file->type == GENERIC_FILE_TYPE_DIR)
+        if (entry.file->type == GENERIC_FILE_TYPE_DIR) {
+            // The lookup may have slept while another process looked up and cached the same directory
+            cached = generic_dir_find_cached(file, name);
+            if (cached != (void*) 0) {
+                free(entry.name);
+                close_generic_file(entry.file);
+                return *cached;
+            }
             generic_dir_append_entry(file, entry);
+        }
     }
     return entry;
 }
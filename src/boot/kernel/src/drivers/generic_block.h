@@ -7,9 +7,11 @@
 // The unpack functions are used as follows (same goes for write):
 // block->unpack_read(&data_buffer, sector, sector_count, block->metadata)
 // On success, unpack_(read/write) returns 0, otherwise it returns an error code.
+// unpack_capacity returns the number of sectors on the device.
 typedef struct s_generic_block {
     char (*unpack_read)(void*, unsigned long long, unsigned long long, unsigned char*);
     char (*unpack_write)(void*, unsigned long long, unsigned long long, unsigned char*);
+    unsigned long long (*unpack_capacity)(unsigned char*);
     unsigned char used;
     unsigned char metadata[15];
 } __attribute__((__packed__, aligned(1))) generic_block_t;
@@ -26,5 +28,11 @@ static inline char generic_block_write(generic_block_t* block, void* buffer, uns
     return block->unpack_write(buffer, sector, sector_count, block->metadata);
 }
 
+// generic_block_capacity(generic_block_t*) -> unsigned long long
+// Returns the number of sectors on a block device.
+static inline unsigned long long generic_block_capacity(generic_block_t* block) {
+    return block->unpack_capacity(block->metadata);
+}
+
 #endif /* KERNEL_GENERIC_BLOCK_H */
 
@@ -1,8 +1,11 @@
 #include "block.h"
 #include "../../interrupts.h"
+#include "../../lib/lock.h"
 #include "../../lib/memory.h"
 #include "../../lib/string.h"
 #include "../console/console.h"
+#include "../../userspace/sched.h"
+#include "../../userspace/waitqueue.h"
 
 typedef struct __attribute__((__packed__, aligned(1))) { 
     unsigned long long capacity; 
@@ -29,6 +32,8 @@ typedef struct {
     volatile virtio_block_config_t* config;
     char in_use;
     char ro;
+    spinlock_t lock;
+    wait_queue_t waiters;
 } virtio_block_device_t;
 
 typedef struct __attribute__((__packed__, aligned(4))) {
@@ -50,10 +55,15 @@ void virtio_block_mei_handler(unsigned int _, void* block_device) {
 
     if (status == VIRTIO_INTERRUPT_USED_RING_UPDATE) {
         // Free memory that is no longer used
+        unsigned long long flags = spinlock_acquire_irqsave((spinlock_t*) &device->lock);
         volatile virtio_descriptor_t* p;
         while ((p = virtqueue_pop_used(device->queue))) {
             free((void*) p->addr);
         }
+        spinlock_release_irqrestore((spinlock_t*) &device->lock, flags);
+
+        // Processes waiting on the device check whether their own request finished
+        wait_queue_wake_all((wait_queue_t*) &device->waiters);
     }
 }
 
@@ -76,7 +86,9 @@ char virtio_init_block_device(volatile virtio_mmio_t* mmio) {
         .mmio = mmio,
         .config = config,
         .in_use = 1,
-        .ro = ro
+        .ro = ro,
+        .lock = { 0 },
+        .waiters = { 0 }
     };
 
     // Add interrupt
@@ -119,7 +131,8 @@ virtio_block_error_code_t virtio_block_operation(virtio_block_operation_t rw, un
     };
     virtio_block_device_t* device = &block_devices[block_id];
 
-    // Set descriptors
+    // Set descriptors; other harts may be using the queue too
+    unsigned long long flags = spinlock_acquire_irqsave(&device->lock);
     unsigned short d1, d2, d3;
     *virtqueue_push_descriptor(device->queue, &d3) = (virtio_descriptor_t) {
         .addr = status,
@@ -147,6 +160,7 @@ virtio_block_error_code_t virtio_block_operation(virtio_block_operation_t rw, un
 
     // Notify the device of new entries on the queue
     device->mmio->queue_notify = 0;
+    spinlock_release_irqrestore(&device->lock, flags);
 
     return VIRTIO_BLOCK_ERROR_CODE_SUCCESS;
 }
@@ -163,10 +177,27 @@ virtio_block_error_code_t virtio_block_write(unsigned char block_id, unsigned lo
     return virtio_block_operation(VIRTIO_BLOCK_OPERATION_WRITE, block_id, sector, data, sector_count * 512, status);
 }
 
+// virtio_block_capacity(unsigned char) -> unsigned long long
+// Returns the number of sectors on a block device, or 0 if there is no such device.
+unsigned long long virtio_block_capacity(unsigned char block_id) {
+    if (block_id >= VIRTIO_DEVICE_COUNT || !block_devices[block_id].in_use)
+        return 0;
+    return block_devices[block_id].config->capacity;
+}
+
+// virtio_block_wait(unsigned char, volatile unsigned char*) -> void
+// Waits for a request to a block device to finish. Processes in a syscall sleep until the completion interrupt wakes them up; anything else polls.
+static void virtio_block_wait(unsigned char block_id, volatile unsigned char* status) {
+    while (*status == 0xff) {
+        if (sched_can_sleep())
+            wait_queue_sleep(&block_devices[block_id].waiters);
+    }
+}
+
 char virtio_block_unpack_read(void* buffer, unsigned long long sector, unsigned long long sector_count, unsigned char* metadata) {
     volatile unsigned char status = 0xff;
     if (!virtio_block_read(*metadata, sector, buffer, sector_count, &status)) {
-        while (status == 0xff);
+        virtio_block_wait(*metadata, &status);
         if (status)
             return -1;
         else
@@ -178,7 +209,7 @@ char virtio_block_unpack_read(void* buffer, unsigned long long sector, unsigned
 char virtio_block_unpack_write(void* buffer, unsigned long long sector, unsigned long long sector_count, unsigned char* metadata) {
     volatile unsigned char status = 0xff;
     if (!virtio_block_write(*metadata, sector, buffer, sector_count, &status)) {
-        while (status == 0xff);
+        virtio_block_wait(*metadata, &status);
         if (status)
             return -1;
         else
@@ -187,11 +218,16 @@ char virtio_block_unpack_write(void* buffer, unsigned long long sector, unsigned
     return -1;
 }
 
+unsigned long long virtio_block_unpack_capacity(unsigned char* metadata) {
+    return virtio_block_capacity(*metadata);
+}
+
 void virtio_block_make_generic(unsigned char block_id, generic_file_t* dev) {
     generic_block_t* device = malloc(sizeof(generic_block_t));
     *device = (generic_block_t) {
         .unpack_read = virtio_block_unpack_read,
         .unpack_write = virtio_block_unpack_write,
+        .unpack_capacity = virtio_block_unpack_capacity,
         .used = 1,
         .metadata = { block_id, 0 }
     };
@@ -23,6 +23,10 @@ virtio_block_error_code_t virtio_block_read(unsigned char block_id, unsigned lon
 // Reads sectors from a block device and dumps them into the provided pointer. Status is set to 0xff and remains 0xff until the read is finished.
 virtio_block_error_code_t virtio_block_write(unsigned char block_id, unsigned long long sector, void* data, unsigned long long sector_count, volatile unsigned char* status);
 
+// virtio_block_capacity(unsigned char) -> unsigned long long
+// Returns the number of sectors on a block device, or 0 if there is no such device.
+unsigned long long virtio_block_capacity(unsigned char block_id);
+
 void virtio_block_make_generic(unsigned char block_id, generic_file_t* dev);
 
 // clean_virtio_block_devices() -> void
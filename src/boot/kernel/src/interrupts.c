@@ -1,7 +1,15 @@
 #include "interrupts.h"
 #include "opensbi.h"
+#include "smp.h"
+#include "userspace/ksm.h"
+#include "userspace/pagefault.h"
+#include "userspace/sched.h"
 #include "userspace/syscall.h"
+#include "userspace/timer.h"
+#include "userspace/uring.h"
+#include "userspace/workingset.h"
 #include "drivers/console/console.h"
+#include "drivers/devicetree/tree.h"
 
 //#define INTERRUPT_DEBUG
 
@@ -11,6 +19,21 @@ unsigned long long PLIC_BASE = 0;
 void (*mei_interrupt_handlers[PLIC_COUNT])(unsigned int, void*) = { 0 };
 void* mei_callback_data[PLIC_COUNT] = { 0 };
 
+unsigned long long plic_contexts[SMP_MAX_HARTS] = { 0 };
+
+// Whether each hart takes device interrupts yet
+char plic_hart_ready[SMP_MAX_HARTS] = { 0 };
+
+// Hart each interrupt is enabled on, and whether it was pinned there rather than balanced
+unsigned long long plic_routes[PLIC_COUNT] = { 0 };
+char plic_pinned[PLIC_COUNT] = { 0 };
+
+// The process whose floating point registers were last loaded into or saved from each hart
+process_t* fp_owners[SMP_MAX_HARTS] = { 0 };
+
+extern void fp_save(double* fs);
+extern void fp_load(double* fs);
+
 // get_context_enable_bits(unsigned long long) -> volatile unsigned int*
 // Gets a volatile pointer to the interrupt enable bits for a given context.
 volatile unsigned int* get_context_enable_bits(unsigned long long context) {
@@ -29,6 +52,138 @@ volatile unsigned int* get_context_claim_pointer(unsigned long long context) {
     return (volatile void*) (PLIC_BASE + PLIC_CLAIM_OFFSET + context * 0x1000);
 }
 
+// plic_phandle_hart(fdt_t*, unsigned long long) -> unsigned long long
+// Returns the id of the hart whose local interrupt controller has the given phandle, or PLIC_NONE if there is none.
+static unsigned long long plic_phandle_hart(fdt_t* devicetree, unsigned long long phandle) {
+    void* cpu = (void*) 0;
+    while ((cpu = fdt_find(devicetree, "cpu", cpu)) != (void*) 0) {
+        struct fdt_property reg = fdt_get_property(devicetree, cpu, "reg");
+        if (reg.data == (void*) 0)
+            continue;
+
+        // The controller is a child of the cpu node, so it comes before the next cpu
+        void* intc = fdt_find(devicetree, "interrupt-controller", cpu);
+        void* next = fdt_find(devicetree, "cpu", cpu);
+        if (intc == (void*) 0 || (next != (void*) 0 && next < intc))
+            continue;
+
+        struct fdt_property handle = fdt_get_property(devicetree, intc, "phandle");
+        if (handle.data != (void*) 0 && be_to_le(32, handle.data) == phandle)
+            return be_to_le(32, reg.data);
+    }
+
+    return PLIC_NONE;
+}
+
+// plic_init(void*) -> void
+// Finds the PLIC in the device tree and works out which context takes each hart's supervisor external interrupts from its interrupts-extended property.
+void plic_init(void* fdt) {
+    for (unsigned long long i = 0; i < PLIC_COUNT; i++)
+        plic_routes[i] = PLIC_NONE;
+
+    fdt_t devicetree = verify_fdt(fdt);
+    void* plic = fdt_find(&devicetree, "plic", (void*) 0);
+    PLIC_BASE = fdt_get_node_addr(plic);
+
+    // Each context has a pair of a local interrupt controller's phandle and the interrupt it raises there
+    struct fdt_property contexts = fdt_get_property(&devicetree, plic, "interrupts-extended");
+    if (contexts.data == (void*) 0) {
+        console_puts("PLIC contexts not in the device tree; assuming two per hart\n");
+        for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++)
+            plic_contexts[i] = PLIC_CONTEXT(i, 1);
+        return;
+    }
+
+    for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++)
+        plic_contexts[i] = PLIC_NONE;
+    for (unsigned long long i = 0; i < contexts.len / 8; i++) {
+        unsigned long long phandle = be_to_le(32, contexts.data + i * 8);
+        unsigned long long interrupt = be_to_le(32, contexts.data + i * 8 + 4);
+        if (interrupt != PLIC_SUPERVISOR_EXTERNAL)
+            continue;
+
+        unsigned long long hartid = plic_phandle_hart(&devicetree, phandle);
+        if (hartid < SMP_MAX_HARTS)
+            plic_contexts[hartid] = i;
+    }
+}
+
+// plic_route(unsigned int, unsigned long long) -> void
+// Enables an interrupt on the context of one hart only, so that a single hart takes it.
+static void plic_route(unsigned int mei_id, unsigned long long hartid) {
+    unsigned long long old = plic_routes[mei_id - 1];
+    if (old == hartid)
+        return;
+
+    unsigned int word = mei_id / 32;
+    unsigned int bit = 1u << (mei_id % 32);
+    if (old != PLIC_NONE)
+        get_context_enable_bits(plic_contexts[old])[word] &= ~bit;
+    if (hartid != PLIC_NONE)
+        get_context_enable_bits(plic_contexts[hartid])[word] |= bit;
+    plic_routes[mei_id - 1] = hartid;
+}
+
+// plic_balance() -> void
+// Spreads the interrupts with registered handlers that are not pinned evenly across the harts that take device interrupts.
+static void plic_balance() {
+    unsigned long long next = 0;
+    for (unsigned int i = 0; i < PLIC_COUNT; i++) {
+        if (mei_interrupt_handlers[i] == 0 || plic_pinned[i])
+            continue;
+
+        unsigned long long hartid = PLIC_NONE;
+        for (unsigned long long j = 0; j < SMP_MAX_HARTS; j++) {
+            unsigned long long k = (next + j) % SMP_MAX_HARTS;
+            if (plic_hart_ready[k]) {
+                hartid = k;
+                break;
+            }
+        }
+
+        plic_route(i + 1, hartid);
+        if (hartid != PLIC_NONE)
+            next = hartid + 1;
+    }
+}
+
+// plic_init_hart(unsigned long long) -> void
+// Lets the PLIC interrupt a hart and rebalances device interrupts across every hart set up so far. Called with the kernel lock held on each hart as it starts.
+void plic_init_hart(unsigned long long hartid) {
+    if (hartid >= SMP_MAX_HARTS || plic_contexts[hartid] == PLIC_NONE) {
+        console_printf("Hart 0x%llx has no PLIC context\n", hartid);
+        return;
+    }
+
+    // Start with nothing enabled; interrupts are routed here by balancing
+    volatile unsigned int* enables = get_context_enable_bits(plic_contexts[hartid]);
+    for (unsigned int i = 0; i < (PLIC_COUNT + 1) / 32; i++)
+        enables[i] = 0;
+    *get_context_priority_threshold(plic_contexts[hartid]) = 0;
+
+    plic_hart_ready[hartid] = 1;
+    plic_balance();
+}
+
+// plic_set_affinity(unsigned int, unsigned long long) -> char
+// Pins an interrupt with a registered handler to a hart, or lets it be balanced again if the hart is PLIC_NONE. Returns 0 on success, 1 on failure.
+char plic_set_affinity(unsigned int mei_id, unsigned long long hartid) {
+    if (mei_id == 0 || mei_id > PLIC_COUNT || mei_interrupt_handlers[mei_id - 1] == 0)
+        return 1;
+
+    if (hartid == PLIC_NONE) {
+        plic_pinned[mei_id - 1] = 0;
+        plic_balance();
+        return 0;
+    }
+
+    if (hartid >= SMP_MAX_HARTS || !plic_hart_ready[hartid])
+        return 1;
+    plic_pinned[mei_id - 1] = 1;
+    plic_route(mei_id, hartid);
+    return 0;
+}
+
 // register_mei_handler(unsigned int, unsigned char, void (*)(unsigned int, void*), void*) -> char
 // Registers a machine external interrupt with a given mei id, priority, and handler. If the priority is 0, then the interrupt is disabled. Returns 0 on successful registration, 1 on failure.
 char register_mei_handler(unsigned int mei_id, unsigned char priority, void (*mei_handler)(unsigned int, void*), void* callback_data) {
@@ -37,6 +192,7 @@ char register_mei_handler(unsigned int mei_id, unsigned char priority, void (*me
         mei_interrupt_handlers[mei_id - 1] = mei_handler;
         mei_callback_data[mei_id - 1] = callback_data;
         *(((unsigned int*) PLIC_BASE) + mei_id) = priority;
+        plic_balance();
         return 0;
     }
     return 1;
@@ -46,8 +202,10 @@ char register_mei_handler(unsigned int mei_id, unsigned char priority, void (*me
 // Handles a machine external interrupt.
 void handle_mei() {
     // Claim the interrupt
-    volatile unsigned int* claim_reg = get_context_claim_pointer(PLIC_CONTEXT(0, 1)); // TODO: don't hardcode the context
+    volatile unsigned int* claim_reg = get_context_claim_pointer(plic_contexts[current_hartid()]);
     unsigned int mei_id = *claim_reg;
+    if (mei_id == 0)
+        return;
     *claim_reg = mei_id;
 
     // Debug stuff
@@ -61,55 +219,167 @@ void handle_mei() {
         mei_handler(mei_id, mei_callback_data[mei_id - 1]);
 }
 
-// swap_process(trap_t*) -> void
-// Swaps the current process with the next process in the queue.
-void swap_process(trap_t* trap) {
-    // Save current state
-    process_t* process = fetch_process(trap->pid);
-    process->pc = trap->pc;
-    memcpy(process->xs, trap->xs, sizeof(unsigned long long) * 32);
-    memcpy(process->fs, trap->fs, sizeof(double) * 32);
-
-    pid_t pid = next_process_in_queue();
-    if (pid) {
-        // Get process
-        process_t* new = fetch_process(pid);
-        trap->pid = pid;
-
-        // Set mmu
-        unsigned long long mmu = (((unsigned long long) new->mmu_data) >> 12) | 0x8000000000000000;
-        asm volatile("csrw satp, %0" : "=r" (mmu));
-        mmu = 0;
-        asm volatile("sfence.vma zero, %0" : "=r" (mmu));
-
-        // Set trap registers
-        trap->pc = new->pc;
-        memcpy(trap->xs, new->xs, sizeof(unsigned long long) * 32);
-        memcpy(trap->fs, new->fs, sizeof(double) * 32);
-
-        // Set ring to user ring
-        mmu = 0x100;
-        asm volatile("csrc sstatus, %0" : "=r" (mmu));
+// set_fp_state(unsigned long long) -> void
+// Sets the FS field of sstatus.
+static void set_fp_state(unsigned long long state) {
+    unsigned long long fs = SSTATUS_FS;
+    asm volatile("csrc sstatus, %0" : : "r" (fs));
+    asm volatile("csrs sstatus, %0" : : "r" (state));
+}
+
+// save_process_trap(process_t*) -> void
+// Saves the state of a process that is switched away from that is not kept in its trap frame. Floating point registers are only saved if the process has written to them since they were loaded.
+void save_process_trap(process_t* process) {
+    // The kernel is built without floating point, so the unit's state is still that of the process
+    unsigned long long sstatus;
+    asm volatile("csrr %0, sstatus" : "=r" (sstatus));
+    if ((sstatus & SSTATUS_FS) == SSTATUS_FS_DIRTY) {
+        fp_save(process->fs);
+        set_fp_state(SSTATUS_FS_CLEAN);
+        fp_owners[process->trap.hartid] = process;
+        process->fp_hart = process->trap.hartid;
+    }
+}
+
+// load_process_fp(process_t*, unsigned long long) -> void
+// Loads the floating point registers of a process into the current hart and turns the floating point unit on.
+static void load_process_fp(process_t* process, unsigned long long hartid) {
+    set_fp_state(SSTATUS_FS_INITIAL);
+    fp_load(process->fs);
+    set_fp_state(SSTATUS_FS_CLEAN);
+    fp_owners[hartid] = process;
+    process->fp_hart = hartid;
+}
+
+// load_process_trap(process_t*) -> void
+// Points sscratch at the trap frame of a process so that leaving the trap continues the process and the next trap saves into it, and switches to its page table and kernel stack. Floating point registers are loaded once the process uses them.
+void load_process_trap(process_t* process) {
+    trap_t* trap = &process->trap;
+    trap->hartid = current_hartid();
+    trap->pid = process->pid;
+    asm volatile("csrw sscratch, %0" : : "r" (trap));
+
+    // Set mmu
+    mmu_switch_top(process->mmu_data);
+
+    // Registers that are still on this hart from the last time the process ran are used as is; otherwise they are loaded on the first floating point instruction
+    if (fp_owners[trap->hartid] == process && process->fp_hart == trap->hartid)
+        set_fp_state(SSTATUS_FS_CLEAN);
+    else set_fp_state(SSTATUS_FS_OFF);
+
+    // The next trap is handled on the process's kernel stack
+    trap->isr_stack = sched_kernel_stack_top(process, trap->hartid);
+
+    // Set ring to user ring, or to the kernel with interrupts enabled for the idle process
+    unsigned long long spp = 0x100;
+    if (process->pid != 0) {
+        asm volatile("csrc sstatus, %0" : : "r" (spp));
+    } else {
+        spp |= 0x20;
+        asm volatile("csrs sstatus, %0" : : "r" (spp));
+    }
+}
+
+// swap_process(trap_t*) -> unsigned long long
+// Swaps the current process with the next process picked by the scheduler. Returns the length of the time slice of the process to run, or 0 if the hart is going idle.
+unsigned long long swap_process(trap_t* trap) {
+    // Registers are already in the process's trap frame; each hart has its own idle process
+    process_t* process = trap->pid != 0 ? fetch_process(trap->pid) : sched_idle_process(trap->hartid);
+    save_process_trap(process);
+
+    // Process 0 is the idle process, which is picked when nothing else can run
+    unsigned long long slice;
+    pid_t pid = sched_next(trap->pid, &slice);
+    if (pid != trap->pid)
+        load_process_trap(pid != 0 ? fetch_process(pid) : sched_idle_process(trap->hartid));
+
+    return slice;
+}
+
+// reschedule(trap_t*) -> void
+// Switches to the next process and programs the timer for the end of its time slice.
+static void reschedule(trap_t* trap) {
+    unsigned long long slice = swap_process(trap);
+
+    // An idle hart has no time slice and only wakes up for pending timers or other interrupts
+    timer_program(slice != 0 ? timer_now() + slice : TIMER_NEVER);
+
+    // A process that went to sleep inside the kernel carries on from there instead of returning through this trap
+    sched_continue_kernel();
+}
+
+// kernel_preempt_point() -> void
+// Marks a safe point in a long kernel path. Syscalls run with interrupts disabled, so this handles pending device interrupts and expired timers, and switches to another process if the time slice is over or a reschedule was asked for. Does nothing outside of syscalls or inside atomic sections.
+void kernel_preempt_point() {
+    if (!sched_can_sleep())
+        return;
+
+    unsigned long long sip;
+    asm volatile("csrr %0, sip" : "=r" (sip));
+    if (sip & 0x200)
+        handle_mei();
+
+    // Timers run here may wake something up, which is seen as a software interrupt
+    char slice_over = (sip & 0x20) && timer_tick();
+    asm volatile("csrr %0, sip" : "=r" (sip));
+
+    // The process stays runnable and is requeued; the next timer is programmed when switching
+    if (slice_over || (sip & 0x2)) {
+        unsigned long long ssip = 0x2;
+        asm volatile("csrc sip, %0" : : "r" (ssip));
+        sched_sleep();
     }
 }
 
+// handle_timer_interrupt(trap_t*) -> char
+// Called by the timer interrupt entry, which only saves the registers the C calling convention does not preserve. Runs expired timers. Returns true if the time slice is over, in which case the trap is taken again through handle_interrupt to reschedule.
+char handle_timer_interrupt(trap_t* trap) {
+    (void) trap;
+    unsigned long long flags = kernel_lock_acquire();
+    char slice_over = timer_tick();
+    kernel_lock_release(flags);
+    return slice_over;
+}
+
+// handle_external_interrupt(trap_t*) -> char
+// Called by the external interrupt entry, which only saves the registers the C calling convention does not preserve. Processes woken up by the device are switched to by a later software interrupt, so this always returns false.
+char handle_external_interrupt(trap_t* trap) {
+    (void) trap;
+    unsigned long long flags = kernel_lock_acquire();
+    handle_mei();
+    kernel_lock_release(flags);
+    return 0;
+}
+
 // handle_interrupt(unsigned long long, unsigned long long, struct s_trap, pid_t) -> trap_t*
 // Called by the interrupt handler to dispatch the interrupt. Returns the trap structure to jump back to.
 trap_t* handle_interrupt(unsigned long long scause, trap_t* trap) {
+    // Only one hart is in the kernel at a time
+    unsigned long long flags = kernel_lock_acquire();
+
     // Asynchronous interrupts
     if (scause &  0x8000000000000000) {
         scause &= 0x7fffffffffffffff;
         switch (scause) {
-            // Timer interrupts
-            case 0x05: {
-                swap_process(trap);
-
-                unsigned long long time = 0;
-                asm volatile("csrr %0, time" : "=r" (time));
-                sbi_set_timer(time + 10000);
+            // Software interrupts, sent by other harts when they queue something here
+            case 0x01: {
+                unsigned long long ssip = 0x2;
+                asm volatile("csrc sip, %0" : : "r" (ssip));
+                reschedule(trap);
                 break;
             }
 
+            // Timer interrupts only get here from handle_timer_interrupt once it has already run the expired timers and found the time slice over
+            case 0x05:
+                workingset_tick();
+                ksm_tick();
+
+                // Timer interrupts only reach processes in user mode, so the process's page table is loaded
+                if (trap->pid != 0)
+                    uring_poll(fetch_process(trap->pid), trap);
+                reschedule(trap);
+                break;
+
             // External interrupts
             case 0x09:
                 handle_mei();
@@ -124,8 +394,11 @@ trap_t* handle_interrupt(unsigned long long scause, trap_t* trap) {
     } else {
         switch (scause) {
             // User mode syscall
-            case 0x08:
-                trap->xs[PROCESS_REGISTER_A0] = user_syscall(
+            case 0x08: {
+                // Syscalls may sleep
+                process_t* process = fetch_process(trap->pid);
+                process->in_syscall = 1;
+                unsigned long long result = user_syscall(
                     trap->pid,
                     trap->xs[PROCESS_REGISTER_A7],
                     trap->xs[PROCESS_REGISTER_A0],
@@ -136,8 +409,57 @@ trap_t* handle_interrupt(unsigned long long scause, trap_t* trap) {
                     trap->xs[PROCESS_REGISTER_A5],
                     trap
                 );
+                process->in_syscall = 0;
+
+                // The frame belongs to the process, so it is still the right one if the process slept and continued on another hart
+                trap->xs[PROCESS_REGISTER_A0] = result;
                 trap->pc += 4;
                 break;
+            }
+
+            // Illegal instructions, which includes the first floating point instruction since the process was switched to
+            case 0x02: {
+                unsigned long long sstatus;
+                asm volatile("csrr %0, sstatus" : "=r" (sstatus));
+                if (!(sstatus & 0x100) && (sstatus & SSTATUS_FS) == SSTATUS_FS_OFF) {
+                    // Retry the instruction with the registers loaded
+                    load_process_fp(fetch_process(trap->pid), trap->hartid);
+                    break;
+                }
+
+                if (sstatus & 0x100) {
+                    console_printf("kernel illegal instruction at 0x%llx\n", trap->pc);
+                    while (1);
+                }
+
+                console_printf("Process %llu killed after illegal instruction (pc 0x%llx)\n", trap->pid, trap->pc);
+                kill_process(trap->pid);
+                sched_sleep();
+                break;
+            }
+
+            // Page faults
+            case PAGE_FAULT_INSTRUCTION:
+            case PAGE_FAULT_LOAD:
+            case PAGE_FAULT_STORE: {
+                unsigned long long stval;
+                unsigned long long sstatus;
+                asm volatile("csrr %0, stval" : "=r" (stval));
+                asm volatile("csrr %0, sstatus" : "=r" (sstatus));
+
+                // Faults in the kernel cannot be recovered from
+                if (sstatus & 0x100) {
+                    console_printf("kernel page fault at 0x%llx (scause 0x%llx)\n", stval, scause);
+                    while (1);
+                }
+
+                if (handle_page_fault(trap, scause, (void*) stval)) {
+                    console_printf("Process %llu killed after page fault at 0x%llx (pc 0x%llx)\n", trap->pid, stval, trap->pc);
+                    kill_process(trap->pid);
+                    sched_sleep();
+                }
+                break;
+            }
 
             default:
                 console_printf("unknown synchronous interrupt: 0x%llx\n", scause);
@@ -148,6 +470,7 @@ trap_t* handle_interrupt(unsigned long long scause, trap_t* trap) {
         }
     }
 
-    return trap;
+    kernel_lock_release(flags);
+    return current_trap();
 }
 
@@ -12,16 +12,24 @@
 
 extern unsigned long long PLIC_BASE;
 
-// Converts a hartid and supervisor/user mode pair into a context for the PLIC.
+// Converts a hartid and supervisor/user mode pair into a context for the PLIC. Only used if the device tree does not describe the PLIC's contexts.
 #define PLIC_CONTEXT(hartid, s) ((hartid) * 2 + (s))
 
-typedef struct {
-    unsigned long long hartid;
-    pid_t pid;
-    unsigned long long pc;
-    unsigned long long xs[32];
-    double fs[32];
-} trap_t;
+// Value of plic_contexts for harts without a supervisor mode context, and of an interrupt's route before it goes to a hart.
+#define PLIC_NONE ((unsigned long long) -1)
+
+// Interrupt number of supervisor external interrupts in a hart's local interrupt controller.
+#define PLIC_SUPERVISOR_EXTERNAL 9
+
+// Supervisor mode PLIC context of each hart, indexed by hart id.
+extern unsigned long long plic_contexts[];
+
+// States of the floating point unit as kept in the FS field of sstatus. Floating point instructions trap while it is off.
+#define SSTATUS_FS          0x6000
+#define SSTATUS_FS_OFF      0x0000
+#define SSTATUS_FS_INITIAL  0x2000
+#define SSTATUS_FS_CLEAN    0x4000
+#define SSTATUS_FS_DIRTY    0x6000
 
 // get_context_enable_bits(unsigned long long) -> volatile unsigned int*
 // Gets a volatile pointer to the interrupt enable bits for a given context.
@@ -35,13 +43,37 @@ volatile unsigned int* get_context_priority_threshold(unsigned long long context
 // Gets a volatile pointer to the interupt claim register for a given context.
 volatile unsigned int* get_context_claim_pointer(unsigned long long context);
 
+// plic_init(void*) -> void
+// Finds the PLIC in the device tree and works out which context takes each hart's supervisor external interrupts from its interrupts-extended property.
+void plic_init(void* fdt);
+
+// plic_init_hart(unsigned long long) -> void
+// Lets the PLIC interrupt a hart and rebalances device interrupts across every hart set up so far. Called with the kernel lock held on each hart as it starts.
+void plic_init_hart(unsigned long long hartid);
+
+// plic_set_affinity(unsigned int, unsigned long long) -> char
+// Pins an interrupt with a registered handler to a hart, or lets it be balanced again if the hart is PLIC_NONE. Returns 0 on success, 1 on failure.
+char plic_set_affinity(unsigned int mei_id, unsigned long long hartid);
+
 // register_mei_handler(unsigned int, unsigned char, void (*)(unsigned int, void*), void*) -> char
 // Registers a machine external interrupt with a given mei id, priority, and handler. If the priority is 0, then the interrupt is disabled. Returns 0 on successful registration, 1 on failure.
 char register_mei_handler(unsigned int mei_id, unsigned char priority, void (*mei_handler)(unsigned int, void*), void* callback_data);
 
-// swap_process(trap_t*) -> void
-// Swaps the current process with the next process in the queue.
-void swap_process(trap_t* trap);
+// save_process_trap(process_t*) -> void
+// Saves the state of a process that is switched away from that is not kept in its trap frame. Floating point registers are only saved if the process has written to them since they were loaded.
+void save_process_trap(process_t* process);
+
+// load_process_trap(process_t*) -> void
+// Points sscratch at the trap frame of a process so that leaving the trap continues the process and the next trap saves into it, and switches to its page table and kernel stack. Floating point registers are loaded once the process uses them.
+void load_process_trap(process_t* process);
+
+// swap_process(trap_t*) -> unsigned long long
+// Swaps the current process with the next process picked by the scheduler. Returns the length of the time slice of the process to run, or 0 if the hart is going idle.
+unsigned long long swap_process(trap_t* trap);
+
+// kernel_preempt_point() -> void
+// Marks a safe point in a long kernel path. Syscalls run with interrupts disabled, so this handles pending device interrupts and expired timers, and switches to another process if the time slice is over or a reschedule was asked for. Does nothing outside of syscalls or inside atomic sections.
+void kernel_preempt_point();
 
 #endif /* KERNEL_INTERRUPTS_H */
 
@@ -1,19 +1,190 @@
 .section .text
+.global interrupt_vector
 .global interrupt_handler
+.global kcontext_switch
+.global kcontext_trap_return
+.global fp_save
+.global fp_load
 .align 2
 
 /*
+Trap frame of the running process, pointed to by sscratch
 typedef struct {
     unsigned long long hartid;
     pid_t pid;
     unsigned long long pc;
     unsigned long long xs[32];
-    double fs[32];
+    void* isr_stack;
 } trap_t;
 */
+
+# Saves the registers the C calling convention does not preserve into the trap frame, switches to the kernel's sp and tp, and calls handler with the trap frame. The trap is taken again through interrupt_handler if it returns nonzero, and returned from otherwise.
+.macro interrupt_light handler
+    csrrw t6, sscratch, t6
+    sd x1,  0x020(t6)
+    sd x2,  0x028(t6)
+    sd x4,  0x038(t6)
+    sd x5,  0x040(t6)
+    sd x6,  0x048(t6)
+    sd x7,  0x050(t6)
+    sd x10, 0x068(t6)
+    sd x11, 0x070(t6)
+    sd x12, 0x078(t6)
+    sd x13, 0x080(t6)
+    sd x14, 0x088(t6)
+    sd x15, 0x090(t6)
+    sd x16, 0x098(t6)
+    sd x17, 0x0a0(t6)
+    sd x28, 0x0f8(t6)
+    sd x29, 0x100(t6)
+    sd x30, 0x108(t6)
+    csrr t5, sscratch
+    sd t5, 0x110(t6)
+    csrw sscratch, t6
+    ld sp, 0x118(t6)
+    ld tp, 0x000(t6)
+
+    mv a0, t6
+    jal \handler
+    csrr t6, sscratch
+    mv t5, a0
+
+    ld x1,  0x020(t6)
+    ld x2,  0x028(t6)
+    ld x4,  0x038(t6)
+    ld x5,  0x040(t6)
+    ld x6,  0x048(t6)
+    ld x7,  0x050(t6)
+    ld x10, 0x068(t6)
+    ld x11, 0x070(t6)
+    ld x12, 0x078(t6)
+    ld x13, 0x080(t6)
+    ld x14, 0x088(t6)
+    ld x15, 0x090(t6)
+    ld x16, 0x098(t6)
+    ld x17, 0x0a0(t6)
+    ld x28, 0x0f8(t6)
+    ld x29, 0x100(t6)
+    bnez t5, 1f
+    ld x30, 0x108(t6)
+    ld x31, 0x110(t6)
+    sret
+
+    # The full path saves t5 itself and expects the original t6 in sscratch
+1:
+    ld t5, 0x110(t6)
+    csrw sscratch, t5
+    ld t5, 0x108(t6)
+    j interrupt_save
+.endm
+
+# Vectored trap entry, installed in stvec with mode 1. Exceptions jump to the first entry and interrupts to the entry for their cause. Every entry is one uncompressed jump.
+.option push
+.option norvc
+.balign 256
+interrupt_vector:
+    j interrupt_handler         # Exceptions
+    j interrupt_software        # Supervisor software interrupt
+    j interrupt_handler
+    j interrupt_handler
+    j interrupt_handler
+    j interrupt_timer           # Supervisor timer interrupt
+    j interrupt_handler
+    j interrupt_handler
+    j interrupt_handler
+    j interrupt_external        # Supervisor external interrupt
+.option pop
+
+# Software interrupts always reschedule, so they go straight to the full save
+interrupt_software:
+    csrrw t6, sscratch, t6
+    j interrupt_save
+
+# Timer interrupts only need the full save once the time slice is over
+interrupt_timer:
+    interrupt_light handle_timer_interrupt
+
+# External interrupts never switch processes
+interrupt_external:
+    interrupt_light handle_external_interrupt
+
 interrupt_handler:
-    # Save registers
     csrrw t6, sscratch, t6
+
+    # Syscalls with a fast handler only save what the C calling convention does not preserve
+    sd t4, 0x100(t6)
+    sd t5, 0x108(t6)
+    csrr t5, scause
+    addi t5, t5, -8
+    bnez t5, interrupt_full
+
+    # SYSCALL_FAST_MAX in userspace/syscall.h
+    li t5, 128
+    bgeu a7, t5, interrupt_full
+    la t4, syscall_fast_table
+    slli t5, a7, 3
+    add t4, t4, t5
+    ld t4, 0(t4)
+    beqz t4, interrupt_full
+
+    # Save registers the handler may clobber and the ones replaced with the kernel's
+    sd x1,  0x020(t6)
+    sd x2,  0x028(t6)
+    sd x4,  0x038(t6)
+    sd x5,  0x040(t6)
+    sd x6,  0x048(t6)
+    sd x7,  0x050(t6)
+    sd x11, 0x070(t6)
+    sd x12, 0x078(t6)
+    sd x13, 0x080(t6)
+    sd x14, 0x088(t6)
+    sd x15, 0x090(t6)
+    sd x16, 0x098(t6)
+    sd x17, 0x0a0(t6)
+    sd x28, 0x0f8(t6)
+    csrr t5, sscratch
+    sd t5, 0x110(t6)
+    csrw sscratch, t6
+    ld sp, 0x118(t6)
+    ld tp, 0x000(t6)
+
+    # Arguments stay in a0-a5 and the trap frame goes in a6
+    mv a6, t6
+    jalr t4
+    csrr t6, sscratch
+
+    # Skip the ecall
+    csrr t5, sepc
+    addi t5, t5, 4
+    csrw sepc, t5
+
+    # Revert everything but a0, which holds the result
+    ld x1,  0x020(t6)
+    ld x2,  0x028(t6)
+    ld x4,  0x038(t6)
+    ld x5,  0x040(t6)
+    ld x6,  0x048(t6)
+    ld x7,  0x050(t6)
+    ld x11, 0x070(t6)
+    ld x12, 0x078(t6)
+    ld x13, 0x080(t6)
+    ld x14, 0x088(t6)
+    ld x15, 0x090(t6)
+    ld x16, 0x098(t6)
+    ld x17, 0x0a0(t6)
+    ld x28, 0x0f8(t6)
+    ld x29, 0x100(t6)
+    ld x30, 0x108(t6)
+    ld x31, 0x110(t6)
+    sret
+
+interrupt_full:
+    ld t4, 0x100(t6)
+    ld t5, 0x108(t6)
+
+# Saves every register with the trap frame in t6 and the original t6 in sscratch, and calls handle_interrupt
+interrupt_save:
+    # Save registers
     sd x0,  0x018(t6)
     sd x1,  0x020(t6)
     sd x2,  0x028(t6)
@@ -55,8 +226,11 @@ interrupt_handler:
     csrr t5, sepc
     sd t5, 0x010(t6)
 
-    # Init stack
-    la sp, isr_stack_end
+    # Init stack; each hart has its own
+    ld sp, 0x118(t6)
+
+    # The kernel keeps the hart id in tp
+    ld tp, 0x000(t6)
 
     # Call interrupt handler
     csrr a0, scause
@@ -64,6 +238,8 @@ interrupt_handler:
     jal handle_interrupt
     mv t6, a0
 
+# Leaves a trap with the registers in the trap structure in t6
+interrupt_return:
     # Revert pc
     ld t5, 0x010(t6)
     csrw sepc, t5
@@ -103,6 +279,129 @@ interrupt_handler:
     ld x31, 0x110(t6)
     sret
 
+# kcontext_switch(kcontext_t*, kcontext_t*) -> void
+# Saves the callee saved registers of the current kernel context and continues another kernel context.
+kcontext_switch:
+    sd ra,  0x00(a0)
+    sd sp,  0x08(a0)
+    sd s0,  0x10(a0)
+    sd s1,  0x18(a0)
+    sd s2,  0x20(a0)
+    sd s3,  0x28(a0)
+    sd s4,  0x30(a0)
+    sd s5,  0x38(a0)
+    sd s6,  0x40(a0)
+    sd s7,  0x48(a0)
+    sd s8,  0x50(a0)
+    sd s9,  0x58(a0)
+    sd s10, 0x60(a0)
+    sd s11, 0x68(a0)
+
+    ld ra,  0x00(a1)
+    ld sp,  0x08(a1)
+    ld s0,  0x10(a1)
+    ld s1,  0x18(a1)
+    ld s2,  0x20(a1)
+    ld s3,  0x28(a1)
+    ld s4,  0x30(a1)
+    ld s5,  0x38(a1)
+    ld s6,  0x40(a1)
+    ld s7,  0x48(a1)
+    ld s8,  0x50(a1)
+    ld s9,  0x58(a1)
+    ld s10, 0x60(a1)
+    ld s11, 0x68(a1)
+    ret
+
+# Kernel contexts that continue a process that is not sleeping inside the kernel start here
+kcontext_trap_return:
+    jal sched_trap_return
+    mv t6, a0
+    j interrupt_return
+
+# The kernel is built without the floating point extensions, so they are only enabled for saving and restoring process registers
+.option push
+.option arch, +d
+
+# fp_save(double*) -> void
+# Saves the floating point registers followed by fcsr. The floating point unit must be on.
+fp_save:
+    fsd f0, 0x000(a0)
+    fsd f1, 0x008(a0)
+    fsd f2, 0x010(a0)
+    fsd f3, 0x018(a0)
+    fsd f4, 0x020(a0)
+    fsd f5, 0x028(a0)
+    fsd f6, 0x030(a0)
+    fsd f7, 0x038(a0)
+    fsd f8, 0x040(a0)
+    fsd f9, 0x048(a0)
+    fsd f10, 0x050(a0)
+    fsd f11, 0x058(a0)
+    fsd f12, 0x060(a0)
+    fsd f13, 0x068(a0)
+    fsd f14, 0x070(a0)
+    fsd f15, 0x078(a0)
+    fsd f16, 0x080(a0)
+    fsd f17, 0x088(a0)
+    fsd f18, 0x090(a0)
+    fsd f19, 0x098(a0)
+    fsd f20, 0x0a0(a0)
+    fsd f21, 0x0a8(a0)
+    fsd f22, 0x0b0(a0)
+    fsd f23, 0x0b8(a0)
+    fsd f24, 0x0c0(a0)
+    fsd f25, 0x0c8(a0)
+    fsd f26, 0x0d0(a0)
+    fsd f27, 0x0d8(a0)
+    fsd f28, 0x0e0(a0)
+    fsd f29, 0x0e8(a0)
+    fsd f30, 0x0f0(a0)
+    fsd f31, 0x0f8(a0)
+    frcsr t0
+    sd t0, 0x100(a0)
+    ret
+
+# fp_load(double*) -> void
+# Loads the floating point registers followed by fcsr. The floating point unit must be on.
+fp_load:
+    fld f0, 0x000(a0)
+    fld f1, 0x008(a0)
+    fld f2, 0x010(a0)
+    fld f3, 0x018(a0)
+    fld f4, 0x020(a0)
+    fld f5, 0x028(a0)
+    fld f6, 0x030(a0)
+    fld f7, 0x038(a0)
+    fld f8, 0x040(a0)
+    fld f9, 0x048(a0)
+    fld f10, 0x050(a0)
+    fld f11, 0x058(a0)
+    fld f12, 0x060(a0)
+    fld f13, 0x068(a0)
+    fld f14, 0x070(a0)
+    fld f15, 0x078(a0)
+    fld f16, 0x080(a0)
+    fld f17, 0x088(a0)
+    fld f18, 0x090(a0)
+    fld f19, 0x098(a0)
+    fld f20, 0x0a0(a0)
+    fld f21, 0x0a8(a0)
+    fld f22, 0x0b0(a0)
+    fld f23, 0x0b8(a0)
+    fld f24, 0x0c0(a0)
+    fld f25, 0x0c8(a0)
+    fld f26, 0x0d0(a0)
+    fld f27, 0x0d8(a0)
+    fld f28, 0x0e0(a0)
+    fld f29, 0x0e8(a0)
+    fld f30, 0x0f0(a0)
+    fld f31, 0x0f8(a0)
+    ld t0, 0x100(a0)
+    fscsr t0
+    ret
+.option pop
+
 
 # Stack stuff
 .section .bss
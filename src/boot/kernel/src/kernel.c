@@ -10,14 +10,20 @@
 #include "lib/memory.h"
 #include "lib/string.h"
 #include "opensbi.h"
+#include "smp.h"
 #include "userspace/elffile.h"
 #include "userspace/process.h"
+#include "userspace/ksm.h"
 #include "userspace/mmu.h"
+#include "userspace/swap.h"
+#include "userspace/timer.h"
+#include "userspace/vdso.h"
+#include "userspace/workingset.h"
 
 #define ROOT_DISC "/dev/virt-blk7"
+#define SWAP_DISC "/dev/virt-blk5"
 
 generic_file_t* root;
-trap_t trap_structs[32];
 
 void kinit(unsigned long long hartid, void* fdt) {
     fdt_t devicetree = verify_fdt(fdt);
@@ -40,19 +46,14 @@ void kinit(unsigned long long hartid, void* fdt) {
         .write_char = console_generic_file_write
     };
 
-    // Create trap structure
-    trap_structs[hartid] = (trap_t) {
-        .hartid = hartid,
-        .pid = 0,
-        .pc = 0,
-        .xs = { 0 },
-        .fs = { 0.0 }
-    };
-    trap_t* trap = &trap_structs[hartid];
-    asm volatile("csrw sscratch, %0" : "=r" (trap));
+    // Create trap structure and find the other harts
+    smp_init(hartid, fdt);
+    init_timers(fdt);
 
     // Initialise process table
     init_process_table();
+    init_workingset();
+    init_ksm();
 
     // Initialise root and /dev file system
     root = malloc(sizeof(generic_file_t));
@@ -78,18 +79,22 @@ void kinit(unsigned long long hartid, void* fdt) {
     // Probe for available virtio devices
     virtio_probe(dev);
 
+    // Set up compressed swap, backed by the swap disc if there is one
+    struct s_dir_entry swap = generic_dir_lookup(root, SWAP_DISC);
+    generic_block_t* swap_block = (void*) 0;
+    if (swap.file != (void*) 0 && swap.file->type == GENERIC_FILE_TYPE_BLOCK)
+        swap_block = swap.file->block;
+    if (init_swap(swap_block))
+        console_puts("No swap available\n");
+
     // Register file systems
     register_fs_mounter(ext2_mount);
 
-    // Enable all interrupts in the PLIC
-    volatile unsigned int* enables = get_context_enable_bits(PLIC_CONTEXT(hartid, 1));
-    for (unsigned int i = 0; i < (PLIC_COUNT + 1) / 32; i++) {
-        enables[i] = 0xffffffff;
-    }
+    // Let the PLIC interrupt this hart; device interrupts are spread out further as the other harts start
+    plic_init_hart(hartid);
 
-    // Set priority threshold
-    volatile unsigned int* threshold = get_context_priority_threshold(PLIC_CONTEXT(hartid, 1));
-    *threshold = 0;
+    // Let the vdso read the time CSR from user mode
+    vdso_init_hart();
 
     // Enable interrupts in the hart
     unsigned long long t = 0x202;
@@ -131,17 +136,14 @@ void kmain() {
     }
     */
 
-    // MMU is definitely enabled here, so get page table and mark all nonmeta entries as global
-    unsigned long long mmu;
-    mmu_level_1_t* top = (void*) 0;
-    asm volatile("csrr %0, satp" : "=r" (mmu));
-    top = (void*) ((mmu & 0x00000fffffffffff) << 12);
-    make_all_global(top);
-
     // Load /sbin/init
     elf_t init = load_executable_elf_from_file(root, "/sbin/init");
     pid_t initd = load_elf_as_process(1, &init, 1);
     free_elf(&init);
+    if (initd == 0) {
+        console_puts("Failed to create init process\n");
+        while (1);
+    }
     process_t* initd_process = fetch_process(initd);
 
     // Set up stdin, stdout, and stderr
@@ -161,20 +163,25 @@ void kmain() {
         .fs = &console_fs
     };
 
-    // Load the new page table and clean up the old page table
+    // Load the new page table; the kernel page table stays around for future processes
     process_init_kernel_mmu(initd);
-    clean_mmu_mappings(top, 0);
-    mmu_level_1_t* new_top = initd_process->mmu_data;
-    mmu = 0x8000000000000000 | (((unsigned long long) new_top) >> 12);
-    asm volatile("csrw satp, %0" : "=r" (mmu));
-    asm volatile("sfence.vma");
+    mmu_switch_top(initd_process->mmu_data);
+
+    // Start the other harts; they idle until there is something to run
+    smp_start_harts();
 
     // Queue init process
+    unsigned long long flags = kernel_lock_acquire();
     add_process_to_queue(initd);
+    kernel_lock_release(flags);
     console_puts("Loaded initd.\n");
-    sbi_set_timer(0);
+    timer_program(0);
     unsigned long long t = 0x222;
     asm volatile("csrs sie, %0" : "=r" (t));
-    while (1);
+
+    // This context becomes the idle process of the boot hart
+    while (1) {
+        asm volatile("wfi");
+    }
 }
 
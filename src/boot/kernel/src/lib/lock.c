@@ -0,0 +1,301 @@
+#include "lock.h"
+
+// atomic_add_w(volatile unsigned int*, unsigned int) -> unsigned int
+// Atomically adds to a word. Returns the old value.
+static inline unsigned int atomic_add_w(volatile unsigned int* ptr, unsigned int value) {
+    unsigned int old;
+    asm volatile("amoadd.w.aqrl %0, %2, (%1)" : "=r" (old) : "r" (ptr), "r" (value) : "memory");
+    return old;
+}
+
+// atomic_add_d(volatile unsigned long long*, unsigned long long) -> unsigned long long
+// Atomically adds to a double word. Returns the old value.
+static inline unsigned long long atomic_add_d(volatile unsigned long long* ptr, unsigned long long value) {
+    unsigned long long old;
+    asm volatile("amoadd.d %0, %2, (%1)" : "=r" (old) : "r" (ptr), "r" (value) : "memory");
+    return old;
+}
+
+// atomic_swap_ptr(void* volatile*, void*) -> void*
+// Atomically swaps a pointer. Returns the old value.
+static inline void* atomic_swap_ptr(void* volatile* ptr, void* value) {
+    void* old;
+    asm volatile("amoswap.d.aqrl %0, %2, (%1)" : "=r" (old) : "r" (ptr), "r" (value) : "memory");
+    return old;
+}
+
+// atomic_cas_w(volatile int*, int, int) -> int
+// Atomically replaces a word with desired if it equals expected. Returns the old value.
+static inline int atomic_cas_w(volatile int* ptr, int expected, int desired) {
+    int old;
+    unsigned long long fail;
+    asm volatile(
+        "1: lr.w.aqrl %0, (%2)\n"
+        "   bne %0, %3, 2f\n"
+        "   sc.w.rl %1, %4, (%2)\n"
+        "   bnez %1, 1b\n"
+        "2:"
+        : "=&r" (old), "=&r" (fail)
+        : "r" (ptr), "r" (expected), "r" (desired)
+        : "memory"
+    );
+    return old;
+}
+
+// atomic_cas_ptr(void* volatile*, void*, void*) -> void*
+// Atomically replaces a pointer with desired if it equals expected. Returns the old value.
+static inline void* atomic_cas_ptr(void* volatile* ptr, void* expected, void* desired) {
+    void* old;
+    unsigned long long fail;
+    asm volatile(
+        "1: lr.d.aqrl %0, (%2)\n"
+        "   bne %0, %3, 2f\n"
+        "   sc.d.rl %1, %4, (%2)\n"
+        "   bnez %1, 1b\n"
+        "2:"
+        : "=&r" (old), "=&r" (fail)
+        : "r" (ptr), "r" (expected), "r" (desired)
+        : "memory"
+    );
+    return old;
+}
+
+// Orders the loads that saw a lock as free before the critical section.
+#define LOCK_ACQUIRE_FENCE() asm volatile("fence r, rw" : : : "memory")
+
+// Orders the critical section before the store that frees a lock.
+#define LOCK_RELEASE_FENCE() asm volatile("fence rw, w" : : : "memory")
+
+// lock_stats_acquired(lock_stats_t*, unsigned long long) -> void
+// Counts an acquisition by the hart now holding the lock.
+static inline void lock_stats_acquired(lock_stats_t* stats, unsigned long long spins) {
+#ifdef LOCK_STATS
+    stats->acquisitions++;
+    if (spins != 0) {
+        stats->contentions++;
+        stats->spins += spins;
+    }
+    asm volatile("csrr %0, time" : "=r" (stats->acquired_at));
+#else
+    (void) stats;
+    (void) spins;
+#endif
+}
+
+// lock_stats_released(lock_stats_t*) -> void
+// Adds the time since the lock was acquired to its hold time. Called before the lock is released.
+static inline void lock_stats_released(lock_stats_t* stats) {
+#ifdef LOCK_STATS
+    unsigned long long time;
+    asm volatile("csrr %0, time" : "=r" (time));
+    unsigned long long held = time - stats->acquired_at;
+    stats->hold_time += held;
+    if (held > stats->max_hold_time)
+        stats->max_hold_time = held;
+#else
+    (void) stats;
+#endif
+}
+
+// lock_stats_shared(lock_stats_t*, unsigned long long) -> void
+// Counts an acquisition by a reader, which may happen alongside other readers. Hold times are only kept for writers.
+static inline void lock_stats_shared(lock_stats_t* stats, unsigned long long spins) {
+#ifdef LOCK_STATS
+    atomic_add_d(&stats->acquisitions, 1);
+    if (spins != 0) {
+        atomic_add_d(&stats->contentions, 1);
+        atomic_add_d(&stats->spins, spins);
+    }
+#else
+    (void) stats;
+    (void) spins;
+#endif
+}
+
+// lock_irq_save() -> unsigned long long
+// Disables interrupts on this hart and returns whether they were enabled.
+unsigned long long lock_irq_save() {
+    unsigned long long sstatus;
+    asm volatile("csrrci %0, sstatus, 2" : "=r" (sstatus) : : "memory");
+    return sstatus & 2;
+}
+
+// lock_irq_restore(unsigned long long) -> void
+// Restores interrupts on this hart to the state returned by lock_irq_save().
+void lock_irq_restore(unsigned long long flags) {
+    if (flags & 2)
+        asm volatile("csrsi sstatus, 2" : : : "memory");
+}
+
+// spinlock_acquire(spinlock_t*) -> void
+// Acquires a ticket spinlock.
+void spinlock_acquire(spinlock_t* lock) {
+    unsigned int ticket = atomic_add_w(&lock->next, 1);
+    unsigned long long spins = 0;
+    while (lock->owner != ticket)
+        spins++;
+    LOCK_ACQUIRE_FENCE();
+    lock_stats_acquired(&lock->stats, spins);
+}
+
+// spinlock_try_acquire(spinlock_t*) -> char
+// Acquires a ticket spinlock if it is free. Returns 0 if the lock was acquired.
+char spinlock_try_acquire(spinlock_t* lock) {
+    // Both counters are taken together so that the ticket is only taken if it would be served right away
+    unsigned int owner = lock->owner;
+    if (lock->next != owner)
+        return -1;
+    if ((unsigned int) atomic_cas_w((volatile int*) &lock->next, owner, owner + 1) != owner)
+        return -1;
+    LOCK_ACQUIRE_FENCE();
+    lock_stats_acquired(&lock->stats, 0);
+    return 0;
+}
+
+// spinlock_release(spinlock_t*) -> void
+// Releases a ticket spinlock.
+void spinlock_release(spinlock_t* lock) {
+    lock_stats_released(&lock->stats);
+    LOCK_RELEASE_FENCE();
+    lock->owner = lock->owner + 1;
+}
+
+// spinlock_acquire_irqsave(spinlock_t*) -> unsigned long long
+// Disables interrupts and acquires a ticket spinlock. Returns the interrupt state to pass to spinlock_release_irqrestore().
+unsigned long long spinlock_acquire_irqsave(spinlock_t* lock) {
+    unsigned long long flags = lock_irq_save();
+    spinlock_acquire(lock);
+    return flags;
+}
+
+// spinlock_release_irqrestore(spinlock_t*, unsigned long long) -> void
+// Releases a ticket spinlock and restores interrupts.
+void spinlock_release_irqrestore(spinlock_t* lock, unsigned long long flags) {
+    spinlock_release(lock);
+    lock_irq_restore(flags);
+}
+
+// mcs_lock_acquire(mcs_lock_t*, mcs_node_t*) -> void
+// Acquires an MCS lock, queueing the given node. The node must stay alive until the lock is released.
+void mcs_lock_acquire(mcs_lock_t* lock, mcs_node_t* node) {
+    node->next = (void*) 0;
+    node->locked = 1;
+
+    mcs_node_t* prev = atomic_swap_ptr((void* volatile*) &lock->tail, node);
+    unsigned long long spins = 0;
+    if (prev != (void*) 0) {
+        // Wait for the previous holder to hand the lock over
+        prev->next = node;
+        while (node->locked)
+            spins++;
+    }
+
+    LOCK_ACQUIRE_FENCE();
+    lock_stats_acquired(&lock->stats, spins);
+}
+
+// mcs_lock_release(mcs_lock_t*, mcs_node_t*) -> void
+// Releases an MCS lock acquired with the given node and hands it to the next waiting hart.
+void mcs_lock_release(mcs_lock_t* lock, mcs_node_t* node) {
+    lock_stats_released(&lock->stats);
+
+    if (node->next == (void*) 0) {
+        // Nobody is waiting if this is still the tail
+        if (atomic_cas_ptr((void* volatile*) &lock->tail, node, (void*) 0) == node)
+            return;
+
+        // Someone is in the middle of queueing behind this node
+        while (node->next == (void*) 0);
+    }
+
+    LOCK_RELEASE_FENCE();
+    node->next->locked = 0;
+}
+
+// mcs_lock_acquire_irqsave(mcs_lock_t*, mcs_node_t*) -> unsigned long long
+// Disables interrupts and acquires an MCS lock. Returns the interrupt state to pass to mcs_lock_release_irqrestore().
+unsigned long long mcs_lock_acquire_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+    unsigned long long flags = lock_irq_save();
+    mcs_lock_acquire(lock, node);
+    return flags;
+}
+
+// mcs_lock_release_irqrestore(mcs_lock_t*, mcs_node_t*, unsigned long long) -> void
+// Releases an MCS lock and restores interrupts.
+void mcs_lock_release_irqrestore(mcs_lock_t* lock, mcs_node_t* node, unsigned long long flags) {
+    mcs_lock_release(lock, node);
+    lock_irq_restore(flags);
+}
+
+// rwlock_read_acquire(rwlock_t*) -> void
+// Acquires a reader-writer lock for reading.
+void rwlock_read_acquire(rwlock_t* lock) {
+    // The state is the number of readers, or -1 while a writer holds the lock
+    unsigned long long spins = 0;
+    while (1) {
+        int state = lock->state;
+        if (state >= 0 && lock->writers_waiting == 0 && atomic_cas_w(&lock->state, state, state + 1) == state)
+            break;
+        spins++;
+    }
+
+    LOCK_ACQUIRE_FENCE();
+    lock_stats_shared(&lock->stats, spins);
+}
+
+// rwlock_read_release(rwlock_t*) -> void
+// Releases a reader-writer lock held for reading.
+void rwlock_read_release(rwlock_t* lock) {
+    atomic_add_w((volatile unsigned int*) &lock->state, -1);
+}
+
+// rwlock_write_acquire(rwlock_t*) -> void
+// Acquires a reader-writer lock for writing.
+void rwlock_write_acquire(rwlock_t* lock) {
+    atomic_add_w(&lock->writers_waiting, 1);
+    unsigned long long spins = 0;
+    while (lock->state != 0 || atomic_cas_w(&lock->state, 0, -1) != 0)
+        spins++;
+    atomic_add_w(&lock->writers_waiting, -1);
+
+    LOCK_ACQUIRE_FENCE();
+    lock_stats_acquired(&lock->stats, spins);
+}
+
+// rwlock_write_release(rwlock_t*) -> void
+// Releases a reader-writer lock held for writing.
+void rwlock_write_release(rwlock_t* lock) {
+    lock_stats_released(&lock->stats);
+    LOCK_RELEASE_FENCE();
+    lock->state = 0;
+}
+
+// rwlock_read_acquire_irqsave(rwlock_t*) -> unsigned long long
+// Disables interrupts and acquires a reader-writer lock for reading. Returns the interrupt state to pass to rwlock_read_release_irqrestore().
+unsigned long long rwlock_read_acquire_irqsave(rwlock_t* lock) {
+    unsigned long long flags = lock_irq_save();
+    rwlock_read_acquire(lock);
+    return flags;
+}
+
+// rwlock_read_release_irqrestore(rwlock_t*, unsigned long long) -> void
+// Releases a reader-writer lock held for reading and restores interrupts.
+void rwlock_read_release_irqrestore(rwlock_t* lock, unsigned long long flags) {
+    rwlock_read_release(lock);
+    lock_irq_restore(flags);
+}
+
+// rwlock_write_acquire_irqsave(rwlock_t*) -> unsigned long long
+// Disables interrupts and acquires a reader-writer lock for writing. Returns the interrupt state to pass to rwlock_write_release_irqrestore().
+unsigned long long rwlock_write_acquire_irqsave(rwlock_t* lock) {
+    unsigned long long flags = lock_irq_save();
+    rwlock_write_acquire(lock);
+    return flags;
+}
+
+// rwlock_write_release_irqrestore(rwlock_t*, unsigned long long) -> void
+// Releases a reader-writer lock held for writing and restores interrupts.
+void rwlock_write_release_irqrestore(rwlock_t* lock, unsigned long long flags) {
+    rwlock_write_release(lock);
+    lock_irq_restore(flags);
+}
@@ -0,0 +1,119 @@
+#ifndef KERNEL_LOCK_H
+#define KERNEL_LOCK_H
+
+// Uncomment to count acquisitions, contention, and hold times on every lock.
+//#define LOCK_STATS
+
+// Contention and hold time counters. Times are in ticks of the time CSR. Only updated if LOCK_STATS is defined.
+typedef struct {
+    unsigned long long acquisitions;
+    unsigned long long contentions;
+    unsigned long long spins;
+    unsigned long long hold_time;
+    unsigned long long max_hold_time;
+    unsigned long long acquired_at;
+} lock_stats_t;
+
+// A ticket spinlock. Harts get the lock in the order they asked for it. Zero initialised locks are unlocked.
+typedef struct {
+    volatile unsigned int next;
+    volatile unsigned int owner;
+    lock_stats_t stats;
+} spinlock_t;
+
+// A node in an MCS lock's queue. Each waiting hart spins on its own node, which normally lives on its stack.
+typedef struct s_mcs_node {
+    struct s_mcs_node* volatile next;
+    volatile unsigned int locked;
+} mcs_node_t;
+
+// An MCS queue lock. Zero initialised locks are unlocked.
+typedef struct {
+    mcs_node_t* volatile tail;
+    lock_stats_t stats;
+} mcs_lock_t;
+
+// A reader-writer spinlock. Waiting writers keep new readers out so that they cannot be starved. Zero initialised locks are unlocked.
+typedef struct {
+    volatile int state;
+    volatile unsigned int writers_waiting;
+    lock_stats_t stats;
+} rwlock_t;
+
+// lock_irq_save() -> unsigned long long
+// Disables interrupts on this hart and returns whether they were enabled.
+unsigned long long lock_irq_save();
+
+// lock_irq_restore(unsigned long long) -> void
+// Restores interrupts on this hart to the state returned by lock_irq_save().
+void lock_irq_restore(unsigned long long flags);
+
+// spinlock_acquire(spinlock_t*) -> void
+// Acquires a ticket spinlock.
+void spinlock_acquire(spinlock_t* lock);
+
+// spinlock_try_acquire(spinlock_t*) -> char
+// Acquires a ticket spinlock if it is free. Returns 0 if the lock was acquired.
+char spinlock_try_acquire(spinlock_t* lock);
+
+// spinlock_release(spinlock_t*) -> void
+// Releases a ticket spinlock.
+void spinlock_release(spinlock_t* lock);
+
+// spinlock_acquire_irqsave(spinlock_t*) -> unsigned long long
+// Disables interrupts and acquires a ticket spinlock. Returns the interrupt state to pass to spinlock_release_irqrestore().
+unsigned long long spinlock_acquire_irqsave(spinlock_t* lock);
+
+// spinlock_release_irqrestore(spinlock_t*, unsigned long long) -> void
+// Releases a ticket spinlock and restores interrupts.
+void spinlock_release_irqrestore(spinlock_t* lock, unsigned long long flags);
+
+// mcs_lock_acquire(mcs_lock_t*, mcs_node_t*) -> void
+// Acquires an MCS lock, queueing the given node. The node must stay alive until the lock is released.
+void mcs_lock_acquire(mcs_lock_t* lock, mcs_node_t* node);
+
+// mcs_lock_release(mcs_lock_t*, mcs_node_t*) -> void
+// Releases an MCS lock acquired with the given node and hands it to the next waiting hart.
+void mcs_lock_release(mcs_lock_t* lock, mcs_node_t* node);
+
+// mcs_lock_acquire_irqsave(mcs_lock_t*, mcs_node_t*) -> unsigned long long
+// Disables interrupts and acquires an MCS lock. Returns the interrupt state to pass to mcs_lock_release_irqrestore().
+unsigned long long mcs_lock_acquire_irqsave(mcs_lock_t* lock, mcs_node_t* node);
+
+// mcs_lock_release_irqrestore(mcs_lock_t*, mcs_node_t*, unsigned long long) -> void
+// Releases an MCS lock and restores interrupts.
+void mcs_lock_release_irqrestore(mcs_lock_t* lock, mcs_node_t* node, unsigned long long flags);
+
+// rwlock_read_acquire(rwlock_t*) -> void
+// Acquires a reader-writer lock for reading.
+void rwlock_read_acquire(rwlock_t* lock);
+
+// rwlock_read_release(rwlock_t*) -> void
+// Releases a reader-writer lock held for reading.
+void rwlock_read_release(rwlock_t* lock);
+
+// rwlock_write_acquire(rwlock_t*) -> void
+// Acquires a reader-writer lock for writing.
+void rwlock_write_acquire(rwlock_t* lock);
+
+// rwlock_write_release(rwlock_t*) -> void
+// Releases a reader-writer lock held for writing.
+void rwlock_write_release(rwlock_t* lock);
+
+// rwlock_read_acquire_irqsave(rwlock_t*) -> unsigned long long
+// Disables interrupts and acquires a reader-writer lock for reading. Returns the interrupt state to pass to rwlock_read_release_irqrestore().
+unsigned long long rwlock_read_acquire_irqsave(rwlock_t* lock);
+
+// rwlock_read_release_irqrestore(rwlock_t*, unsigned long long) -> void
+// Releases a reader-writer lock held for reading and restores interrupts.
+void rwlock_read_release_irqrestore(rwlock_t* lock, unsigned long long flags);
+
+// rwlock_write_acquire_irqsave(rwlock_t*) -> unsigned long long
+// Disables interrupts and acquires a reader-writer lock for writing. Returns the interrupt state to pass to rwlock_write_release_irqrestore().
+unsigned long long rwlock_write_acquire_irqsave(rwlock_t* lock);
+
+// rwlock_write_release_irqrestore(rwlock_t*, unsigned long long) -> void
+// Releases a reader-writer lock held for writing and restores interrupts.
+void rwlock_write_release_irqrestore(rwlock_t* lock, unsigned long long flags);
+
+#endif /* KERNEL_LOCK_H */
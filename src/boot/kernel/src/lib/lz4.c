@@ -0,0 +1,172 @@
+#include "lz4.h"
+#include "memory.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_BITS 12
+
+// The last five bytes are always literals and the last match must start at least twelve bytes before the end.
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+
+// Most recent position of each hashed sequence of four bytes
+static unsigned short lz4_table[1 << LZ4_HASH_BITS];
+
+// lz4_read32(const unsigned char*) -> unsigned int
+// Reads four bytes as a little endian integer.
+static unsigned int lz4_read32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+// lz4_hash(unsigned int) -> unsigned int
+// Hashes four bytes into an index into the position table.
+static unsigned int lz4_hash(unsigned int sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// lz4_write_length(unsigned char*, unsigned long int) -> unsigned char*
+// Writes the extra bytes of a literal or match length. Returns the new output pointer.
+static unsigned char* lz4_write_length(unsigned char* op, unsigned long int length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// lz4_write_literals(unsigned char*, unsigned char*, const unsigned char*, unsigned long int) -> unsigned char*
+// Writes a token and a run of literals. Returns the new output pointer, or null if it does not fit.
+static unsigned char* lz4_write_literals(unsigned char* op, unsigned char* oend, const unsigned char* literals, unsigned long int length) {
+    if ((unsigned long int) (oend - op) < 1 + length / 255 + 1 + length)
+        return (void*) 0;
+
+    *op++ = (length >= 15 ? 15 : length) << 4;
+    if (length >= 15)
+        op = lz4_write_length(op, length - 15);
+    memcpy(op, literals, length);
+    return op + length;
+}
+
+// lz4_compress(const void*, unsigned long int, void*, unsigned long int) -> unsigned long int
+// Compresses a buffer of at most 64 KiB into the LZ4 block format. Returns the compressed size, or 0 if it does not fit in the destination.
+unsigned long int lz4_compress(const void* source, unsigned long int size, void* dest, unsigned long int capacity) {
+    const unsigned char* src = source;
+    unsigned char* op = dest;
+    unsigned char* oend = op + capacity;
+    unsigned long int anchor = 0;
+
+    if (size > 0xffff)
+        return 0;
+    memset(lz4_table, 0, sizeof(lz4_table));
+
+    // Greedily take the first match found for each position
+    if (size > LZ4_MATCH_LIMIT) {
+        unsigned long int limit = size - LZ4_MATCH_LIMIT;
+        unsigned long int ip = 0;
+        while (ip < limit) {
+            unsigned int sequence = lz4_read32(src + ip);
+            unsigned int h = lz4_hash(sequence);
+            unsigned long int candidate = lz4_table[h];
+            lz4_table[h] = ip;
+
+            if (candidate >= ip || lz4_read32(src + candidate) != sequence) {
+                ip++;
+                continue;
+            }
+
+            unsigned long int length = LZ4_MIN_MATCH;
+            while (ip + length < size - LZ4_LAST_LITERALS && src[candidate + length] == src[ip + length]) {
+                length++;
+            }
+
+            // Literals since the last match, then the match itself
+            unsigned char* token = op;
+            op = lz4_write_literals(op, oend, src + anchor, ip - anchor);
+            if (op == (void*) 0 || (unsigned long int) (oend - op) < 2 + (length - LZ4_MIN_MATCH) / 255 + 1)
+                return 0;
+
+            unsigned long int offset = ip - candidate;
+            *op++ = offset;
+            *op++ = offset >> 8;
+
+            unsigned long int extra = length - LZ4_MIN_MATCH;
+            *token |= extra >= 15 ? 15 : extra;
+            if (extra >= 15)
+                op = lz4_write_length(op, extra - 15);
+
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_write_literals(op, oend, src + anchor, size - anchor);
+    if (op == (void*) 0)
+        return 0;
+    return op - (unsigned char*) dest;
+}
+
+// lz4_decompress(const void*, unsigned long int, void*, unsigned long int) -> long int
+// Decompresses an LZ4 block. Returns the decompressed size, or -1 if the block is malformed or does not fit in the destination.
+long int lz4_decompress(const void* source, unsigned long int size, void* dest, unsigned long int capacity) {
+    const unsigned char* ip = source;
+    const unsigned char* iend = ip + size;
+    unsigned char* op = dest;
+    unsigned char* oend = op + capacity;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        // Literals
+        unsigned long int length = token >> 4;
+        if (length == 15) {
+            unsigned char byte;
+            do {
+                if (ip >= iend)
+                    return -1;
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+        }
+
+        if (length > (unsigned long int) (iend - ip) || length > (unsigned long int) (oend - op))
+            return -1;
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        // Match
+        if (iend - ip < 2)
+            return -1;
+        unsigned long int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned long int) (op - (unsigned char*) dest))
+            return -1;
+
+        length = token & 15;
+        if (length == 15) {
+            unsigned char byte;
+            do {
+                if (ip >= iend)
+                    return -1;
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+        }
+        length += LZ4_MIN_MATCH;
+
+        if (length > (unsigned long int) (oend - op))
+            return -1;
+
+        // Matches may overlap the output, so copy byte by byte
+        unsigned char* match = op - offset;
+        for (unsigned long int i = 0; i < length; i++) {
+            op[i] = match[i];
+        }
+        op += length;
+    }
+
+    return op - (unsigned char*) dest;
+}
@@ -0,0 +1,12 @@
+#ifndef KERNEL_LZ4_H
+#define KERNEL_LZ4_H
+
+// lz4_compress(const void*, unsigned long int, void*, unsigned long int) -> unsigned long int
+// Compresses a buffer of at most 64 KiB into the LZ4 block format. Returns the compressed size, or 0 if it does not fit in the destination.
+unsigned long int lz4_compress(const void* source, unsigned long int size, void* dest, unsigned long int capacity);
+
+// lz4_decompress(const void*, unsigned long int, void*, unsigned long int) -> long int
+// Decompresses an LZ4 block. Returns the decompressed size, or -1 if the block is malformed or does not fit in the destination.
+long int lz4_decompress(const void* source, unsigned long int size, void* dest, unsigned long int capacity);
+
+#endif /* KERNEL_LZ4_H */
@@ -1,5 +1,6 @@
 #include "memory.h"
-#include "../userspace/mmu.h"
+#include "lock.h"
+#include "../smp.h"
 #include "../drivers/console/console.h"
 #include "../drivers/devicetree/tree.h"
 
@@ -14,19 +15,47 @@ struct s_malloc_pointer_header {
 // Represents a page.
 typedef unsigned char page_t[PAGE_SIZE];
 
+// Number of malloc size classes, from 16 to 512 bytes.
+#define MALLOC_BUCKET_COUNT 6
+
+// Objects a hart caches per size class before returning a batch to the depot.
+#define MALLOC_MAGAZINE_SIZE 64
+
+// Objects moved between a hart's magazine and the depot at a time.
+#define MALLOC_BATCH 32
+
+// Free objects shared by all harts for each size class. Harts only come here to refill or drain their magazines.
 struct {
-    struct s_malloc_pointer_header* bucket_16;
-    struct s_malloc_pointer_header* bucket_32;
-    struct s_malloc_pointer_header* bucket_64;
-    struct s_malloc_pointer_header* bucket_128;
-    struct s_malloc_pointer_header* bucket_256;
-    struct s_malloc_pointer_header* bucket_512;
+    struct s_malloc_pointer_header* buckets[MALLOC_BUCKET_COUNT];
 } global_allocator = { 0 };
 
+// Protects the depot
+spinlock_t malloc_lock = { 0 };
+
+// Free objects cached by a hart for a size class. Only touched by its own hart with interrupts disabled.
+typedef struct {
+    struct s_malloc_pointer_header* head;
+    unsigned long long count;
+} malloc_magazine_t;
+
+malloc_magazine_t malloc_magazines[SMP_MAX_HARTS][MALLOC_BUCKET_COUNT] = { 0 };
+
+// Protects the page allocation bytes and reference counts
+spinlock_t page_lock = { 0 };
+
 // Pages bottom
 extern page_t pages_bottom;
 page_t* pages_start = &pages_bottom;
 
+// End of physical memory
+page_t* pages_end = (void*) 0;
+
+// Called when the page allocator runs out of pages
+unsigned long long (*page_reclaimer)(unsigned long long) = (void*) 0;
+
+// Number of references to each page beyond the first, allocated when a page is first shared
+unsigned short* page_refs = (void*) 0;
+
 enum {
     PAGE_ALLOC_BYTE_FREE = 0,
     PAGE_ALLOC_BYTE_USED = 1,
@@ -51,7 +80,8 @@ void init_heap_metadata(void* fdt) {
     for (int i = 4 * address_cells; i < reg.len; i += 4 * (size_cells + address_cells)) {
         HEAP_SIZE += be_to_le(32 * size_cells, reg.data + i);
     }
-    console_printf("Heap has %llx bytes of memory\n", HEAP_SIZE);
+    pages_end = (page_t*) (be_to_le(32 * address_cells, reg.data) + HEAP_SIZE);
+    console_printf("Heap has %llx bytes of memory ending at %p\n", HEAP_SIZE, pages_end);
 
     unsigned long long page_count = HEAP_SIZE / PAGE_SIZE / PAGE_SIZE;
     pages_start += page_count;
@@ -102,25 +132,33 @@ void mark_pages_as_used(void* ptr, unsigned long long size) {
     mark_pages_as_used_unchecked(ptr, page_count);
 }
 
-// alloc_page(unsigned long long) -> void*
-// Returns a zeroed out pointer to consecutive pages in memory.
-void* alloc_page(unsigned long long page_count) {
-    if (page_count == 0)
-        return (void*) 0;
+// page_index(void*) -> unsigned long long
+// Returns the index of a page among the pages managed by the page allocator.
+unsigned long long page_index(void* ptr) {
+    return (((unsigned long long) ptr) - (unsigned long long) pages_start) / PAGE_SIZE;
+}
 
-    // Get mmu if available
-    volatile unsigned long long mmu = 0;
-    mmu_level_1_t* top = (void*) 0;
-    asm volatile("csrr %0, satp" : "=r" (mmu));
-    if (mmu & 0x8000000000000000) {
-        top = (void*) ((mmu & 0x00000fffffffffff) << 12);
-    }
+// heap_page_count() -> unsigned long long
+// Returns the number of pages managed by the page allocator.
+unsigned long long heap_page_count() {
+    return pages_end - pages_start;
+}
+
+// register_page_reclaimer(unsigned long long (*)(unsigned long long)) -> void
+// Registers a function that the page allocator calls to free up pages when it runs out. The function is given the number of pages wanted and returns the number of pages it freed.
+void register_page_reclaimer(unsigned long long (*reclaimer)(unsigned long long)) {
+    page_reclaimer = reclaimer;
+}
 
+// find_free_pages(unsigned long long) -> void*
+// Finds, clears, and marks consecutive free pages. Returns null if there are none.
+static void* find_free_pages(unsigned long long page_count) {
+    // Physical memory is identity mapped in every page table, so pages can be handed out directly
+    unsigned long long flags = spinlock_acquire_irqsave(&page_lock);
     page_t* ptr = pages_start;
-    page_t* pages_end = pages_start + HEAP_SIZE;
 
     // Find a pointer
-    for (; ptr < pages_end; ptr++) {
+    for (; ptr + page_count <= pages_end; ptr++) {
         if (is_free(ptr)) {
             // Check if consecutive pages are free
             char free = 1;
@@ -133,28 +171,6 @@ void* alloc_page(unsigned long long page_count) {
             }
 
             if (free) {
-                if (top != (void*) 0) {
-                    // Add pages to mmu if necessary
-                    for (page_t* p = ptr; p < end; p++) {
-                        premap_mmu(top, p);
-                    }
-
-                    // Check if still free
-                    for (page_t* p = ptr; p < end; p++) {
-                        if (is_used(p)) {
-                            free = 0;
-                            break;
-                        }
-                    }
-
-                    // Map page
-                    if (free) {
-                        for (page_t* p = ptr; p < end; p++) {
-                            map_mmu(top, p, p, MMU_FLAG_READ | MMU_FLAG_WRITE);
-                        }
-                    } else continue;
-                }
-
                 // Clear pages
                 volatile unsigned long long* big_ptr = (unsigned long long*) ptr;
                 for (; big_ptr < (unsigned long long*) ((void*) end); big_ptr++) {
@@ -164,22 +180,95 @@ void* alloc_page(unsigned long long page_count) {
                 // Mark pages as used
                 mark_pages_as_used_unchecked(ptr, page_count);
 
+                spinlock_release_irqrestore(&page_lock, flags);
                 return (void*) ptr;
             }
         }
     }
 
+    spinlock_release_irqrestore(&page_lock, flags);
+    return (void*) 0;
+}
+
+// page_get(void*) -> char
+// Adds a reference to a page so that it is only freed once every holder has deallocated it. Returns 0 on success.
+char page_get(void* ptr) {
+    unsigned long long i = page_index(ptr);
+    if (i >= heap_page_count() || is_free(ptr))
+        return -1;
+
+    // The table is allocated outside the lock since the page allocator takes it
+    if (page_refs == (void*) 0) {
+        unsigned short* refs = alloc_page((heap_page_count() * sizeof(unsigned short) + PAGE_SIZE - 1) / PAGE_SIZE);
+        if (refs == (void*) 0)
+            return -1;
+
+        // Another hart may have allocated it in the meantime
+        unsigned long long flags = spinlock_acquire_irqsave(&page_lock);
+        char raced = page_refs != (void*) 0;
+        if (!raced)
+            page_refs = refs;
+        spinlock_release_irqrestore(&page_lock, flags);
+        if (raced)
+            dealloc_page(refs);
+    }
+
+    unsigned long long flags = spinlock_acquire_irqsave(&page_lock);
+    char result = -1;
+    if (page_refs[i] != 0xffff) {
+        page_refs[i]++;
+        result = 0;
+    }
+    spinlock_release_irqrestore(&page_lock, flags);
+    return result;
+}
+
+// page_references(void*) -> unsigned long long
+// Returns the number of references to a page, or 0 if it is free.
+unsigned long long page_references(void* ptr) {
+    unsigned long long i = page_index(ptr);
+    if (i >= heap_page_count() || is_free(ptr))
+        return 0;
+    return 1 + (page_refs != (void*) 0 ? page_refs[i] : 0);
+}
+
+// alloc_page(unsigned long long) -> void*
+// Returns a zeroed out pointer to consecutive pages in memory.
+void* alloc_page(unsigned long long page_count) {
+    if (page_count == 0)
+        return (void*) 0;
+
+    void* ptr = find_free_pages(page_count);
+    if (ptr != (void*) 0)
+        return ptr;
+
+    // Try to free up some pages and try again
+    if (page_reclaimer != (void*) 0 && page_reclaimer(page_count) != 0) {
+        ptr = find_free_pages(page_count);
+        if (ptr != (void*) 0)
+            return ptr;
+    }
+
     // No pointer was found; return null
     console_printf("[alloc_page] Error: Could not allocate %llx consecutive pages!\n", page_count);
     return (void*) 0;
 }
 
 // dealloc_page(void*) -> void
-// Deallocates a pointer allocated by alloc.
+// Deallocates a pointer allocated by alloc. Pages with references added by page_get() only lose a reference.
 void dealloc_page(void* ptr) {
     if (ptr == (void*) 0)
         return;
 
+    // Shared pages are only freed when the last reference is dropped
+    unsigned long long flags = spinlock_acquire_irqsave(&page_lock);
+    unsigned long long i = page_index(ptr);
+    if (page_refs != (void*) 0 && i < heap_page_count() && page_refs[i] != 0) {
+        page_refs[i]--;
+        spinlock_release_irqrestore(&page_lock, flags);
+        return;
+    }
+
     page_t* page_ptr = (page_t*) ptr;
     char* cp = ((char*) &pages_bottom) + (((unsigned long long) page_ptr) - (unsigned long long) pages_start) / PAGE_SIZE;
 
@@ -192,15 +281,18 @@ void dealloc_page(void* ptr) {
 
     // Mark last page as free
     *cp = PAGE_ALLOC_BYTE_FREE;
+    spinlock_release_irqrestore(&page_lock, flags);
 }
 
+// memory_format_new_page(unsigned long int) -> struct s_malloc_pointer_header*
+// Splits a new page into a list of free objects of the given size. Returns null if there are no free pages.
 struct s_malloc_pointer_header* memory_format_new_page(unsigned long int size) {
     void* page = alloc_page(1);
     if (page == (void*) 0)
         return page;
     unsigned long long node_size = (size + sizeof(struct s_malloc_pointer_header) + 15) & ~15;
     struct s_malloc_pointer_header* header = (void*) 0;
-    for (unsigned long long i = 0; i < PAGE_SIZE; i += node_size) {
+    for (unsigned long long i = 0; i + node_size <= PAGE_SIZE; i += node_size) {
         if (header) {
             header->next = page + i;
             header = header->next;
@@ -211,23 +303,76 @@ struct s_malloc_pointer_header* memory_format_new_page(unsigned long int size) {
     return page;
 }
 
-#define MALLOC_GET_FROM_BUCKET(size)                                                                \
-do {                                                                                                \
-    if (n <= size) {                                                                                \
-        if (!global_allocator.bucket_##size) {                                                      \
-            global_allocator.bucket_##size = memory_format_new_page(size);                          \
-                                                                                                    \
-            if (!global_allocator.bucket_##size) {                                                  \
-                console_printf("[malloc] Out of memory! Attempted to allocate %lx bytes.\n", n);    \
-                return (void*) 0;                                                                   \
-            }                                                                                       \
-        }                                                                                           \
-                                                                                                    \
-        struct s_malloc_pointer_header* header = global_allocator.bucket_##size;                    \
-        global_allocator.bucket_##size = global_allocator.bucket_##size->next;                      \
-        return header + 1;                                                                          \
-    }                                                                                               \
-} while (0)
+// malloc_bucket(unsigned long int) -> int
+// Returns the index of the smallest size class that fits the given size, or -1 if it needs whole pages.
+static int malloc_bucket(unsigned long int n) {
+    unsigned long int size = 16;
+    for (int i = 0; i < MALLOC_BUCKET_COUNT; i++, size <<= 1) {
+        if (n <= size)
+            return i;
+    }
+    return -1;
+}
+
+// malloc_magazine() -> malloc_magazine_t*
+// Returns the magazines of the current hart. Interrupts must be disabled while they are used.
+static malloc_magazine_t* malloc_magazine() {
+    // The kernel keeps the hart id in tp
+    unsigned long long hartid;
+    asm volatile("mv %0, tp" : "=r" (hartid));
+    return malloc_magazines[hartid];
+}
+
+// malloc_refill(malloc_magazine_t*, int) -> char
+// Moves a batch of objects from the depot into an empty magazine, formatting a new page if the depot is empty. Returns 0 on success.
+static char malloc_refill(malloc_magazine_t* magazine, int bucket) {
+    spinlock_acquire(&malloc_lock);
+    struct s_malloc_pointer_header* head = global_allocator.buckets[bucket];
+    if (head != (void*) 0) {
+        struct s_malloc_pointer_header* last = head;
+        unsigned long long count = 1;
+        for (; count < MALLOC_BATCH && last->next != (void*) 0; count++)
+            last = last->next;
+
+        global_allocator.buckets[bucket] = last->next;
+        spinlock_release(&malloc_lock);
+        last->next = magazine->head;
+        magazine->head = head;
+        magazine->count += count;
+        return 0;
+    }
+    spinlock_release(&malloc_lock);
+
+    // The whole new page goes into the magazine; the page allocator may allocate while reclaiming, which is fine since the magazine is consistent
+    head = memory_format_new_page(16 << bucket);
+    if (head == (void*) 0)
+        return -1;
+
+    struct s_malloc_pointer_header* last = head;
+    unsigned long long count = 1;
+    for (; last->next != (void*) 0; count++)
+        last = last->next;
+    last->next = magazine->head;
+    magazine->head = head;
+    magazine->count += count;
+    return 0;
+}
+
+// malloc_drain(malloc_magazine_t*, int) -> void
+// Moves a batch of objects from a full magazine to the depot.
+static void malloc_drain(malloc_magazine_t* magazine, int bucket) {
+    struct s_malloc_pointer_header* head = magazine->head;
+    struct s_malloc_pointer_header* last = head;
+    for (unsigned long long i = 1; i < MALLOC_BATCH; i++)
+        last = last->next;
+    magazine->head = last->next;
+    magazine->count -= MALLOC_BATCH;
+
+    spinlock_acquire(&malloc_lock);
+    last->next = global_allocator.buckets[bucket];
+    global_allocator.buckets[bucket] = head;
+    spinlock_release(&malloc_lock);
+}
 
 // malloc(unsigned long int) -> void*
 // Allocates a small piece of memory
@@ -235,22 +380,32 @@ void* malloc(unsigned long int n) {
     // Don't allocate zero sized memory
     if (n == 0) return (void*) 0;
 
-    unsigned long long ra;
-    asm volatile("mv %0, ra" : "=r" (ra));
-    MALLOC_GET_FROM_BUCKET(16);
-    MALLOC_GET_FROM_BUCKET(32);
-    MALLOC_GET_FROM_BUCKET(64);
-    MALLOC_GET_FROM_BUCKET(128);
-    MALLOC_GET_FROM_BUCKET(256);
-    MALLOC_GET_FROM_BUCKET(512);
-    unsigned long long page_count = (n + sizeof(struct s_malloc_pointer_header) + PAGE_SIZE - 1) / PAGE_SIZE;
-    struct s_malloc_pointer_header* header = alloc_page(page_count);
-    header->size = n;
+    int bucket = malloc_bucket(n);
+    if (bucket < 0) {
+        unsigned long long page_count = (n + sizeof(struct s_malloc_pointer_header) + PAGE_SIZE - 1) / PAGE_SIZE;
+        struct s_malloc_pointer_header* header = alloc_page(page_count);
+        if (header == (void*) 0)
+            return (void*) 0;
+        header->size = n;
+        return header + 1;
+    }
+
+    // Small objects come from this hart's magazine, so the common case takes no locks
+    unsigned long long flags = lock_irq_save();
+    malloc_magazine_t* magazine = &malloc_magazine()[bucket];
+    if (magazine->count == 0 && malloc_refill(magazine, bucket)) {
+        lock_irq_restore(flags);
+        console_printf("[malloc] Out of memory! Attempted to allocate %lx bytes.\n", n);
+        return (void*) 0;
+    }
+
+    struct s_malloc_pointer_header* header = magazine->head;
+    magazine->head = header->next;
+    magazine->count--;
+    lock_irq_restore(flags);
     return header + 1;
 }
 
-#undef MALLOC_GET_FROM_BUCKET
-
 // realloc(void*, unsigned long int) -> void*
 // Reallocates a piece of memory, returning the new pointer.
 void* realloc(void* ptr, unsigned long int n) {
@@ -279,38 +434,26 @@ void free(void* ptr) {
         return;
 
     struct s_malloc_pointer_header* header = ptr - sizeof(struct s_malloc_pointer_header);
-    switch (header->size) {
-        case 16:
-            header->next = global_allocator.bucket_16;
-            global_allocator.bucket_16 = header;
-            break;
-        case 32:
-            header->next = global_allocator.bucket_32;
-            global_allocator.bucket_32 = header;
-            break;
-        case 64:
-            header->next = global_allocator.bucket_64;
-            global_allocator.bucket_64 = header;
-            break;
-        case 128:
-            header->next = global_allocator.bucket_128;
-            global_allocator.bucket_128 = header;
-            break;
-        case 256:
-            header->next = global_allocator.bucket_256;
-            global_allocator.bucket_256 = header;
-            break;
-        case 512:
-            header->next = global_allocator.bucket_512;
-            global_allocator.bucket_512 = header;
-            break;
-        default:
-            if (header->size > 512) {
-                dealloc_page(header);
-            } else {
-                console_printf("[free] Warning: attempted to free memory that likely was not allocated by malloc: %p\n", ptr);
-            }
+    if (header->size > 512) {
+        dealloc_page(header);
+        return;
     }
+
+    // Objects from size classes have exactly the size of their class
+    int bucket = malloc_bucket(header->size);
+    if (bucket < 0 || header->size != 16ul << bucket) {
+        console_printf("[free] Warning: attempted to free memory that likely was not allocated by malloc: %p\n", ptr);
+        return;
+    }
+
+    unsigned long long flags = lock_irq_save();
+    malloc_magazine_t* magazine = &malloc_magazine()[bucket];
+    header->next = magazine->head;
+    magazine->head = header;
+    magazine->count++;
+    if (magazine->count >= MALLOC_MAGAZINE_SIZE)
+        malloc_drain(magazine, bucket);
+    lock_irq_restore(flags);
 }
 
 // _sizeof(void*) -> unsigned long long
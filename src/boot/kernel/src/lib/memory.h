@@ -11,12 +11,32 @@ void init_heap_metadata(void* fdt);
 // Marks the given pages as used.
 void mark_pages_as_used(void* ptr, unsigned long long page_count);
 
+// page_index(void*) -> unsigned long long
+// Returns the index of a page among the pages managed by the page allocator.
+unsigned long long page_index(void* ptr);
+
+// heap_page_count() -> unsigned long long
+// Returns the number of pages managed by the page allocator.
+unsigned long long heap_page_count();
+
+// register_page_reclaimer(unsigned long long (*)(unsigned long long)) -> void
+// Registers a function that the page allocator calls to free up pages when it runs out. The function is given the number of pages wanted and returns the number of pages it freed.
+void register_page_reclaimer(unsigned long long (*reclaimer)(unsigned long long));
+
+// page_get(void*) -> char
+// Adds a reference to a page so that it is only freed once every holder has deallocated it. Returns 0 on success.
+char page_get(void* ptr);
+
+// page_references(void*) -> unsigned long long
+// Returns the number of references to a page, or 0 if it is free.
+unsigned long long page_references(void* ptr);
+
 // alloc_page(unsigned long long) -> void*
 // Returns a zeroed out pointer to consecutive pages in memory.
 void* alloc_page(unsigned long long size);
 
 // dealloc_page(void*) -> void
-// Deallocates a pointer allocated by alloc.
+// Deallocates a pointer allocated by alloc. Pages with references added by page_get() only lose a reference.
 void dealloc_page(void* ptr);
 
 // malloc(unsigned long int) -> void*
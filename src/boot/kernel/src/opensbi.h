@@ -40,4 +40,12 @@ struct sbiret sbi_hart_stop(void);
 // Gets the current status of a hart.
 struct sbiret sbi_hart_get_status(unsigned long hartid);
 
+// sbi_send_ipi(unsigned long, unsigned long) -> struct sbiret
+// Sends a supervisor software interrupt to the harts in the mask.
+struct sbiret sbi_send_ipi(unsigned long hart_mask, unsigned long hart_mask_base);
+
+// sbi_remote_sfence_vma(unsigned long, unsigned long, unsigned long, unsigned long) -> struct sbiret
+// Executes sfence.vma on the harts in the mask for the given range of virtual addresses.
+struct sbiret sbi_remote_sfence_vma(unsigned long hart_mask, unsigned long hart_mask_base, unsigned long start_addr, unsigned long size);
+
 #endif /* OPENSBI_H */
@@ -9,6 +9,9 @@
 .global sbi_hart_stop
 .global sbi_hart_get_status
 
+.global sbi_send_ipi
+.global sbi_remote_sfence_vma
+
 # EIDs are stored in a7
 # FIDs are stored in a6
 
@@ -59,3 +62,19 @@ sbi_hart_get_status:
     li a7, 0x48534d
     ecall
     ret
+
+# sbi_send_ipi(unsigned long, unsigned long) -> struct sbiret
+# Sends a supervisor software interrupt to the harts in the mask.
+sbi_send_ipi:
+    li a6, 0
+    li a7, 0x735049
+    ecall
+    ret
+
+# sbi_remote_sfence_vma(unsigned long, unsigned long, unsigned long, unsigned long) -> struct sbiret
+# Executes sfence.vma on the harts in the mask for the given range of virtual addresses.
+sbi_remote_sfence_vma:
+    li a6, 1
+    li a7, 0x52464E43
+    ecall
+    ret
@@ -0,0 +1,161 @@
+#include "smp.h"
+#include "opensbi.h"
+#include "drivers/console/console.h"
+#include "drivers/devicetree/tree.h"
+#include "lib/memory.h"
+#include "lib/string.h"
+#include "userspace/sched.h"
+#include "userspace/vdso.h"
+
+extern void* isr_stack_end;
+extern void _start_secondary();
+
+char hart_online[SMP_MAX_HARTS] = { 0 };
+
+// Harts listed in the device tree
+char hart_present[SMP_MAX_HARTS] = { 0 };
+unsigned long long boot_hartid = 0;
+
+spinlock_t kernel_lock = { 0 };
+
+// smp_init(unsigned long long, void*) -> void
+// Sets up the boot hart and finds the other harts in the device tree.
+void smp_init(unsigned long long hartid, void* fdt) {
+    // The hart starts out running its idle process
+    sched_init_hart(hartid, &isr_stack_end);
+    trap_t* trap = &sched_idle_process(hartid)->trap;
+    asm volatile("csrw sscratch, %0" : : "r" (trap));
+
+    boot_hartid = hartid;
+    hart_present[hartid] = 1;
+    hart_online[hartid] = 1;
+
+    fdt_t devicetree = verify_fdt(fdt);
+    if (devicetree.header == (void*) 0)
+        return;
+
+    // Hart ids are in the reg property of each cpu node
+    void* cpu = (void*) 0;
+    while ((cpu = fdt_find(&devicetree, "cpu", cpu)) != (void*) 0) {
+        struct fdt_property reg = fdt_get_property(&devicetree, cpu, "reg");
+        struct fdt_property status = fdt_get_property(&devicetree, cpu, "status");
+        if (reg.data == (void*) 0 || (status.data != (void*) 0 && strcmp(status.data, "okay")))
+            continue;
+
+        unsigned long long id = be_to_le(32, reg.data);
+        if (id < SMP_MAX_HARTS)
+            hart_present[id] = 1;
+        else
+            console_printf("Ignoring hart 0x%llx; only 0x%x harts are supported\n", id, SMP_MAX_HARTS);
+    }
+}
+
+// smp_start_harts() -> void
+// Starts every hart found in the device tree other than the boot hart.
+void smp_start_harts() {
+    // Started harts wait on the lock until everything has been handed out
+    unsigned long long flags = kernel_lock_acquire();
+    for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++) {
+        if (!hart_present[i] || i == boot_hartid)
+            continue;
+
+        void* stack = alloc_page(SMP_STACK_PAGES);
+        void* isr_stack = alloc_page(SMP_STACK_PAGES);
+        smp_boot_info_t* info = malloc(sizeof(smp_boot_info_t));
+        if (stack == (void*) 0 || isr_stack == (void*) 0 || info == (void*) 0) {
+            dealloc_page(stack);
+            dealloc_page(isr_stack);
+            free(info);
+            console_printf("Failed to allocate stacks for hart 0x%llx\n", i);
+            continue;
+        }
+
+        *info = (smp_boot_info_t) {
+            .stack_top = stack + SMP_STACK_PAGES * PAGE_SIZE,
+            .satp = mmu_make_satp(kernel_mmu),
+            .isr_stack_top = isr_stack + SMP_STACK_PAGES * PAGE_SIZE
+        };
+
+        struct sbiret ret = sbi_hart_start(i, (unsigned long) _start_secondary, (unsigned long) info);
+        if (ret.error != SBIRET_ERROR_CODE_SUCCESS)
+            console_printf("Failed to start hart 0x%llx (error %lld)\n", i, (long long) ret.error);
+    }
+    kernel_lock_release(flags);
+}
+
+// kinit_secondary(unsigned long long, smp_boot_info_t*) -> void
+// Initialises a secondary hart and becomes its idle loop. Called from _start_secondary.
+void kinit_secondary(unsigned long long hartid, smp_boot_info_t* info) {
+    unsigned long long flags = kernel_lock_acquire();
+    sched_init_hart(hartid, info->isr_stack_top);
+    trap_t* trap = &sched_idle_process(hartid)->trap;
+    asm volatile("csrw sscratch, %0" : : "r" (trap));
+    hart_online[hartid] = 1;
+    console_printf("Hart 0x%llx online\n", hartid);
+
+    // Device interrupts are rebalanced to include this hart
+    plic_init_hart(hartid);
+    kernel_lock_release(flags);
+    vdso_init_hart();
+
+    unsigned long long t = 0x222;
+    asm volatile("csrs sie, %0" : : "r" (t));
+    t = 0x22;
+    asm volatile("csrs sstatus, %0" : : "r" (t));
+
+    // This context is the idle process of this hart
+    while (1) {
+        asm volatile("wfi");
+    }
+}
+
+// current_hartid() -> unsigned long long
+// Returns the id of the hart this is running on.
+unsigned long long current_hartid() {
+    // The kernel keeps the hart id in tp
+    unsigned long long hartid;
+    asm volatile("mv %0, tp" : "=r" (hartid));
+    return hartid;
+}
+
+// current_trap() -> trap_t*
+// Returns the trap frame of the process running on this hart.
+trap_t* current_trap() {
+    trap_t* trap;
+    asm volatile("csrr %0, sscratch" : "=r" (trap));
+    return trap;
+}
+
+// kernel_lock_acquire() -> unsigned long long
+// Disables interrupts and acquires the lock that serialises the kernel across harts. Returns the interrupt state to pass to kernel_lock_release().
+unsigned long long kernel_lock_acquire() {
+    return spinlock_acquire_irqsave(&kernel_lock);
+}
+
+// kernel_lock_release(unsigned long long) -> void
+// Releases the lock that serialises the kernel across harts and restores interrupts.
+void kernel_lock_release(unsigned long long flags) {
+    spinlock_release_irqrestore(&kernel_lock, flags);
+}
+
+// smp_send_ipi(unsigned long long) -> void
+// Sends a software interrupt to a hart, which makes it reschedule.
+void smp_send_ipi(unsigned long long hartid) {
+    sbi_send_ipi(1ul << hartid, 0);
+}
+
+// smp_flush_tlb() -> void
+// Flushes the tlbs of every online hart after page table entries have been changed.
+void smp_flush_tlb() {
+    asm volatile("sfence.vma zero, zero");
+
+    unsigned long long self = current_hartid();
+    unsigned long mask = 0;
+    for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++) {
+        if (hart_online[i] && i != self)
+            mask |= 1ul << i;
+    }
+
+    if (mask != 0)
+        sbi_remote_sfence_vma(mask, 0, 0, -1);
+}
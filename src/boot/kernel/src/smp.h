@@ -0,0 +1,62 @@
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+#include "interrupts.h"
+#include "lib/lock.h"
+
+// Maximum number of harts supported. Hart ids must be below this.
+#define SMP_MAX_HARTS 32
+
+// Number of pages in the stacks of secondary harts.
+#define SMP_STACK_PAGES 4
+
+// Information handed to a secondary hart when it is started.
+typedef struct {
+    void* stack_top;
+    unsigned long long satp;
+    void* isr_stack_top;
+} smp_boot_info_t;
+
+// Whether each hart has been initialised and is taking interrupts.
+extern char hart_online[SMP_MAX_HARTS];
+
+// Lock that serialises the kernel across harts.
+extern spinlock_t kernel_lock;
+
+// smp_init(unsigned long long, void*) -> void
+// Sets up the boot hart and finds the other harts in the device tree.
+void smp_init(unsigned long long hartid, void* fdt);
+
+// smp_start_harts() -> void
+// Starts every hart found in the device tree other than the boot hart.
+void smp_start_harts();
+
+// kinit_secondary(unsigned long long, smp_boot_info_t*) -> void
+// Initialises a secondary hart and becomes its idle loop. Called from _start_secondary.
+void kinit_secondary(unsigned long long hartid, smp_boot_info_t* info);
+
+// current_hartid() -> unsigned long long
+// Returns the id of the hart this is running on.
+unsigned long long current_hartid();
+
+// current_trap() -> trap_t*
+// Returns the trap frame of the process running on this hart.
+trap_t* current_trap();
+
+// kernel_lock_acquire() -> unsigned long long
+// Disables interrupts and acquires the lock that serialises the kernel across harts. Returns the interrupt state to pass to kernel_lock_release().
+unsigned long long kernel_lock_acquire();
+
+// kernel_lock_release(unsigned long long) -> void
+// Releases the lock that serialises the kernel across harts and restores interrupts.
+void kernel_lock_release(unsigned long long flags);
+
+// smp_send_ipi(unsigned long long) -> void
+// Sends a software interrupt to a hart, which makes it reschedule.
+void smp_send_ipi(unsigned long long hartid);
+
+// smp_flush_tlb() -> void
+// Flushes the tlbs of every online hart after page table entries have been changed.
+void smp_flush_tlb();
+
+#endif /* KERNEL_SMP_H */
@@ -1,5 +1,6 @@
 #include "elffile.h"
 #include "../lib/memory.h"
+#include "../interrupts.h"
 
 #define ELF_MACHINE_RISCV 0xf3
 #define ELF_CLASS_64 2
@@ -81,6 +82,7 @@ elf_t load_executable_elf_from_file(generic_file_t* dir, char* path) {
     // Load program data
     elf.data = malloc(header.program_header_num * sizeof(void*));
     for (int i = 0; i < header.program_header_num; i++) {
+        kernel_preempt_point();
         elf.data[i] = malloc(elf.program_headers[i].file_size);
         generic_file_seek(file, elf.program_headers[i].offset);
         generic_file_read(file, elf.data[i], elf.program_headers[i].file_size);
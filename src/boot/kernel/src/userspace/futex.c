@@ -0,0 +1,100 @@
+#include "futex.h"
+#include "pagefault.h"
+#include "sched.h"
+#include "waitqueue.h"
+
+// Processes waiting on futexes, hashed by physical address. Processes waiting on different futexes can share a bucket.
+wait_queue_t futex_buckets[FUTEX_BUCKET_COUNT] = { 0 };
+
+// futex_bucket(unsigned long long) -> wait_queue_t*
+// Returns the wait queue a futex is hashed into.
+static wait_queue_t* futex_bucket(unsigned long long key) {
+    return &futex_buckets[(((key >> 2) * 0x9e3779b97f4a7c15) >> 32) & (FUTEX_BUCKET_COUNT - 1)];
+}
+
+// futex_key(process_t*, unsigned int*) -> unsigned long long
+// Returns the physical address of a futex, so that processes sharing memory agree on it, or 0 if the address is not an aligned, mapped user address.
+static unsigned long long futex_key(process_t* process, unsigned int* address) {
+    if (((unsigned long long) address) & (sizeof(unsigned int) - 1))
+        return 0;
+
+    // Copy on write pages are copied now, since the physical address would change on the next write
+    if (fault_in_user_range(process->mmu_data, address, sizeof(unsigned int), 1))
+        return 0;
+
+    mmu_entry_t entry = walk_mmu(process->mmu_data, address);
+    if ((entry.raw & (MMU_FLAG_VALID | MMU_FLAG_USER)) != (MMU_FLAG_VALID | MMU_FLAG_USER))
+        return 0;
+    return (unsigned long long) MMU_UNWRAP(entry) + (((unsigned long long) address) & 0xfff);
+}
+
+// futex_wait(process_t*, unsigned int*, unsigned int, unsigned long long) -> int
+// Puts the current process to sleep on a futex if it holds the expected value, until it is woken up or the time CSR reaches the deadline, which may be TIMER_NEVER. Returns 0 once woken up, or -1 if the value differed, the address is invalid, or the deadline passed.
+int futex_wait(process_t* process, unsigned int* address, unsigned int expected, unsigned long long deadline) {
+    if (!sched_can_sleep())
+        return -1;
+
+    unsigned long long key = futex_key(process, address);
+    if (key == 0)
+        return -1;
+
+    // The kernel lock is held, so a waker cannot get in between checking the value and sleeping
+    if (*(volatile unsigned int*) address != expected)
+        return -1;
+
+    // The extra reference keeps swap and merging away from the page, so the key stays valid while the process sleeps
+    void* page = (void*) (key & ~0xfff);
+    if (page_get(page))
+        return -1;
+    process->futex_key = key;
+    process->futex_page = page;
+
+    int result = 0;
+    if (wait_queue_sleep_until(futex_bucket(key), deadline)) {
+        process->futex_key = 0;
+        result = -1;
+    }
+
+    process->futex_page = (void*) 0;
+    dealloc_page(page);
+    return result;
+}
+
+// futex_wake(process_t*, unsigned int*, unsigned int) -> int
+// Wakes up to the given number of processes waiting on a futex, oldest first. Returns the number woken up, or -1 if the address is invalid.
+int futex_wake(process_t* process, unsigned int* address, unsigned int count) {
+    unsigned long long key = futex_key(process, address);
+    if (key == 0)
+        return -1;
+
+    wait_queue_t* bucket = futex_bucket(key);
+    int woken = 0;
+    process_t* next;
+    for (process_t* p = bucket->head; p != (void*) 0 && (unsigned int) woken < count; p = next) {
+        next = p->wait_next;
+        if (p->futex_key != key)
+            continue;
+
+        wait_queue_remove(bucket, p);
+        p->futex_key = 0;
+        sched_wakeup(p);
+        woken++;
+    }
+
+    return woken;
+}
+
+// futex_release(process_t*) -> void
+// Takes a process that is being killed off the futex it waits on.
+void futex_release(process_t* process) {
+    if (process->futex_key != 0) {
+        wait_queue_remove(futex_bucket(process->futex_key), process);
+        process->futex_key = 0;
+    }
+
+    // A process woken up but killed before it ran still holds its page
+    if (process->futex_page != (void*) 0) {
+        dealloc_page(process->futex_page);
+        process->futex_page = (void*) 0;
+    }
+}
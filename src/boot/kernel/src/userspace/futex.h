@@ -0,0 +1,28 @@
+#ifndef KERNEL_FUTEX_H
+#define KERNEL_FUTEX_H
+
+#include "process.h"
+
+// Number of wait queues futexes are hashed into. Must be a power of two.
+#define FUTEX_BUCKET_COUNT 64
+
+// Operations
+// Sleeps if the futex still holds the given value.
+#define FUTEX_WAIT 0
+
+// Wakes up to the given number of processes waiting on the futex.
+#define FUTEX_WAKE 1
+
+// futex_wait(process_t*, unsigned int*, unsigned int, unsigned long long) -> int
+// Puts the current process to sleep on a futex if it holds the expected value, until it is woken up or the time CSR reaches the deadline, which may be TIMER_NEVER. Returns 0 once woken up, or -1 if the value differed, the address is invalid, or the deadline passed.
+int futex_wait(process_t* process, unsigned int* address, unsigned int expected, unsigned long long deadline);
+
+// futex_wake(process_t*, unsigned int*, unsigned int) -> int
+// Wakes up to the given number of processes waiting on a futex, oldest first. Returns the number woken up, or -1 if the address is invalid.
+int futex_wake(process_t* process, unsigned int* address, unsigned int count);
+
+// futex_release(process_t*) -> void
+// Takes a process that is being killed off the futex it waits on.
+void futex_release(process_t* process);
+
+#endif /* KERNEL_FUTEX_H */
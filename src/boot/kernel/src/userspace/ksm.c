@@ -0,0 +1,213 @@
+#include "ksm.h"
+#include "sched.h"
+#include "workingset.h"
+#include "../smp.h"
+
+// An entry in the table of page contents. Stable entries hold a reference to a merged read only page. Unstable entries only remember where a page was seen, since the page may still change.
+typedef struct {
+    unsigned long long hash;
+    void* page;
+    pid_t pid;
+    void* virtual;
+    char used;
+    char stable;
+} ksm_entry_t;
+
+ksm_entry_t* ksm_table = (void*) 0;
+
+unsigned long long ksm_ticks = 0;
+pid_t ksm_cursor = 0;
+unsigned long long ksm_virtual_cursor = 0;
+unsigned long long ksm_budget = 0;
+unsigned long long ksm_pages_scanned = 0;
+unsigned long long ksm_full_scans = 0;
+
+// init_ksm() -> void
+// Allocates the table used to find identical pages.
+void init_ksm() {
+    ksm_table = alloc_page((sizeof(ksm_entry_t) * KSM_TABLE_SIZE + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+// ksm_hash(void*) -> unsigned long long
+// Hashes the contents of a page.
+static unsigned long long ksm_hash(void* page) {
+    unsigned long long* words = page;
+    unsigned long long hash = 0xcbf29ce484222325;
+    for (unsigned long long i = 0; i < PAGE_SIZE / sizeof(unsigned long long); i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// ksm_same(void*, void*) -> char
+// Checks if two pages have the same contents.
+static char ksm_same(void* a, void* b) {
+    unsigned long long* wa = a;
+    unsigned long long* wb = b;
+    for (unsigned long long i = 0; i < PAGE_SIZE / sizeof(unsigned long long); i++) {
+        if (wa[i] != wb[i])
+            return 0;
+    }
+    return 1;
+}
+
+// ksm_candidate(mmu_entry_t*) -> char
+// Checks if an entry maps a private anonymous user page.
+static char ksm_candidate(mmu_entry_t* entry) {
+    unsigned long long needed = MMU_FLAG_VALID | MMU_FLAG_USER | MMU_FLAG_ALLOCED;
+    return (entry->raw & needed) == needed && !(entry->raw & MMU_FLAG_GLOBAL) && page_references(MMU_UNWRAP(*entry)) == 1;
+}
+
+// ksm_share(mmu_entry_t*, void*) -> void
+// Replaces the page of an entry with a merged page, which the mapping then shares read only.
+static void ksm_share(mmu_entry_t* entry, void* page) {
+    void* old = MMU_UNWRAP(*entry);
+    if (old != page) {
+        if (page_get(page))
+            return;
+        entry->raw = (((unsigned long long) page) >> 2) | (entry->raw & 0x3ff);
+        dealloc_page(old);
+    }
+
+    if (entry->raw & MMU_FLAG_WRITE)
+        entry->raw = (entry->raw & ~MMU_FLAG_WRITE) | MMU_FLAG_COW;
+}
+
+// ksm_unstable_entry(ksm_entry_t*) -> mmu_entry_t*
+// Finds the mapping of the page an unstable entry refers to, or null if it is gone or its process may not be remapped right now.
+static mmu_entry_t* ksm_unstable_entry(ksm_entry_t* slot) {
+    if (slot->pid == 0 || slot->pid >= MAX_PID)
+        return (void*) 0;
+
+    process_t* process = fetch_process(slot->pid);
+    if (process->state == PROCESS_STATE_DEAD || process->mmu_data == (void*) 0)
+        return (void*) 0;
+
+    // Same rules as the process being scanned; see sched_can_remap()
+    if (!sched_can_remap(process) || process->mmu_data == mmu_current_top())
+        return (void*) 0;
+
+    mmu_entry_t* entry = mmu_walk_entry(process->mmu_data, slot->virtual, 0);
+    if (entry == (void*) 0 || !ksm_candidate(entry) || MMU_UNWRAP(*entry) != slot->page)
+        return (void*) 0;
+    return entry;
+}
+
+// ksm_scan_page(void*, mmu_entry_t*, void*) -> void
+// Merges a page with an identical page seen before, or remembers it.
+static void ksm_scan_page(void* virtual, mmu_entry_t* entry, void* data) {
+    pid_t pid = (pid_t) (unsigned long long) data;
+    if ((unsigned long long) virtual < ksm_virtual_cursor || ksm_budget == 0)
+        return;
+
+    ksm_budget--;
+    ksm_virtual_cursor = (unsigned long long) virtual + PAGE_SIZE;
+    if (!ksm_candidate(entry))
+        return;
+
+    // Pages still being written to are not worth merging
+    void* page = MMU_UNWRAP(*entry);
+    if ((entry->raw & MMU_FLAG_WRITE) && workingset_page_age(page) == 0)
+        return;
+
+    ksm_pages_scanned++;
+    unsigned long long hash = ksm_hash(page);
+    ksm_entry_t* slot = ksm_table + (hash & (KSM_TABLE_SIZE - 1));
+
+    if (slot->used && slot->hash == hash) {
+        if (slot->stable) {
+            if (ksm_same(slot->page, page))
+                ksm_share(entry, slot->page);
+            return;
+        }
+
+        // Promote the unstable entry to a stable one if the page it refers to still matches
+        mmu_entry_t* other = ksm_unstable_entry(slot);
+        if (other != (void*) 0 && other != entry && ksm_same(slot->page, page) && !page_get(slot->page)) {
+            slot->stable = 1;
+            ksm_share(other, slot->page);
+            ksm_share(entry, slot->page);
+            return;
+        }
+    }
+
+    // Stable entries are only replaced once nothing maps their page anymore
+    if (slot->used && slot->stable)
+        return;
+
+    *slot = (ksm_entry_t) {
+        .hash = hash,
+        .page = page,
+        .pid = pid,
+        .virtual = virtual,
+        .used = 1,
+        .stable = 0
+    };
+}
+
+// ksm_end_scan() -> void
+// Forgets unstable entries and merged pages that are no longer mapped anywhere after every process has been looked at.
+static void ksm_end_scan() {
+    for (unsigned long long i = 0; i < KSM_TABLE_SIZE; i++) {
+        ksm_entry_t* slot = ksm_table + i;
+        if (slot->used && slot->stable && page_references(slot->page) == 1)
+            dealloc_page(slot->page);
+        if (!slot->used || !slot->stable || page_references(slot->page) == 0)
+            slot->used = 0;
+    }
+    ksm_full_scans++;
+}
+
+// ksm_tick() -> void
+// Called on every timer tick. Looks at the next batch of pages every KSM_SCAN_TICKS ticks and merges the ones identical to pages seen before.
+void ksm_tick() {
+    if (ksm_table == (void*) 0 || ++ksm_ticks < KSM_SCAN_TICKS)
+        return;
+    ksm_ticks = 0;
+
+    if (ksm_cursor == 0) {
+        ksm_cursor = next_live_process(0);
+        ksm_virtual_cursor = 0;
+        if (ksm_cursor == 0)
+            return;
+    }
+
+    // Processes running on other harts or in a syscall are skipped this time around; see sched_can_remap()
+    process_t* process = fetch_process(ksm_cursor);
+    char skip = process->state == PROCESS_STATE_DEAD || !sched_can_remap(process);
+    ksm_budget = KSM_BATCH_PAGES;
+    if (!skip) {
+        mmu_walk_leaves(process->mmu_data, ksm_scan_page, (void*) (unsigned long long) ksm_cursor);
+        smp_flush_tlb();
+    }
+
+    // Move on to the next process once this one has been looked at completely
+    if (ksm_budget != 0 || skip) {
+        ksm_cursor = next_live_process(ksm_cursor);
+        ksm_virtual_cursor = 0;
+        if (ksm_cursor == 0)
+            ksm_end_scan();
+    }
+}
+
+// ksm_info(ksm_info_t*) -> void
+// Fills in page merging statistics. Pages sharing is the number of pages saved by merging.
+void ksm_info(ksm_info_t* info) {
+    *info = (ksm_info_t) {
+        .pages_scanned = ksm_pages_scanned,
+        .full_scans = ksm_full_scans
+    };
+
+    if (ksm_table == (void*) 0)
+        return;
+
+    // Every merged page has a reference held by the table and one for each mapping
+    for (unsigned long long i = 0; i < KSM_TABLE_SIZE; i++) {
+        ksm_entry_t* slot = ksm_table + i;
+        unsigned long long references = slot->used && slot->stable ? page_references(slot->page) : 0;
+        if (references > 2) {
+            info->pages_shared++;
+            info->pages_sharing += references - 2;
+        }
+    }
+}
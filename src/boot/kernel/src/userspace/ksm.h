@@ -0,0 +1,35 @@
+#ifndef KERNEL_KSM_H
+#define KERNEL_KSM_H
+
+#include "process.h"
+
+// Number of timer ticks between merging steps.
+#define KSM_SCAN_TICKS 16
+
+// Number of pages looked at in each merging step.
+#define KSM_BATCH_PAGES 64
+
+// Number of entries in the table of page contents. Must be a power of two.
+#define KSM_TABLE_SIZE 4096
+
+// Page merging statistics as reported to userspace.
+typedef struct {
+    unsigned long long pages_shared;
+    unsigned long long pages_sharing;
+    unsigned long long pages_scanned;
+    unsigned long long full_scans;
+} ksm_info_t;
+
+// init_ksm() -> void
+// Allocates the table used to find identical pages.
+void init_ksm();
+
+// ksm_tick() -> void
+// Called on every timer tick. Looks at the next batch of pages every KSM_SCAN_TICKS ticks and merges the ones identical to pages seen before.
+void ksm_tick();
+
+// ksm_info(ksm_info_t*) -> void
+// Fills in page merging statistics. Pages sharing is the number of pages saved by merging.
+void ksm_info(ksm_info_t* info);
+
+#endif /* KERNEL_KSM_H */
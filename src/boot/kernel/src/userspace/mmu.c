@@ -1,116 +1,224 @@
 #include "mmu.h"
+#include "swap.h"
+#include "workingset.h"
+#include "../drivers/console/console.h"
+#include "../lib/string.h"
+#include "../smp.h"
+
+mmu_mode_t mmu_mode = MMU_MODE_SV39;
+unsigned int mmu_levels = 3;
+mmu_entry_t* kernel_mmu = (void*) 0;
+
+// Range of virtual addresses whose tables are shared with the kernel page table.
+static unsigned long long shared_start = 0;
+static unsigned long long shared_end = 0;
+
+// mmu_init_mode(void*) -> void
+// Selects the translation mode from the mmu-type of the boot hart in the device tree. Sv48 is used if available, otherwise Sv39.
+void mmu_init_mode(void* fdt) {
+    mmu_mode = MMU_MODE_SV39;
+    mmu_levels = 3;
 
-// create_mmu_top() -> mmu_level_1_t*
+    fdt_t devicetree = verify_fdt(fdt);
+    if (devicetree.header == (void*) 0) {
+        console_puts("Invalid device tree; defaulting to Sv39 paging\n");
+        return;
+    }
+
+    // Harts that support Sv57 must also support Sv48
+    void* cpu = fdt_find(&devicetree, "cpu", (void*) 0);
+    struct fdt_property mmu_type = fdt_get_property(&devicetree, cpu, "mmu-type");
+    if (mmu_type.data != (void*) 0 && (!strcmp(mmu_type.data, "riscv,sv48") || !strcmp(mmu_type.data, "riscv,sv57"))) {
+        mmu_mode = MMU_MODE_SV48;
+        mmu_levels = 4;
+    }
+
+    console_printf("Using Sv%d paging\n", 12 + 9 * mmu_levels);
+}
+
+// mmu_make_satp(mmu_entry_t*) -> unsigned long long
+// Creates a satp value for a page table using the current translation mode.
+unsigned long long mmu_make_satp(mmu_entry_t* top) {
+    return (((unsigned long long) mmu_mode) << 60) | (((unsigned long long) top) >> 12);
+}
+
+// mmu_current_top() -> mmu_entry_t*
+// Returns the page table currently loaded in satp, or null if translation is disabled.
+mmu_entry_t* mmu_current_top() {
+    unsigned long long satp;
+    asm volatile("csrr %0, satp" : "=r" (satp));
+    if ((satp >> 60) == MMU_MODE_BARE)
+        return (void*) 0;
+    return (void*) ((satp & 0x00000fffffffffff) << 12);
+}
+
+// mmu_switch_top(mmu_entry_t*) -> unsigned long long
+// Loads a page table into satp and flushes the tlb. Returns the previous satp value.
+unsigned long long mmu_switch_top(mmu_entry_t* top) {
+    unsigned long long satp = mmu_make_satp(top);
+    asm volatile("csrrw %0, satp, %0" : "+r" (satp));
+    asm volatile("sfence.vma zero, zero");
+    return satp;
+}
+
+// mmu_user_top() -> void*
+// Returns the end of the lower half of the virtual address space, which is where user mappings live.
+void* mmu_user_top() {
+    return (void*) (1ull << (12 + 9 * mmu_levels - 1));
+}
+
+// mmu_canonical(unsigned long long) -> void*
+// Sign extends a virtual address built from page table indices.
+static void* mmu_canonical(unsigned long long virtual) {
+    unsigned long long bits = 12 + 9 * mmu_levels;
+    if (virtual & (1ull << (bits - 1)))
+        virtual |= ~((1ull << bits) - 1);
+    return (void*) virtual;
+}
+
+// mmu_is_shared(unsigned long long) -> char
+// Checks if the tables covering a virtual address are shared with the kernel page table.
+static char mmu_is_shared(unsigned long long virtual) {
+    return shared_start <= virtual && virtual < shared_end;
+}
+
+// create_mmu_top() -> mmu_entry_t*
 // Creates an MMU data structure.
-mmu_level_1_t* create_mmu_top() {
-    mmu_level_1_t* config = alloc_page(1);
+mmu_entry_t* create_mmu_top() {
+    mmu_entry_t* config = alloc_page(1);
     return config;
 }
 
-mmu_level_3_t* walk_mmu_and_get_pointer_to_pointer(mmu_level_1_t* top, void* virtual, int create_pages) {
+// mmu_walk_to_level(mmu_entry_t*, void*, unsigned int, int) -> mmu_entry_t*
+// Walks an mmu page table down to the given level and returns a pointer to the entry for the virtual address at that level.
+static mmu_entry_t* mmu_walk_to_level(mmu_entry_t* top, void* virtual, unsigned int target, int create_pages) {
     if (top == (void*) 0)
         return (void*) 0;
 
-    // Top to level 2
-    unsigned long long i = (((unsigned long long) virtual) >> 30) & 0x1ff;
-    if (top[i].addr == (void*) 0) {
-        if (create_pages) {
-            top[i].raw = ((unsigned long long) alloc_page(1)) >> 2;
-            top[i].raw |= MMU_FLAG_VALID;
-        } else {
+    mmu_entry_t* table = top;
+    for (unsigned int level = mmu_levels - 1; level > target; level--) {
+        mmu_entry_t* entry = table + MMU_INDEX(virtual, level);
+        if (entry->addr == (void*) 0) {
+            if (!create_pages)
+                return (void*) 0;
+
+            void* page = alloc_page(1);
+            if (page == (void*) 0)
+                return (void*) 0;
+            entry->raw = ((unsigned long long) page) >> 2;
+            entry->raw |= MMU_FLAG_VALID;
+        } else if ((entry->raw & MMU_FLAG_VALID) == 0 || (entry->raw & MMU_FLAG_LEAF) != 0)
             return (void*) 0;
-        }
-    } else if ((top[i].raw & 1) != MMU_FLAG_VALID)
-        return (void*) 0;
 
-    // Level 2 to level 3
-    mmu_level_2_t* level2 = MMU_UNWRAP(2, top[i]);
-    i = (((unsigned long long) virtual) >> 21) & 0x1ff;
-    if (level2[i].addr == (void*) 0) {
-        if (create_pages) {
-            level2[i].raw = ((unsigned long long) alloc_page(1)) >> 2;
-            level2[i].raw |= MMU_FLAG_VALID;
-        } else {
-            return (void*) 0;
-        }
-    } else if ((level2[i].raw & 1) != MMU_FLAG_VALID)
-        return (void*) 0;
+        table = MMU_UNWRAP(*entry);
+    }
 
-    // Get page
-    mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[i]);
-    i = (((unsigned long long) virtual) >> 12) & 0x1ff;
-    return level3 + i;
+    return table + MMU_INDEX(virtual, target);
 }
 
-// premap_mmu(mmu_level_1_t*, void*) -> void
+// mmu_walk_entry(mmu_entry_t*, void*, int) -> mmu_entry_t*
+// Walks an mmu page table and returns a pointer to the leaf entry for the given virtual address. Missing tables are allocated if create_pages is true, otherwise null is returned.
+mmu_entry_t* mmu_walk_entry(mmu_entry_t* top, void* virtual, int create_pages) {
+    return mmu_walk_to_level(top, virtual, 0, create_pages);
+}
+
+// premap_mmu(mmu_entry_t*, void*) -> void
 // Walks an mmu page table and allocates the missing entries on the way to the address that would be mapped to the virtual address given without allocating an address to the virtual address.
-void premap_mmu(mmu_level_1_t* top, void* virtual) {
-    walk_mmu_and_get_pointer_to_pointer(top, virtual, 1);
+void premap_mmu(mmu_entry_t* top, void* virtual) {
+    mmu_walk_entry(top, virtual, 1);
 }
 
-// walk_mmu(mmu_level_1_t*, void*) -> mmu_level_3_t
-// Walks an mmu page table and returns the physical address associated with the given virtual address. Returns null if unmapped.
-mmu_level_3_t walk_mmu(mmu_level_1_t* top, void* virtual) {
-    mmu_level_3_t* physical_ptr = walk_mmu_and_get_pointer_to_pointer(top, virtual, 0);
+// walk_mmu(mmu_entry_t*, void*) -> mmu_entry_t
+// Walks an mmu page table and returns the leaf entry associated with the given virtual address. Returns a zeroed entry if unmapped.
+mmu_entry_t walk_mmu(mmu_entry_t* top, void* virtual) {
+    mmu_entry_t* physical_ptr = mmu_walk_entry(top, virtual, 0);
     if (physical_ptr == (void*) 0)
-        return (mmu_level_3_t) { 0 };
+        return (mmu_entry_t) { 0 };
     return *physical_ptr;
 }
 
-// map_mmu(mmu_level_1_t*, void*, void*, char) -> int
+// mmu_walk_leaves_level(mmu_entry_t*, unsigned int, unsigned long long, void (*)(void*, mmu_entry_t*, void*), void*) -> void
+// Recursive helper for mmu_walk_leaves().
+static void mmu_walk_leaves_level(mmu_entry_t* table, unsigned int level, unsigned long long base, void (*callback)(void*, mmu_entry_t*, void*), void* data) {
+    for (unsigned long long i = 0; i < PAGE_SIZE / sizeof(mmu_entry_t); i++) {
+        if (table[i].raw == 0)
+            continue;
+
+        unsigned long long virtual = base | (i << (12 + 9 * level));
+        if (level == 0 || ((table[i].raw & MMU_FLAG_VALID) && (table[i].raw & MMU_FLAG_LEAF)))
+            callback(mmu_canonical(virtual), table + i, data);
+        else if ((table[i].raw & MMU_FLAG_VALID) && !(level == MMU_SHARED_LEVEL && mmu_is_shared(virtual)))
+            mmu_walk_leaves_level(MMU_UNWRAP(table[i]), level - 1, virtual, callback, data);
+    }
+}
+
+// mmu_walk_leaves(mmu_entry_t*, void (*)(void*, mmu_entry_t*, void*), void*) -> void
+// Calls the given function with the virtual address and entry of every nonzero leaf entry in a page table. Tables shared with the kernel are skipped.
+void mmu_walk_leaves(mmu_entry_t* top, void (*callback)(void*, mmu_entry_t*, void*), void* data) {
+    if (top == (void*) 0)
+        return;
+    mmu_walk_leaves_level(top, mmu_levels - 1, 0, callback, data);
+}
+
+// map_mmu(mmu_entry_t*, void*, void*, char) -> int
 // Maps a virtual address to a physical address.
-int map_mmu(mmu_level_1_t* top, void* virtual, void* physical, char flags) {
+int map_mmu(mmu_entry_t* top, void* virtual, void* physical, char flags) {
     // Align addresses to the largest 4096 byte boundary less than the address
     physical = (void*) (((unsigned long long) physical) & ~0xfff);
     virtual = (void*) (((unsigned long long) virtual) & ~0xfff);
 
     // Walk mmu and create pages along the way
-    mmu_level_3_t* level3 = walk_mmu_and_get_pointer_to_pointer(top, virtual, 1);
+    mmu_entry_t* leaf = mmu_walk_entry(top, virtual, 1);
 
-    if (level3 == (void*) 0) {
+    if (leaf == (void*) 0) {
         return -1;
-    } else if (level3->addr != (void*) 0) {
+    } else if (leaf->addr != (void*) 0) {
         return -1;
     }
 
-    level3->raw = ((unsigned long long) physical) >> 2;
+    leaf->raw = ((unsigned long long) physical) >> 2;
 
     // In addition to the flags provided by the standard, the 8th and 9th bits are reserved for software use
     // In our case, the 8th bit is used to keep track of whether the memory location was allocated with alloc_page().
-    level3->raw &= ~0x100;
-    level3->raw |= (0b00111111 & flags) | MMU_FLAG_VALID;
+    leaf->raw &= ~0x100;
+    leaf->raw |= (0b00111111 & flags) | MMU_FLAG_VALID;
     return 0;
 }
 
-// alloc_page_mmu(mmu_level_1_t*, void*, char) -> void*
+// alloc_page_mmu(mmu_entry_t*, void*, char) -> void*
 // Allocates a new page to map to a given virtual address. Returns the physical address
-void* alloc_page_mmu(mmu_level_1_t* top, void* virtual, char flags) {
+void* alloc_page_mmu(mmu_entry_t* top, void* virtual, char flags) {
     // Align addresses to the largest 4096 byte boundary less than the address
     virtual = (void*) (((unsigned long long) virtual) & ~0xfff);
 
     // Walk mmu and create pages along the way
-    mmu_level_3_t* level3 = walk_mmu_and_get_pointer_to_pointer(top, virtual, 1);
+    mmu_entry_t* leaf = mmu_walk_entry(top, virtual, 1);
 
-    if (level3 == (void*) 0) {
+    if (leaf == (void*) 0) {
         return (void*) 0;
-    } else if (level3->addr != (void*) 0) {
-        void* physical = MMU_UNWRAP(4, *level3);
+    } else if (leaf->addr != (void*) 0) {
+        if (!(leaf->raw & MMU_FLAG_VALID) && swap_in(leaf))
+            return (void*) 0;
+        void* physical = MMU_UNWRAP(*leaf);
         return physical;
     }
 
     void* physical = alloc_page(1);
-    level3->raw = ((unsigned long long) physical) >> 2;
+    if (physical == (void*) 0)
+        return (void*) 0;
+    leaf->raw = ((unsigned long long) physical) >> 2;
+    workingset_reset_page(physical);
 
     // In addition to the flags provided by the standard, the 8th and 9th bits are reserved for software use
     // In our case, the 8th bit is used to keep track of whether the memory location was allocated with alloc_page().
-    level3->raw |= 0x100;
-    level3->raw |= (0b00111111 & flags) | MMU_FLAG_VALID;
+    leaf->raw |= 0x100;
+    leaf->raw |= (0b00111111 & flags) | MMU_FLAG_VALID;
     return physical;
 }
 
-// mmu_map_range_identity(mmu_level_1_t*, void*, void*, char) -> void
+// mmu_map_range_identity(mmu_entry_t*, void*, void*, char) -> void
 // Maps a range onto itself in an mmu page table.
-void mmu_map_range_identity(mmu_level_1_t* top, void* start, void* end, char flags) {
+void mmu_map_range_identity(mmu_entry_t* top, void* start, void* end, char flags) {
     start = (void*) (((unsigned long long) start) & ~0xfff);
     end = (void*) ((((unsigned long long) end) + PAGE_SIZE - 1) & ~0xfff);
 
@@ -123,20 +231,20 @@ void mmu_map_range_identity(mmu_level_1_t* top, void* start, void* end, char fla
 #include "../drivers/virtio/virtio.h"
 #include "../interrupts.h"
 
-// mmu_map_kernel(mmu_level_1_t*, fdt_header_t*) -> void
-// Maps the kernel onto an mmu page table.
-void mmu_map_kernel(mmu_level_1_t* top, fdt_header_t* fdt) {
+// mmu_map_kernel(mmu_entry_t*, fdt_header_t*) -> void
+// Maps the kernel and all of physical memory onto an mmu page table and makes it the kernel page table.
+void mmu_map_kernel(mmu_entry_t* top, fdt_header_t* fdt) {
     extern int text_start;
     extern int data_start;
     extern int ro_data_start;
     extern int sdata_start;
     extern int stack_start;
     extern int pages_bottom;
-    extern void* pages_start;
+    extern void* pages_end;
 
     // Map fdt
-    mmu_map_range_identity(top, fdt, ((void*) fdt) + be_to_le(32, fdt->totalsize), MMU_FLAG_GLOBAL | MMU_FLAG_READ);
     mark_pages_as_used(fdt, be_to_le(32, fdt->totalsize));
+    mmu_map_range_identity(top, fdt, ((void*) fdt) + be_to_le(32, fdt->totalsize), MMU_FLAG_GLOBAL | MMU_FLAG_READ);
 
     // Map kernel
     mmu_map_range_identity(top, &text_start, &data_start,       MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_EXEC);
@@ -144,138 +252,77 @@ void mmu_map_kernel(mmu_level_1_t* top, fdt_header_t* fdt) {
     mmu_map_range_identity(top, &ro_data_start, &sdata_start,   MMU_FLAG_GLOBAL | MMU_FLAG_READ);
     mmu_map_range_identity(top, &sdata_start, &stack_start,     MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
     mmu_map_range_identity(top, &stack_start, &pages_bottom,    MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
-    mmu_map_range_identity(top, &pages_bottom, pages_start,     MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
+
+    // Map page metadata and all of physical memory, including the page tables themselves
+    mmu_map_range_identity(top, &pages_bottom, pages_end,       MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
 
     // Map virtio stuff
     mmu_map_range_identity(top, (void*) VIRTIO_MMIO_BASE, (void*) (VIRTIO_MMIO_TOP + VIRTIO_MMIO_INTERVAL), MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
 
     // Map interrupt stuff
-    fdt_t devicetree = verify_fdt(fdt);
-    void* plic = fdt_find(&devicetree, "plic", (void*) 0);
-    PLIC_BASE = fdt_get_node_addr(plic);
-    mmu_map_range_identity(top, (void*) PLIC_BASE, (void*) (PLIC_BASE + PLIC_COUNT * 4),                                    MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
-    mmu_map_range_identity(top, (void*) (PLIC_BASE + PLIC_ENABLES_OFFSET), (void*) (PLIC_BASE + PLIC_ENABLES_OFFSET + 1),   MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
-    mmu_map_range_identity(top, (void*) get_context_priority_threshold(1), (void*) (get_context_priority_threshold(1) + 1), MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
-
-    // Map mmu
-    map_mmu(top, top, top, MMU_FLAG_READ | MMU_FLAG_WRITE);
-    for (int i = 0; i < (int) (PAGE_SIZE / sizeof(void*)); i++) {
-        mmu_level_2_t* level2 = MMU_UNWRAP(2, top[i]);
-        if (level2 == (void*) 0)
-            continue;
-
-        map_mmu(top, level2, level2, MMU_FLAG_READ | MMU_FLAG_WRITE);
-
-        for (int j = 0; j < (int) (PAGE_SIZE / sizeof(void*)); j++) {
-            mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[j]);
-            if (level3 == (void*) 0)
-                continue;
-
-            map_mmu(top, level3, level3, MMU_FLAG_READ | MMU_FLAG_WRITE);
-        }
-    }
-}
+    plic_init(fdt);
+    mmu_map_range_identity(top, (void*) PLIC_BASE, (void*) (PLIC_BASE + PLIC_COUNT * 4), MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
 
-// copy_mmu_globals(mmu_level_1_t*, mmu_level_1_t*) -> void
-// Copies the global mappings from one page table to another.
-void copy_mmu_globals(mmu_level_1_t* dest, mmu_level_1_t* src) {
-    for (int i = 0; i < (int) (PAGE_SIZE / sizeof(void*)); i++) {
-        mmu_level_2_t* level2 = MMU_UNWRAP(2, src[i]);
-        if (level2 == (void*) 0)
+    // Each hart's context has its own enable bits, and its own page with the threshold and claim registers
+    for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++) {
+        unsigned long long context = plic_contexts[i];
+        if (context == PLIC_NONE)
             continue;
-
-        for (int j = 0; j < (int) (PAGE_SIZE / sizeof(void*)); j++) {
-            mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[j]);
-            if (level3 == (void*) 0)
-                continue;
-
-            for (int k = 0; k < (int) (PAGE_SIZE / sizeof(void*)); k++) {
-                if (level3[k].raw & MMU_FLAG_GLOBAL) {
-                    void* physical = MMU_UNWRAP(4, level3[k]);
-                    map_mmu(dest, physical, physical, level3[k].raw & 0xff);
-                }
-            }
-        }
+        mmu_map_range_identity(top, (void*) get_context_enable_bits(context), (void*) (get_context_enable_bits(context) + 1),               MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
+        mmu_map_range_identity(top, (void*) get_context_priority_threshold(context), (void*) (get_context_priority_threshold(context) + 1), MMU_FLAG_GLOBAL | MMU_FLAG_READ | MMU_FLAG_WRITE);
     }
 
-    // Map mmu
-    map_mmu(dest, dest, dest, MMU_FLAG_READ | MMU_FLAG_WRITE);
-    for (int i = 0; i < (int) (PAGE_SIZE / sizeof(void*)); i++) {
-        mmu_level_2_t* level2 = MMU_UNWRAP(2, dest[i]);
-        if (level2 == (void*) 0)
-            continue;
-
-        map_mmu(dest, level2, level2, MMU_FLAG_READ | MMU_FLAG_WRITE);
-
-        for (int j = 0; j < (int) (PAGE_SIZE / sizeof(void*)); j++) {
-            mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[j]);
-            if (level3 == (void*) 0)
-                continue;
+    // Tables covering physical memory are shared with every process page table
+    shared_start = ((unsigned long long) &text_start) & ~(MMU_LEVEL_SIZE(MMU_SHARED_LEVEL) - 1);
+    shared_end = (((unsigned long long) pages_end) + MMU_LEVEL_SIZE(MMU_SHARED_LEVEL) - 1) & ~(MMU_LEVEL_SIZE(MMU_SHARED_LEVEL) - 1);
+    kernel_mmu = top;
+}
 
-            map_mmu(dest, level3, level3, MMU_FLAG_READ | MMU_FLAG_WRITE);
-        }
-    }
+// copy_mmu_global_leaf(void*, mmu_entry_t*, void*) -> void
+// Copies a leaf entry into another page table if it is global.
+static void copy_mmu_global_leaf(void* virtual, mmu_entry_t* entry, void* dest) {
+    if (entry->raw & MMU_FLAG_GLOBAL)
+        map_mmu(dest, virtual, MMU_UNWRAP(*entry), entry->raw & 0xff);
 }
 
-// make_all_global(mmu_level_1_t*) -> void
-// Makes all entries of the page table (except for meta entries) global.
-void make_all_global(mmu_level_1_t* kernel_mapping) {
-    for (int i = 0; i < (int) (PAGE_SIZE / sizeof(void*)); i++) {
-        mmu_level_2_t* level2 = MMU_UNWRAP(2, kernel_mapping[i]);
-        if (level2 == (void*) 0)
+// copy_mmu_globals(mmu_entry_t*, mmu_entry_t*) -> void
+// Copies the global mappings from one page table to another. Tables for physical memory are shared rather than copied.
+void copy_mmu_globals(mmu_entry_t* dest, mmu_entry_t* src) {
+    // Share tables for physical memory
+    for (unsigned long long p = shared_start; p < shared_end; p += MMU_LEVEL_SIZE(MMU_SHARED_LEVEL)) {
+        mmu_entry_t* from = mmu_walk_to_level(src, (void*) p, MMU_SHARED_LEVEL, 0);
+        if (from == (void*) 0 || from->raw == 0)
             continue;
 
-        for (int j = 0; j < (int) (PAGE_SIZE / sizeof(void*)); j++) {
-            mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[j]);
-            if (level3 == (void*) 0)
-                continue;
-
-            for (int k = 0; k < (int) (PAGE_SIZE / sizeof(void*)); k++) {
-                void* physical = MMU_UNWRAP(4, level3[k]);
-                if (physical == (void*) 0 || physical == kernel_mapping)
-                    continue;
-
-                // Check if the physical address is part of the mmu metamapping
-                char mmu = 0;
-                for (int i = 0; i < (int) (PAGE_SIZE / sizeof(void*)); i++) {
-                    mmu_level_2_t* level2 = MMU_UNWRAP(2, kernel_mapping[i]);
-                    if (level2 == (void*) 0)
-                        continue;
-
-                    if (level2 == physical) {
-                        mmu = 1;
-                        break;
-                    }
-
-                    for (int j = 0; j < (int) (PAGE_SIZE / sizeof(void*)); j++) {
-                        mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[j]);
-                        if (level3 == (void*) 0)
-                            continue;
-
-                        if (level3 == physical) {
-                            mmu = 1;
-                            break;
-                        }
-                    }
-
-                    if (mmu) break;
-                }
-
-                if (!mmu)
-                    level3[k].raw |= MMU_FLAG_GLOBAL;
-            }
-        }
+        mmu_entry_t* to = mmu_walk_to_level(dest, (void*) p, MMU_SHARED_LEVEL, 1);
+        if (to != (void*) 0 && to->raw == 0)
+            *to = *from;
     }
+
+    // Copy everything else (mmio and such)
+    mmu_walk_leaves(src, copy_mmu_global_leaf, dest);
 }
 
-// mmu_protect(mmu_level_1_t*, void*, short, int) -> int
+// mmu_protect(mmu_entry_t*, void*, short, int) -> int
 // Changes the protection levels on the mmu page. Be careful when setting change_alloc to true.
-int mmu_protect(mmu_level_1_t* top, void* virtual, short flags, int change_alloc) {
+int mmu_protect(mmu_entry_t* top, void* virtual, short flags, int change_alloc) {
     virtual = (void*) (((unsigned long long) virtual) & ~0xfff);
-    mmu_level_3_t* physical = walk_mmu_and_get_pointer_to_pointer(top, virtual, 0);
+    mmu_entry_t* physical = mmu_walk_entry(top, virtual, 0);
     if (physical == (void*) 0)
         return -1;
 
+    // Swap entries are not valid mappings, so bring the page back in before making it valid
+    if (!(physical->raw & MMU_FLAG_VALID) && (physical->raw & MMU_FLAG_SWAPPED) && swap_in(physical))
+        return -1;
+
+    // Copy on write pages stay read only until written to, and stop being copy on write if made read only
+    if (!change_alloc && (physical->raw & MMU_FLAG_COW)) {
+        if (flags & MMU_FLAG_WRITE)
+            flags &= ~MMU_FLAG_WRITE;
+        else
+            physical->raw &= ~MMU_FLAG_COW;
+    }
+
     if (change_alloc) {
         physical->raw &= ~0x3ff;
         physical->raw |= flags & 0x3ff | MMU_FLAG_VALID;
@@ -287,51 +334,57 @@ int mmu_protect(mmu_level_1_t* top, void* virtual, short flags, int change_alloc
     return 0;
 }
 
-// unmap_mmu(mmu_level_1_t*, void*) -> void
+// unmap_mmu(mmu_entry_t*, void*) -> void
 // Unmaps a page from the MMU structure.
-void unmap_mmu(mmu_level_1_t* top, void* virtual) {
+void unmap_mmu(mmu_entry_t* top, void* virtual) {
     // Align address to the largest 4096 byte boundary less than the address
     virtual = (void*) (((unsigned long long) virtual) & ~0xfff);
 
     // Get
-    mmu_level_3_t* physical = walk_mmu_and_get_pointer_to_pointer(top, virtual, 0);
+    mmu_entry_t* physical = mmu_walk_entry(top, virtual, 0);
     if (physical == (void*) 0)
         return;
 
     // Deallocate if allocated
-    if (physical->raw & 0x100)
-        dealloc_page(MMU_UNWRAP(4, *physical));
+    if (!(physical->raw & MMU_FLAG_VALID))
+        swap_release(physical);
+    else if (physical->raw & 0x100)
+        dealloc_page(MMU_UNWRAP(*physical));
 
     // Unmap
     physical->raw = 0;
 }
 
-// clean_mmu_mappings(mmu_level_1_t*, char) -> void
-// Deallocates all pages associated with an MMU structure.
-void clean_mmu_mappings(mmu_level_1_t* top, char force) {
-    if (top == (void*) 0)
-        return;
-
-    for (int i = 0; i < (int) (PAGE_SIZE / sizeof(void*)); i++) {
-        mmu_level_2_t* level2 = MMU_UNWRAP(2, top[i]);
-        if (level2 == (void*) 0)
+// clean_mmu_level(mmu_entry_t*, unsigned int, unsigned long long, char) -> void
+// Recursive helper for clean_mmu_mappings().
+static void clean_mmu_level(mmu_entry_t* table, unsigned int level, unsigned long long base, char force) {
+    for (unsigned long long i = 0; i < PAGE_SIZE / sizeof(mmu_entry_t); i++) {
+        if (table[i].raw == 0)
             continue;
 
-        for (int j = 0; j < (int) (PAGE_SIZE / sizeof(void*)); j++) {
-            mmu_level_3_t* level3 = MMU_UNWRAP(3, level2[j]);
-            if (level3 == (void*) 0)
+        unsigned long long virtual = base | (i << (12 + 9 * level));
+        if (level == 0) {
+            if (!(table[i].raw & MMU_FLAG_VALID))
+                swap_release(table + i);
+            else if ((table[i].raw & 0x100) && (force || !(table[i].raw & MMU_FLAG_GLOBAL)))
+                dealloc_page(MMU_UNWRAP(table[i]));
+        } else if ((table[i].raw & MMU_FLAG_VALID) && !(table[i].raw & MMU_FLAG_LEAF)) {
+            // Shared tables belong to the kernel
+            if (level == MMU_SHARED_LEVEL && mmu_is_shared(virtual))
                 continue;
 
-            for (int k = 0; k < PAGE_SIZE / sizeof(void*); k++) {
-                if ((level3[k].raw & 0x100) && (force || !(level3[k].raw & MMU_FLAG_GLOBAL)))
-                    dealloc_page(MMU_UNWRAP(4, level3[k]));
-            }
-
-            dealloc_page(level3);
+            clean_mmu_level(MMU_UNWRAP(table[i]), level - 1, virtual, force);
+            dealloc_page(MMU_UNWRAP(table[i]));
         }
-
-        dealloc_page(level2);
     }
+}
+
+// clean_mmu_mappings(mmu_entry_t*, char) -> void
+// Deallocates all pages associated with an MMU structure.
+void clean_mmu_mappings(mmu_entry_t* top, char force) {
+    if (top == (void*) 0)
+        return;
 
+    clean_mmu_level(top, mmu_levels - 1, 0, force);
     dealloc_page(top);
 }
@@ -4,8 +4,18 @@
 #include "../drivers/devicetree/tree.h"
 #include "../lib/memory.h"
 
-#define MMU_UNWRAP(t, a) ((mmu_level_##t##_t*) ((((a).raw) & ~0x3ff) << 2))
+#define MMU_UNWRAP(a) ((void*) ((((a).raw) & 0x003ffffffffffc00) << 2))
 #define MMU_PAGE_SIZE 4096
+#define MMU_MAX_LEVELS 4
+
+// Gets the index into a page table at the given level for a virtual address. Level 0 contains the leaf entries.
+#define MMU_INDEX(v, level) ((((unsigned long long) (v)) >> (12 + 9 * (level))) & 0x1ff)
+
+// Gets the number of bytes covered by an entry at the given level.
+#define MMU_LEVEL_SIZE(level) (1ull << (12 + 9 * (level)))
+
+// The level whose entries cover a gigabyte; the kernel's tables for physical memory are shared at this level.
+#define MMU_SHARED_LEVEL 2
 
 // Flags
 #define MMU_FLAG_VALID      0b000000001
@@ -18,70 +28,105 @@
 #define MMU_FLAG_DIRTY      0b010000000
 #define MMU_FLAG_ALLOCED    0b100000000
 
-typedef void* mmu_level_4_t;
+// Software bit set on invalid entries whose page has been swapped out. Where the page is in swap is stored where the page number would be.
+#define MMU_FLAG_SWAPPED    0b1000000000
+
+// The same bit on valid entries marks a shared page that is copied when written to. The write bit is cleared while it is set.
+#define MMU_FLAG_COW        0b1000000000
+
+// An entry is a leaf if any of these are set; otherwise it points to the next level.
+#define MMU_FLAG_LEAF (MMU_FLAG_READ | MMU_FLAG_WRITE | MMU_FLAG_EXEC)
 
+// Translation modes as written into the mode field of satp.
+typedef enum {
+    MMU_MODE_BARE = 0,
+    MMU_MODE_SV39 = 8,
+    MMU_MODE_SV48 = 9,
+} mmu_mode_t;
+
+// A page table entry at any level.
 typedef union {
     unsigned long long raw;
     void* addr;
-} mmu_level_3_t;
+} mmu_entry_t;
 
-typedef union {
-    unsigned long long raw;
-    mmu_level_3_t* addr;
-} mmu_level_2_t;
+// The translation mode in use and its number of levels.
+extern mmu_mode_t mmu_mode;
+extern unsigned int mmu_levels;
 
-typedef union {
-    unsigned long long raw;
-    mmu_level_2_t* addr;
-} mmu_level_1_t;
+// The kernel's page table. Every process page table shares its tables for physical memory.
+extern mmu_entry_t* kernel_mmu;
 
-// create_mmu_top() -> mmu_level_1_t*
+// mmu_init_mode(void*) -> void
+// Selects the translation mode from the mmu-type of the boot hart in the device tree. Sv48 is used if available, otherwise Sv39.
+void mmu_init_mode(void* fdt);
+
+// mmu_make_satp(mmu_entry_t*) -> unsigned long long
+// Creates a satp value for a page table using the current translation mode.
+unsigned long long mmu_make_satp(mmu_entry_t* top);
+
+// mmu_current_top() -> mmu_entry_t*
+// Returns the page table currently loaded in satp, or null if translation is disabled.
+mmu_entry_t* mmu_current_top();
+
+// mmu_switch_top(mmu_entry_t*) -> unsigned long long
+// Loads a page table into satp and flushes the tlb. Returns the previous satp value.
+unsigned long long mmu_switch_top(mmu_entry_t* top);
+
+// mmu_user_top() -> void*
+// Returns the end of the lower half of the virtual address space, which is where user mappings live.
+void* mmu_user_top();
+
+// create_mmu_top() -> mmu_entry_t*
 // Creates an MMU data structure.
-mmu_level_1_t* create_mmu_top();
+mmu_entry_t* create_mmu_top();
 
-// premap_mmu(mmu_level_1_t*, void*) -> void
+// premap_mmu(mmu_entry_t*, void*) -> void
 // Walks an mmu page table and allocates the missing entries on the way to the address that would be mapped to the virtual address given without allocating an address to the virtual address.
-void premap_mmu(mmu_level_1_t* top, void* _virtual);
+void premap_mmu(mmu_entry_t* top, void* _virtual);
 
-// map_mmu(mmu_level_1_t*, void*, void*, char) -> int
+// map_mmu(mmu_entry_t*, void*, void*, char) -> int
 // Maps a virtual address to a physical address.
-int map_mmu(mmu_level_1_t* top, void* virtual_, void* physical, char flags);
+int map_mmu(mmu_entry_t* top, void* virtual_, void* physical, char flags);
 
-// alloc_page_mmu(mmu_level_1_t*, void*, char) -> void*
+// alloc_page_mmu(mmu_entry_t*, void*, char) -> void*
 // Allocates a new page to map to a given virtual address. Returns the physical address
-void* alloc_page_mmu(mmu_level_1_t* top, void* virtual_, char flags);
+void* alloc_page_mmu(mmu_entry_t* top, void* virtual_, char flags);
 
-// walk_mmu(mmu_level_1_t*, void*) -> mmu_level_3_t
-// Walks an mmu page table and returns the physical address associated with the given virtual address. Returns null if unmapped.
-mmu_level_3_t walk_mmu(mmu_level_1_t* top, void* _virtual);
+// walk_mmu(mmu_entry_t*, void*) -> mmu_entry_t
+// Walks an mmu page table and returns the leaf entry associated with the given virtual address. Returns a zeroed entry if unmapped.
+mmu_entry_t walk_mmu(mmu_entry_t* top, void* _virtual);
 
-// mmu_map_range_identity(mmu_level_1_t*, void*, void*, char) -> void
-// Maps a range onto itself in an mmu page table.
-void mmu_map_range_identity(mmu_level_1_t* top, void* start, void* end, char flags);
+// mmu_walk_entry(mmu_entry_t*, void*, int) -> mmu_entry_t*
+// Walks an mmu page table and returns a pointer to the leaf entry for the given virtual address. Missing tables are allocated if create_pages is true, otherwise null is returned.
+mmu_entry_t* mmu_walk_entry(mmu_entry_t* top, void* _virtual, int create_pages);
+
+// mmu_walk_leaves(mmu_entry_t*, void (*)(void*, mmu_entry_t*, void*), void*) -> void
+// Calls the given function with the virtual address and entry of every nonzero leaf entry in a page table. Tables shared with the kernel are skipped.
+void mmu_walk_leaves(mmu_entry_t* top, void (*callback)(void*, mmu_entry_t*, void*), void* data);
 
-// mmu_map_kernel(mmu_level_1_t*, fdt_header_t*) -> void
-// Maps the kernel onto an mmu page table.
-void mmu_map_kernel(mmu_level_1_t* top, fdt_header_t* fdt);
+// mmu_map_range_identity(mmu_entry_t*, void*, void*, char) -> void
+// Maps a range onto itself in an mmu page table.
+void mmu_map_range_identity(mmu_entry_t* top, void* start, void* end, char flags);
 
-// copy_mmu_globals(mmu_level_1_t*, mmu_level_1_t*) -> void
-// Copies the global mappings from one page table to another.
-void copy_mmu_globals(mmu_level_1_t* dest, mmu_level_1_t* src);
+// mmu_map_kernel(mmu_entry_t*, fdt_header_t*) -> void
+// Maps the kernel and all of physical memory onto an mmu page table and makes it the kernel page table.
+void mmu_map_kernel(mmu_entry_t* top, fdt_header_t* fdt);
 
-// make_all_global(mmu_level_1_t*) -> void
-// Makes all entries of the page table (except for meta entries) global.
-void make_all_global(mmu_level_1_t* kernel_mapping);
+// copy_mmu_globals(mmu_entry_t*, mmu_entry_t*) -> void
+// Copies the global mappings from one page table to another. Tables for physical memory are shared rather than copied.
+void copy_mmu_globals(mmu_entry_t* dest, mmu_entry_t* src);
 
-// mmu_protect(mmu_level_1_t*, void*, short, int) -> int
+// mmu_protect(mmu_entry_t*, void*, short, int) -> int
 // Changes the protection levels on the mmu page. Be careful when setting change_alloc to true.
-int mmu_protect(mmu_level_1_t* top, void* virtual_, short flags, int change_alloc);
+int mmu_protect(mmu_entry_t* top, void* virtual_, short flags, int change_alloc);
 
-// unmap_mmu(mmu_level_1_t*, void*) -> void
+// unmap_mmu(mmu_entry_t*, void*) -> void
 // Unmaps a page from the MMU structure.
-void unmap_mmu(mmu_level_1_t* top, void* _virtual);
+void unmap_mmu(mmu_entry_t* top, void* _virtual);
 
-// clean_mmu_mappings(mmu_level_1_t*, char) -> void
+// clean_mmu_mappings(mmu_entry_t*, char) -> void
 // Deallocates all pages associated with an MMU structure.
-void clean_mmu_mappings(mmu_level_1_t* top, char force);
+void clean_mmu_mappings(mmu_entry_t* top, char force);
 
 #endif /* KERNEL_MMU_H */
-
@@ -0,0 +1,102 @@
+#include "pagefault.h"
+#include "process.h"
+#include "swap.h"
+#include "workingset.h"
+
+// break_cow(mmu_entry_t*) -> char
+// Makes a copy on write page writable, copying it first if it is still shared. Returns 0 on success.
+static char break_cow(mmu_entry_t* entry) {
+    void* old = MMU_UNWRAP(*entry);
+    if (page_references(old) > 1) {
+        void* page = alloc_page(1);
+        if (page == (void*) 0)
+            return -1;
+        memcpy(page, old, PAGE_SIZE);
+        entry->raw = (((unsigned long long) page) >> 2) | (entry->raw & 0x3ff);
+        dealloc_page(old);
+        workingset_reset_page(page);
+    }
+
+    entry->raw = (entry->raw & ~MMU_FLAG_COW) | MMU_FLAG_WRITE | MMU_FLAG_ACCESSED | MMU_FLAG_DIRTY;
+    return 0;
+}
+
+// handle_page_fault(trap_t*, page_fault_t, void*) -> char
+// Handles a page fault from a user process. Returns 0 if the faulting access can be retried.
+char handle_page_fault(trap_t* trap, page_fault_t cause, void* address) {
+    process_t* process = fetch_process(trap->pid);
+    mmu_entry_t* entry = mmu_walk_entry(process->mmu_data, address, 0);
+
+    // Bring swapped out pages back in
+    if (entry != (void*) 0 && !(entry->raw & MMU_FLAG_VALID) && (entry->raw & MMU_FLAG_SWAPPED) && (entry->raw & MMU_FLAG_USER)) {
+        if (swap_in(entry))
+            return -1;
+        asm volatile("sfence.vma %0, zero" : : "r" (address));
+        return 0;
+    }
+
+    if (entry == (void*) 0 || (entry->raw & (MMU_FLAG_VALID | MMU_FLAG_USER)) != (MMU_FLAG_VALID | MMU_FLAG_USER))
+        return -1;
+
+    unsigned long long needed;
+    switch (cause) {
+        case PAGE_FAULT_INSTRUCTION:
+            needed = MMU_FLAG_EXEC;
+            break;
+        case PAGE_FAULT_LOAD:
+            needed = MMU_FLAG_READ;
+            break;
+        case PAGE_FAULT_STORE:
+            needed = MMU_FLAG_WRITE;
+            break;
+        default:
+            return -1;
+    }
+
+    // Writes to copy on write pages get their own copy
+    if (cause == PAGE_FAULT_STORE && !(entry->raw & MMU_FLAG_WRITE) && (entry->raw & MMU_FLAG_COW)) {
+        if (break_cow(entry))
+            return -1;
+        asm volatile("sfence.vma %0, zero" : : "r" (address));
+        return 0;
+    }
+
+    if ((entry->raw & needed) == 0)
+        return -1;
+
+    // Harts that do not update the accessed and dirty bits in hardware fault instead, so set them here
+    entry->raw |= MMU_FLAG_ACCESSED;
+    if (cause == PAGE_FAULT_STORE)
+        entry->raw |= MMU_FLAG_DIRTY;
+    asm volatile("sfence.vma %0, zero" : : "r" (address));
+    return 0;
+}
+
+// fault_in_user_range(mmu_entry_t*, void*, unsigned long long, char) -> char
+// Resolves the faults the kernel would take accessing a range of user memory, since kernel page faults cannot be recovered from. Swapped out pages are brought in and, if the kernel will write to the range, copy on write pages are copied. Unmapped pages are skipped. Returns 0 on success.
+char fault_in_user_range(mmu_entry_t* top, void* start, unsigned long long length, char write) {
+    unsigned long long page = ((unsigned long long) start) & ~(PAGE_SIZE - 1);
+    unsigned long long end = ((unsigned long long) start) + length;
+    char changed = 0;
+    for (; page < end; page += PAGE_SIZE) {
+        mmu_entry_t* entry = mmu_walk_entry(top, (void*) page, 0);
+        if (entry == (void*) 0 || entry->raw == 0)
+            continue;
+
+        if (!(entry->raw & MMU_FLAG_VALID)) {
+            if ((entry->raw & MMU_FLAG_SWAPPED) && swap_in(entry))
+                return -1;
+            changed = 1;
+        }
+
+        if (write && (entry->raw & MMU_FLAG_VALID) && !(entry->raw & MMU_FLAG_WRITE) && (entry->raw & MMU_FLAG_COW)) {
+            if (break_cow(entry))
+                return -1;
+            changed = 1;
+        }
+    }
+
+    if (changed)
+        asm volatile("sfence.vma zero, zero");
+    return 0;
+}
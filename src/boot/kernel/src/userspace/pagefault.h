@@ -0,0 +1,22 @@
+#ifndef KERNEL_PAGEFAULT_H
+#define KERNEL_PAGEFAULT_H
+
+#include "../interrupts.h"
+#include "mmu.h"
+
+// scause values for page faults.
+typedef enum {
+    PAGE_FAULT_INSTRUCTION = 0x0c,
+    PAGE_FAULT_LOAD = 0x0d,
+    PAGE_FAULT_STORE = 0x0f,
+} page_fault_t;
+
+// handle_page_fault(trap_t*, page_fault_t, void*) -> char
+// Handles a page fault from a user process. Returns 0 if the faulting access can be retried.
+char handle_page_fault(trap_t* trap, page_fault_t cause, void* address);
+
+// fault_in_user_range(mmu_entry_t*, void*, unsigned long long, char) -> char
+// Resolves the faults the kernel would take accessing a range of user memory, since kernel page faults cannot be recovered from. Swapped out pages are brought in and, if the kernel will write to the range, copy on write pages are copied. Unmapped pages are skipped. Returns 0 on success.
+char fault_in_user_range(mmu_entry_t* top, void* start, unsigned long long length, char write);
+
+#endif /* KERNEL_PAGEFAULT_H */
@@ -1,56 +1,99 @@
+#include "../lib/lock.h"
 #include "../lib/memory.h"
 #include "process.h"
+#include "sched.h"
+#include "futex.h"
+#include "uring.h"
+#include "vdso.h"
+#include "../interrupts.h"
 
 pid_t MAX_PID = 10000;
 pid_t current_pid = 1;
 process_t* process_table;
 
-unsigned long long JOB_QUEUE_SIZE = 4096;
-unsigned long long job_queue_pos = 0;
-pid_t* job_queue;
+// Protects handing out process table entries
+spinlock_t process_table_lock = { 0 };
+
 
 // init_process_table() -> void
 // Initialises the process table.
 void init_process_table() {
     process_table = malloc(MAX_PID * sizeof(process_t));
-    job_queue = malloc(JOB_QUEUE_SIZE * sizeof(pid_t));
+}
+
+// process_kernel_stack(process_t*) -> void*
+// Returns the kernel stack of a process table entry, allocating it if the entry has never been used. Stacks are kept when entries are reused.
+static void* process_kernel_stack(process_t* process) {
+    if (process->kernel_stack == (void*) 0)
+        return alloc_page(KERNEL_STACK_PAGES);
+    return process->kernel_stack;
 }
 
 // spawn_process(pid_t) -> pid_t
 // Spawns a process given its parent process. Returns 0 if unsuccessful.
 pid_t spawn_process(pid_t parent_pid) {
+    unsigned long long flags = spinlock_acquire_irqsave(&process_table_lock);
     if (current_pid < MAX_PID) {
+        void* kernel_stack = process_kernel_stack(&process_table[current_pid]);
+        if (kernel_stack == (void*) 0) {
+            spinlock_release_irqrestore(&process_table_lock, flags);
+            return 0;
+        }
+
         process_table[current_pid] = (process_t) {
             .pid = current_pid,
             .parent_pid = parent_pid,
             .state = PROCESS_STATE_WAIT,
             .mmu_data = (void*) 0,
+            .mmap_next = (void*) 0,
             .file_descriptors = (void*) 0,
-            .pc = 0,
-            .xs = { 0 },
-            .fs = { 0.0 }
+            .workingset = { 0 },
+            .kernel_stack = kernel_stack,
+            .uring = (void*) 0,
+            .futex_key = 0,
+            .futex_page = (void*) 0,
+            .trap = { 0 },
+            .fs = { 0.0 },
+            .fcsr = 0,
+            .fp_hart = SCHED_NO_HART
         };
+        sched_init_process(&process_table[current_pid]);
         pid_t pid = current_pid;
         current_pid++;
+        spinlock_release_irqrestore(&process_table_lock, flags);
         return pid;
     }
 
     for (pid_t i = 1; i < MAX_PID; i++) {
         if (process_table[i].state == PROCESS_STATE_DEAD) {
+            void* kernel_stack = process_kernel_stack(&process_table[i]);
+            if (kernel_stack == (void*) 0)
+                break;
+
             process_table[i] = (process_t) {
                 .pid = i,
                 .parent_pid = parent_pid,
                 .state = PROCESS_STATE_WAIT,
                 .mmu_data = (void*) 0,
+                .mmap_next = (void*) 0,
                 .file_descriptors = (void*) 0,
-                .pc = 0,
-                .xs = { 0 },
-                .fs = { 0.0 }
+                .workingset = { 0 },
+                .kernel_stack = kernel_stack,
+                .uring = (void*) 0,
+                .futex_key = 0,
+                .futex_page = (void*) 0,
+                .trap = { 0 },
+                .fs = { 0.0 },
+                .fcsr = 0,
+                .fp_hart = SCHED_NO_HART
             };
+            sched_init_process(&process_table[i]);
+            spinlock_release_irqrestore(&process_table_lock, flags);
             return i;
         }
     }
 
+    spinlock_release_irqrestore(&process_table_lock, flags);
     return 0;
 }
 
@@ -60,20 +103,36 @@ process_t* fetch_process(pid_t pid) {
     return &process_table[pid];
 }
 
+// next_live_process(pid_t) -> pid_t
+// Returns the next process after the given pid that is alive and has a page table, or 0 if there is none.
+pid_t next_live_process(pid_t pid) {
+    for (pid_t i = pid + 1; i < current_pid; i++) {
+        if (process_table[i].state != PROCESS_STATE_DEAD && process_table[i].mmu_data != (void*) 0)
+            return i;
+    }
+
+    return 0;
+}
+
 // load_elf_as_process(pid_t, elf_t*) -> pid_t
-// Uses an elf file as a process.
+// Uses an elf file as a process. Returns 0 if unsuccessful.
 pid_t load_elf_as_process(pid_t parent_pid, elf_t* elf, unsigned int stack_page_count) {
     pid_t pid = spawn_process(parent_pid);
     if (pid == 0)
         return pid;
 
     process_t* process = fetch_process(pid);
-    process->file_descriptors = malloc(FILE_DESCRIPTOR_COUNT * sizeof(void*));
     process->mmu_data = create_mmu_top();
-    for (unsigned long long i = 0; i < FILE_DESCRIPTOR_COUNT * sizeof(void*); i++) {
-        void* map = (void*) (process->file_descriptors) + i * PAGE_SIZE;
-        map_mmu(process->mmu_data, map, map, MMU_FLAG_READ | MMU_FLAG_WRITE);
+
+    // The vdso sits below the executable, which is linked well above it
+    if (vdso_map(process)) {
+        kill_process(pid);
+        return 0;
     }
+    process->file_descriptors = malloc(FILE_DESCRIPTOR_COUNT * sizeof(void*));
+
+    // Anonymous mappings go in the upper part of user space, well away from the executable
+    process->mmap_next = (void*) (((unsigned long long) mmu_user_top()) >> 1);
 
     void* last_pointer = 0;
     for (int i = 0; i < elf->header.program_header_num; i++) {
@@ -92,6 +151,9 @@ pid_t load_elf_as_process(pid_t parent_pid, elf_t* elf, unsigned int stack_page_
 
         if (last_pointer < ptr)
             last_pointer = (void*) (((unsigned long long) ptr + PAGE_SIZE - 1) & ~0xfff);
+
+        // Segments are copied with the new process not yet queued, so it is safe to be preempted between them
+        kernel_preempt_point();
     }
 
     for (unsigned int i = 0; i < stack_page_count; i++) {
@@ -99,9 +161,9 @@ pid_t load_elf_as_process(pid_t parent_pid, elf_t* elf, unsigned int stack_page_
         last_pointer += MMU_PAGE_SIZE;
     }
 
-    process->pc = elf->header.entry;
-    process->xs[PROCESS_REGISTER_SP] = (unsigned long long) last_pointer;
-    process->xs[PROCESS_REGISTER_FP] = (unsigned long long) last_pointer;
+    process->trap.pc = elf->header.entry;
+    process->trap.xs[PROCESS_REGISTER_SP] = (unsigned long long) last_pointer;
+    process->trap.xs[PROCESS_REGISTER_FP] = (unsigned long long) last_pointer;
 
     return pid;
 }
@@ -110,42 +172,13 @@ pid_t load_elf_as_process(pid_t parent_pid, elf_t* elf, unsigned int stack_page_
 // Initialises a process's mmu by setting up the kernel part of hte mmu.
 void process_init_kernel_mmu(pid_t pid) {
     process_t* process = fetch_process(pid);
-    unsigned long long mmu;
-    mmu_level_1_t* top = (void*) 0;
-    asm volatile("csrr %0, satp" : "=r" (mmu));
-    top = (void*) ((mmu & 0x00000fffffffffff) << 12);
-    copy_mmu_globals(process->mmu_data, top);
+    copy_mmu_globals(process->mmu_data, kernel_mmu);
 }
 
 // add_process_to_queue(pid_t) -> int
 // Adds a process to the jobs queue. Returns true if added to the queue.
 int add_process_to_queue(pid_t pid) {
-    for (unsigned long long i = 0; i < JOB_QUEUE_SIZE; i++) {
-        if (job_queue[i] == 0) {
-            job_queue[i] = pid;
-            return 1;
-        }
-    }
-
-    return 0;
-}
-
-// next_process_in_queue() -> pid_t
-// Returns the next process in the queue, or 0 if no such process exists.
-pid_t next_process_in_queue() {
-    unsigned long long last_in_queue = job_queue_pos++;
-    if (last_in_queue >= JOB_QUEUE_SIZE)
-        last_in_queue %= JOB_QUEUE_SIZE;
-
-    while (last_in_queue != job_queue_pos) {
-        if (job_queue[job_queue_pos] != 0)
-            return job_queue[job_queue_pos];
-        job_queue_pos++;
-        if (job_queue_pos >= JOB_QUEUE_SIZE)
-            job_queue_pos %= JOB_QUEUE_SIZE;
-    }
-
-    return job_queue[last_in_queue];
+    return !sched_wakeup(fetch_process(pid));
 }
 
 // kill_process(pid_t) -> void
@@ -160,11 +193,10 @@ void kill_process(pid_t pid) {
     }
 
     process->state = PROCESS_STATE_DEAD;
-
-    for (unsigned long long i = 0; i < JOB_QUEUE_SIZE; i++) {
-        if (job_queue[i] == pid)
-            job_queue[i] = 0;
-    }
+    run_queue_remove(process);
+    uring_release(process);
+    futex_release(process);
+    timer_cancel(&process->sleep_timer);
 
     clean_mmu_mappings(process->mmu_data, 0);
 }
@@ -3,10 +3,14 @@
 
 #include "elffile.h"
 #include "mmu.h"
+#include "timer.h"
 #include "../drivers/filesystems/generic_file.h"
 
 #define FILE_DESCRIPTOR_COUNT 1024
 
+// Number of pages in the kernel stack of each process.
+#define KERNEL_STACK_PAGES 4
+
 #define PROCESS_REGISTER_ZERO   0
 #define PROCESS_REGISTER_RA     1
 #define PROCESS_REGISTER_SP     2
@@ -49,15 +53,83 @@ typedef enum {
 
 typedef unsigned long long pid_t;
 
+extern pid_t MAX_PID;
+
+// Working set estimates maintained by the accessed/dirty bit scanner. Averages are fixed point with WORKINGSET_SHIFT fractional bits.
+typedef struct {
+    unsigned long long resident;
+    unsigned long long accessed;
+    unsigned long long dirtied;
+    unsigned long long working_set;
+    unsigned long long dirty_rate;
+    unsigned long long last_scan;
+    unsigned long long interval;
+    unsigned long long scans;
+} process_workingset_t;
+
+// Scheduling state used by the fair scheduler. Virtual runtime is in ticks of the time CSR, scaled down for heavier processes.
+typedef struct {
+    unsigned long long vruntime;
+    unsigned long long weight;
+    unsigned long long run_start;
+    unsigned long long heap_index;
+    unsigned long long hart;
+    int nice;
+} process_sched_t;
+
+// Trap frame of a process, which the trap handler saves registers into and restores them from. sscratch points to the frame of the process running on each hart. Floating point registers are not saved on traps; see save_process_trap().
+typedef struct {
+    unsigned long long hartid;
+    pid_t pid;
+    unsigned long long pc;
+    unsigned long long xs[32];
+    void* isr_stack;
+} trap_t;
+
+// Callee saved registers of a kernel context that switched away inside the kernel.
+typedef struct {
+    unsigned long long ra;
+    unsigned long long sp;
+    unsigned long long s[12];
+} kcontext_t;
+
 typedef struct s_process {
     pid_t pid;
     pid_t parent_pid;
     process_state_t state;
-    mmu_level_1_t* mmu_data;
+    struct s_run_queue* run_queue;
+    process_sched_t sched;
+    mmu_entry_t* mmu_data;
+    void* mmap_next;
     generic_file_t** file_descriptors;
-    unsigned long long pc;
-    unsigned long long xs[32];
+    process_workingset_t workingset;
+
+    // Traps are handled on the process's own kernel stack, so a process can sleep in the middle of a syscall
+    void* kernel_stack;
+    kcontext_t kcontext;
+    char kernel_sleeping;
+    char in_syscall;
+    unsigned int atomic;
+
+    // Next process in the wait queue the process is sleeping on
+    struct s_process* wait_next;
+
+    // Wakes the process up when a sleep or a timed wait runs out
+    ktimer_t sleep_timer;
+
+    // Submission and completion ring shared with the process, if it set one up (uring_t*)
+    void* uring;
+
+    // Physical address of the futex the process is waiting on, or 0 if it is not waiting, and the page kept from moving while it waits
+    unsigned long long futex_key;
+    void* futex_page;
+
+    trap_t trap;
+
+    // Floating point registers followed by fcsr, saved only when dirty and loaded on first use. fp_hart is the hart they were last loaded into or saved from.
     double fs[32];
+    unsigned long long fcsr;
+    unsigned long long fp_hart;
 } process_t;
 
 // init_process_table() -> void
@@ -72,8 +144,12 @@ pid_t spawn_process(pid_t parent_pid);
 // Fetches a process from the process table.
 process_t* fetch_process(pid_t pid);
 
+// next_live_process(pid_t) -> pid_t
+// Returns the next process after the given pid that is alive and has a page table, or 0 if there is none.
+pid_t next_live_process(pid_t pid);
+
 // load_elf_as_process(pid_t, elf_t*) -> pid_t
-// Uses an elf file as a process.
+// Uses an elf file as a process. Returns 0 if unsuccessful.
 pid_t load_elf_as_process(pid_t parent_pid, elf_t* elf, unsigned int stack_page_count);
 
 // process_init_kernel_mmu(pid_t) -> void
@@ -84,10 +160,6 @@ void process_init_kernel_mmu(pid_t pid);
 // Adds a process to the jobs queue. Returns true if added to the queue.
 int add_process_to_queue(pid_t pid);
 
-// next_process_in_queue() -> pid_t
-// Returns the next process in the queue, or 0 if no such process exists.
-pid_t next_process_in_queue();
-
 // kill_process(pid_t) -> void
 // Kills the given process.
 void kill_process(pid_t pid);
@@ -0,0 +1,455 @@
+#include "sched.h"
+#include "mmu.h"
+
+// Weights for nice values from -20 to 19. Each step is about a 10% difference in processor time.
+static const unsigned int sched_nice_weights[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+sched_hart_t sched_harts[SMP_MAX_HARTS] = { 0 };
+
+extern void kcontext_switch(kcontext_t* save, kcontext_t* load);
+extern void kcontext_trap_return();
+
+// sched_time() -> unsigned long long
+// Reads the time CSR.
+static unsigned long long sched_time() {
+    unsigned long long time;
+    asm volatile("csrr %0, time" : "=r" (time));
+    return time;
+}
+
+// sched_scale(unsigned long long, process_t*) -> unsigned long long
+// Converts real time into virtual runtime for a process.
+static unsigned long long sched_scale(unsigned long long delta, process_t* process) {
+    return delta * SCHED_NICE_0_WEIGHT / process->sched.weight;
+}
+
+// sched_before(process_t*, process_t*) -> char
+// Checks if a process has less virtual runtime than another.
+static char sched_before(process_t* a, process_t* b) {
+    return (long long) (a->sched.vruntime - b->sched.vruntime) < 0;
+}
+
+// sched_init_hart(unsigned long long, void*) -> void
+// Initialises the run queue and idle process of a hart. Traps taken while the hart is idle are handled on the given stack.
+void sched_init_hart(unsigned long long hartid, void* isr_stack) {
+    sched_hart_t* hart = &sched_harts[hartid];
+    hart->current = (void*) 0;
+
+    // The idle process runs on the kernel page table
+    hart->idle = (process_t) { 0 };
+    hart->idle.pid = 0;
+    hart->idle.state = PROCESS_STATE_RUNNING;
+    hart->idle.mmu_data = kernel_mmu;
+    hart->idle.sched.hart = hartid;
+    hart->idle.fp_hart = SCHED_NO_HART;
+    hart->idle.trap.hartid = hartid;
+    hart->idle.trap.isr_stack = isr_stack;
+    hart->idle_stack = isr_stack;
+}
+
+// sched_idle_process(unsigned long long) -> process_t*
+// Returns the idle process of a hart.
+process_t* sched_idle_process(unsigned long long hartid) {
+    return &sched_harts[hartid].idle;
+}
+
+// sched_current_process() -> process_t*
+// Returns the process running on the current hart, or null if the hart is idle.
+process_t* sched_current_process() {
+    return sched_harts[current_hartid()].current;
+}
+
+// sched_kernel_stack_top(process_t*, unsigned long long) -> void*
+// Returns the top of the stack traps are handled on while a process runs on a hart.
+void* sched_kernel_stack_top(process_t* process, unsigned long long hartid) {
+    if (process->pid == 0)
+        return sched_harts[hartid].idle_stack;
+    return process->kernel_stack + KERNEL_STACK_PAGES * PAGE_SIZE;
+}
+
+// sched_timer_wakeup(ktimer_t*, void*) -> void
+// Wakes up a process whose sleep timer ran out.
+static void sched_timer_wakeup(ktimer_t* timer, void* data) {
+    (void) timer;
+    sched_wakeup(data);
+}
+
+// sched_init_process(process_t*) -> void
+// Initialises the scheduling state of a newly spawned process.
+void sched_init_process(process_t* process) {
+    timer_init(&process->sleep_timer, sched_timer_wakeup, process);
+    process->run_queue = (void*) 0;
+    process->sched = (process_sched_t) {
+        .vruntime = sched_harts[current_hartid()].run_queue.min_vruntime,
+        .weight = SCHED_NICE_0_WEIGHT,
+        .run_start = 0,
+        .heap_index = 0,
+        .hart = SCHED_NO_HART,
+        .nice = 0
+    };
+}
+
+// run_queue_set(run_queue_t*, unsigned long long, process_t*) -> void
+// Puts a process at a position in the heap.
+static void run_queue_set(run_queue_t* queue, unsigned long long i, process_t* process) {
+    queue->heap[i] = process;
+    process->sched.heap_index = i;
+}
+
+// run_queue_sift_up(run_queue_t*, unsigned long long) -> void
+// Moves a process up the heap until its parent has less virtual runtime.
+static void run_queue_sift_up(run_queue_t* queue, unsigned long long i) {
+    process_t* process = queue->heap[i];
+    while (i > 0) {
+        unsigned long long parent = (i - 1) / 2;
+        if (!sched_before(process, queue->heap[parent]))
+            break;
+        run_queue_set(queue, i, queue->heap[parent]);
+        i = parent;
+    }
+    run_queue_set(queue, i, process);
+}
+
+// run_queue_sift_down(run_queue_t*, unsigned long long) -> void
+// Moves a process down the heap until its children have more virtual runtime.
+static void run_queue_sift_down(run_queue_t* queue, unsigned long long i) {
+    process_t* process = queue->heap[i];
+    while (1) {
+        unsigned long long child = 2 * i + 1;
+        if (child >= queue->length)
+            break;
+        if (child + 1 < queue->length && sched_before(queue->heap[child + 1], queue->heap[child]))
+            child++;
+        if (!sched_before(queue->heap[child], process))
+            break;
+        run_queue_set(queue, i, queue->heap[child]);
+        i = child;
+    }
+    run_queue_set(queue, i, process);
+}
+
+// run_queue_push(run_queue_t*, process_t*) -> char
+// Adds a process to a run queue. Returns 0 on success.
+char run_queue_push(run_queue_t* queue, process_t* process) {
+    if (queue->length == queue->capacity) {
+        unsigned long long capacity = queue->capacity != 0 ? queue->capacity * 2 : 64;
+        process_t** heap = malloc(capacity * sizeof(process_t*));
+        if (heap == (void*) 0)
+            return -1;
+        memcpy(heap, queue->heap, queue->length * sizeof(process_t*));
+        free(queue->heap);
+        queue->heap = heap;
+        queue->capacity = capacity;
+    }
+
+    process->run_queue = queue;
+    run_queue_set(queue, queue->length++, process);
+    run_queue_sift_up(queue, queue->length - 1);
+    queue->total_weight += process->sched.weight;
+    return 0;
+}
+
+// run_queue_remove(process_t*) -> void
+// Removes a process from the run queue it is in, if any.
+void run_queue_remove(process_t* process) {
+    run_queue_t* queue = process->run_queue;
+    if (queue == (void*) 0)
+        return;
+
+    // Fill the hole with the last process and restore the heap order around it
+    unsigned long long i = process->sched.heap_index;
+    process_t* last = queue->heap[--queue->length];
+    if (i != queue->length) {
+        run_queue_set(queue, i, last);
+        run_queue_sift_up(queue, i);
+        run_queue_sift_down(queue, last->sched.heap_index);
+    }
+
+    queue->total_weight -= process->sched.weight;
+    process->run_queue = (void*) 0;
+}
+
+// run_queue_pop(run_queue_t*) -> process_t*
+// Removes and returns the process with the least virtual runtime, or null if the queue is empty.
+process_t* run_queue_pop(run_queue_t* queue) {
+    if (queue->length == 0)
+        return (void*) 0;
+
+    process_t* process = queue->heap[0];
+    run_queue_remove(process);
+    return process;
+}
+
+// sched_select_hart(process_t*) -> unsigned long long
+// Picks the hart to queue a waking process on: its last hart if that is idle, then any idle hart, then its last hart, then the current one.
+static unsigned long long sched_select_hart(process_t* process) {
+    unsigned long long last = process->sched.hart;
+    if (last < SMP_MAX_HARTS && !hart_online[last])
+        last = SCHED_NO_HART;
+    if (last != SCHED_NO_HART && sched_harts[last].current == (void*) 0)
+        return last;
+
+    for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++) {
+        if (hart_online[i] && sched_harts[i].current == (void*) 0)
+            return i;
+    }
+
+    return last != SCHED_NO_HART ? last : current_hartid();
+}
+
+// sched_kick(unsigned long long) -> void
+// Makes a hart reschedule as soon as possible.
+static void sched_kick(unsigned long long hartid) {
+    // The timer belongs to the time slice and pending timers, so the current hart interrupts itself with a software interrupt instead
+    if (hartid == current_hartid()) {
+        unsigned long long ssip = 0x2;
+        asm volatile("csrs sip, %0" : : "r" (ssip));
+    } else {
+        smp_send_ipi(hartid);
+    }
+}
+
+// sched_wakeup(process_t*) -> char
+// Makes a process runnable on its last hart or an idle one, preempting the running process there if the woken one has been served much less. Returns 0 if the process was queued.
+char sched_wakeup(process_t* process) {
+    if (process->state == PROCESS_STATE_DEAD || process->state == PROCESS_STATE_RUNNING || process->run_queue != (void*) 0)
+        return -1;
+
+    unsigned long long hartid = sched_select_hart(process);
+    sched_hart_t* hart = &sched_harts[hartid];
+    run_queue_t* queue = &hart->run_queue;
+
+    // Virtual runtime is relative to the queue, so carry it over when moving between harts
+    unsigned long long last = process->sched.hart;
+    if (last != SCHED_NO_HART && last != hartid)
+        process->sched.vruntime += queue->min_vruntime - sched_harts[last].run_queue.min_vruntime;
+    else if (last == SCHED_NO_HART)
+        process->sched.vruntime = queue->min_vruntime;
+    process->sched.hart = hartid;
+
+    // Sleepers get at most half a latency period of credit so that they cannot hog the processor after waking
+    unsigned long long floor = queue->min_vruntime - SCHED_LATENCY / 2;
+    if (queue->min_vruntime >= SCHED_LATENCY / 2 && process->sched.vruntime < floor)
+        process->sched.vruntime = floor;
+
+    // A process that could not be queued keeps its old state so that a later wakeup can try again
+    process_state_t state = process->state;
+    process->state = PROCESS_STATE_WAIT;
+    if (run_queue_push(queue, process)) {
+        process->state = state;
+        return -1;
+    }
+
+    // Preempt the running process, or wake up the idle process, by rescheduling the hart right away
+    process_t* current = hart->current;
+    if (current == (void*) 0) {
+        sched_kick(hartid);
+    } else if (current->state == PROCESS_STATE_RUNNING) {
+        unsigned long long vruntime = current->sched.vruntime + sched_scale(sched_time() - current->sched.run_start, current);
+        if ((long long) (process->sched.vruntime + SCHED_WAKEUP_GRANULARITY - vruntime) < 0)
+            sched_kick(hartid);
+    }
+
+    return 0;
+}
+
+// sched_steal(unsigned long long) -> process_t*
+// Takes the process with the least virtual runtime from the hart with the most queued processes and moves it to the given hart. Returns null if no other hart has anything queued.
+static process_t* sched_steal(unsigned long long hartid) {
+    sched_hart_t* busiest = (void*) 0;
+    for (unsigned long long i = 0; i < SMP_MAX_HARTS; i++) {
+        if (i == hartid || !hart_online[i] || sched_harts[i].run_queue.length == 0)
+            continue;
+        if (busiest == (void*) 0 || sched_harts[i].run_queue.length > busiest->run_queue.length)
+            busiest = &sched_harts[i];
+    }
+
+    if (busiest == (void*) 0)
+        return (void*) 0;
+
+    process_t* process = run_queue_pop(&busiest->run_queue);
+    process->sched.vruntime += sched_harts[hartid].run_queue.min_vruntime - busiest->run_queue.min_vruntime;
+    process->sched.hart = hartid;
+    return process;
+}
+
+// sched_next(pid_t, unsigned long long*) -> pid_t
+// Charges the running process for its time, requeues it, and picks the process with the least virtual runtime from the current hart's run queue, stealing from the busiest hart if it is empty. The length of its time slice is written to slice. Returns 0, the idle process, with a slice of 0 if there is nothing to run.
+pid_t sched_next(pid_t current, unsigned long long* slice) {
+    unsigned long long now = sched_time();
+    unsigned long long hartid = current_hartid();
+    sched_hart_t* hart = &sched_harts[hartid];
+    run_queue_t* queue = &hart->run_queue;
+
+    // Process 0 is the idle process and is never queued
+    if (current != 0) {
+        process_t* process = fetch_process(current);
+        process->sched.vruntime += sched_scale(now - process->sched.run_start, process);
+        if (process->state == PROCESS_STATE_RUNNING) {
+            process->state = PROCESS_STATE_WAIT;
+            run_queue_push(queue, process);
+        }
+    }
+
+    *slice = 0;
+    process_t* next = run_queue_pop(queue);
+    if (next == (void*) 0)
+        next = sched_steal(hartid);
+    hart->current = next;
+    if (next == (void*) 0)
+        return 0;
+
+    // Virtual runtime only moves forward, so new and waking processes can be placed relative to it
+    if ((long long) (next->sched.vruntime - queue->min_vruntime) > 0)
+        queue->min_vruntime = next->sched.vruntime;
+
+    next->state = PROCESS_STATE_RUNNING;
+    next->sched.run_start = now;
+    next->sched.hart = hartid;
+
+    // Each process gets a share of the latency period in proportion to its weight
+    *slice = SCHED_LATENCY * next->sched.weight / (queue->total_weight + next->sched.weight);
+    if (*slice < SCHED_MIN_GRANULARITY)
+        *slice = SCHED_MIN_GRANULARITY;
+    return next->pid;
+}
+
+// sched_running_elsewhere(process_t*) -> char
+// Checks if a process is running on another hart, which may have its mappings cached in its tlb and be writing through them.
+char sched_running_elsewhere(process_t* process) {
+    return process->state == PROCESS_STATE_RUNNING && process->sched.hart != current_hartid();
+}
+
+// sched_can_remap(process_t*) -> char
+// Checks if swap and page merging may change the mappings of a live process under it. Processes running on other harts and processes in a syscall, which may be sleeping with user memory checked by fault_in_user_range(), are left alone.
+char sched_can_remap(process_t* process) {
+    return !sched_running_elsewhere(process) && !process->in_syscall;
+}
+
+// sched_can_sleep() -> char
+// Checks if the current kernel context belongs to a process in a syscall and is outside of atomic sections, so that it may sleep.
+char sched_can_sleep() {
+    process_t* current = sched_current_process();
+    return current != (void*) 0 && current->in_syscall && current->atomic == 0;
+}
+
+// sched_atomic_enter() -> void
+// Starts a section in which the current process must not sleep, for instance because it uses global state.
+void sched_atomic_enter() {
+    process_t* current = sched_current_process();
+    if (current != (void*) 0)
+        current->atomic++;
+}
+
+// sched_atomic_exit() -> void
+// Ends a section started by sched_atomic_enter().
+void sched_atomic_exit() {
+    process_t* current = sched_current_process();
+    if (current != (void*) 0)
+        current->atomic--;
+}
+
+// sched_enter(process_t*, kcontext_t*) -> void
+// Saves the current kernel context in save and runs a process on the current hart.
+static void sched_enter(process_t* next, kcontext_t* save) {
+    sched_hart_t* hart = &sched_harts[current_hartid()];
+    load_process_trap(next);
+
+    if (next->kernel_sleeping) {
+        next->kernel_sleeping = 0;
+        kcontext_switch(save, &next->kcontext);
+    } else {
+        // Processes that are not in the kernel return through the trap handler on their own kernel stack
+        hart->entry = (kcontext_t) {
+            .ra = (unsigned long long) kcontext_trap_return,
+            .sp = (unsigned long long) next->trap.isr_stack,
+            .s = { 0 }
+        };
+        kcontext_switch(save, &hart->entry);
+    }
+}
+
+// sched_block_until(unsigned long long) -> void
+// Blocks the current process until it is woken up or the time CSR reaches the deadline, which may be TIMER_NEVER. Only call this if sched_can_sleep() is true.
+void sched_block_until(unsigned long long deadline) {
+    process_t* process = sched_current_process();
+    if (deadline != TIMER_NEVER && timer_add(&process->sleep_timer, deadline))
+        return;
+
+    process->state = PROCESS_STATE_BLOCK;
+    sched_sleep();
+    timer_cancel(&process->sleep_timer);
+}
+
+// sched_sleep() -> void
+// Switches away from the current process inside the kernel. A blocked process stays off the run queues until it is woken up, and a running one is requeued. Returns on whichever hart picks the process next.
+void sched_sleep() {
+    unsigned long long hartid = current_hartid();
+    process_t* process = fetch_process(current_trap()->pid);
+
+    // The registers the process trapped with stay in its trap frame until it returns to user mode
+    save_process_trap(process);
+
+    unsigned long long slice;
+    pid_t pid = sched_next(process->pid, &slice);
+    timer_program(slice != 0 ? sched_time() + slice : TIMER_NEVER);
+
+    process_t* next = pid != 0 ? fetch_process(pid) : &sched_harts[hartid].idle;
+    if (next == process) {
+        load_process_trap(process);
+        return;
+    }
+
+    process->kernel_sleeping = 1;
+    sched_enter(next, &process->kcontext);
+}
+
+// sched_continue_kernel() -> void
+// Continues the process picked for the current hart if it is sleeping inside the kernel. The current kernel context is abandoned, so this is only called after the trapped process has been saved.
+void sched_continue_kernel() {
+    sched_hart_t* hart = &sched_harts[current_hartid()];
+    process_t* current = hart->current;
+    if (current != (void*) 0 && current->kernel_sleeping) {
+        current->kernel_sleeping = 0;
+        kcontext_switch(&hart->discard, &current->kcontext);
+    }
+}
+
+// sched_trap_return() -> trap_t*
+// Called by kernel contexts that return to a process that is not sleeping inside the kernel. Releases the kernel lock and returns the trap structure to leave the trap with.
+trap_t* sched_trap_return() {
+    // The lock was taken by the trap that switched here, which had interrupts disabled
+    kernel_lock_release(0);
+    return current_trap();
+}
+
+// sched_set_nice(process_t*, int) -> void
+// Sets the nice value of a process, which is clamped to between -20 and 19.
+void sched_set_nice(process_t* process, int nice) {
+    if (nice < -20)
+        nice = -20;
+    else if (nice > 19)
+        nice = 19;
+
+    // Charge time run so far at the old weight
+    if (process->state == PROCESS_STATE_RUNNING) {
+        unsigned long long now = sched_time();
+        process->sched.vruntime += sched_scale(now - process->sched.run_start, process);
+        process->sched.run_start = now;
+    }
+
+    unsigned long long weight = sched_nice_weights[nice + 20];
+    if (process->run_queue != (void*) 0)
+        process->run_queue->total_weight += weight - process->sched.weight;
+    process->sched.nice = nice;
+    process->sched.weight = weight;
+}
@@ -0,0 +1,123 @@
+#ifndef KERNEL_SCHED_H
+#define KERNEL_SCHED_H
+
+#include "process.h"
+#include "../smp.h"
+
+// Weight of a process with a nice value of 0.
+#define SCHED_NICE_0_WEIGHT 1024
+
+// Period in ticks of the time CSR within which every runnable process should get to run.
+#define SCHED_LATENCY 60000
+
+// Shortest time slice handed out, in ticks of the time CSR.
+#define SCHED_MIN_GRANULARITY 7500
+
+// How much less virtual runtime a woken process needs than the running one to preempt it.
+#define SCHED_WAKEUP_GRANULARITY 10000
+
+// Runnable processes ordered by virtual runtime in a binary min heap. The running process is not in its run queue.
+typedef struct s_run_queue {
+    process_t** heap;
+    unsigned long long length;
+    unsigned long long capacity;
+    unsigned long long total_weight;
+    unsigned long long min_vruntime;
+} run_queue_t;
+
+// Scheduler state of a hart. The idle process of each hart is its own and is never queued; its trap frame is the one the hart boots with and it handles traps on the hart's interrupt stack.
+typedef struct {
+    run_queue_t run_queue;
+    process_t* current;
+    process_t idle;
+    void* idle_stack;
+
+    // Kernel contexts that are switched away from and never continued, and used to start returning to a process
+    kcontext_t discard;
+    kcontext_t entry;
+} sched_hart_t;
+
+// Value of a process's last hart before it has run anywhere.
+#define SCHED_NO_HART ((unsigned long long) -1)
+
+// sched_init_hart(unsigned long long, void*) -> void
+// Initialises the run queue and idle process of a hart. Traps taken while the hart is idle are handled on the given stack.
+void sched_init_hart(unsigned long long hartid, void* isr_stack);
+
+// sched_idle_process(unsigned long long) -> process_t*
+// Returns the idle process of a hart.
+process_t* sched_idle_process(unsigned long long hartid);
+
+// sched_current_process() -> process_t*
+// Returns the process running on the current hart, or null if the hart is idle.
+process_t* sched_current_process();
+
+// sched_kernel_stack_top(process_t*, unsigned long long) -> void*
+// Returns the top of the stack traps are handled on while a process runs on a hart.
+void* sched_kernel_stack_top(process_t* process, unsigned long long hartid);
+
+// sched_init_process(process_t*) -> void
+// Initialises the scheduling state of a newly spawned process.
+void sched_init_process(process_t* process);
+
+// run_queue_push(run_queue_t*, process_t*) -> char
+// Adds a process to a run queue. Returns 0 on success.
+char run_queue_push(run_queue_t* queue, process_t* process);
+
+// run_queue_remove(process_t*) -> void
+// Removes a process from the run queue it is in, if any.
+void run_queue_remove(process_t* process);
+
+// run_queue_pop(run_queue_t*) -> process_t*
+// Removes and returns the process with the least virtual runtime, or null if the queue is empty.
+process_t* run_queue_pop(run_queue_t* queue);
+
+// sched_wakeup(process_t*) -> char
+// Makes a process runnable on its last hart or an idle one, preempting the running process there if the woken one has been served much less. Returns 0 if the process was queued.
+char sched_wakeup(process_t* process);
+
+// sched_next(pid_t, unsigned long long*) -> pid_t
+// Charges the running process for its time, requeues it, and picks the process with the least virtual runtime from the current hart's run queue, stealing from the busiest hart if it is empty. The length of its time slice is written to slice. Returns 0, the idle process, with a slice of 0 if there is nothing to run.
+pid_t sched_next(pid_t current, unsigned long long* slice);
+
+// sched_running_elsewhere(process_t*) -> char
+// Checks if a process is running on another hart, which may have its mappings cached in its tlb and be writing through them.
+char sched_running_elsewhere(process_t* process);
+
+// sched_can_remap(process_t*) -> char
+// Checks if swap and page merging may change the mappings of a live process under it. Processes running on other harts and processes in a syscall, which may be sleeping with user memory checked by fault_in_user_range(), are left alone.
+char sched_can_remap(process_t* process);
+
+// sched_can_sleep() -> char
+// Checks if the current kernel context belongs to a process in a syscall and is outside of atomic sections, so that it may sleep.
+char sched_can_sleep();
+
+// sched_atomic_enter() -> void
+// Starts a section in which the current process must not sleep, for instance because it uses global state.
+void sched_atomic_enter();
+
+// sched_atomic_exit() -> void
+// Ends a section started by sched_atomic_enter().
+void sched_atomic_exit();
+
+// sched_block_until(unsigned long long) -> void
+// Blocks the current process until it is woken up or the time CSR reaches the deadline, which may be TIMER_NEVER. Only call this if sched_can_sleep() is true.
+void sched_block_until(unsigned long long deadline);
+
+// sched_sleep() -> void
+// Switches away from the current process inside the kernel. A blocked process stays off the run queues until it is woken up, and a running one is requeued. Returns on whichever hart picks the process next.
+void sched_sleep();
+
+// sched_continue_kernel() -> void
+// Continues the process picked for the current hart if it is sleeping inside the kernel. The current kernel context is abandoned, so this is only called after the trapped process has been saved.
+void sched_continue_kernel();
+
+// sched_trap_return() -> trap_t*
+// Called by kernel contexts that return to a process that is not sleeping inside the kernel. Releases the kernel lock and returns the trap structure to leave the trap with.
+trap_t* sched_trap_return();
+
+// sched_set_nice(process_t*, int) -> void
+// Sets the nice value of a process, which is clamped to between -20 and 19.
+void sched_set_nice(process_t* process, int nice);
+
+#endif /* KERNEL_SCHED_H */
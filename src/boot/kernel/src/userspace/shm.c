@@ -0,0 +1,113 @@
+#include "shm.h"
+#include "../lib/string.h"
+
+shm_object_t* shm_objects[SHM_MAX_OBJECTS] = { 0 };
+
+// shm_create(char*, unsigned long long) -> int
+// Creates a new shared memory object. Returns its id, or -1 on failure.
+static int shm_create(char* name, unsigned long long size) {
+    unsigned long long page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (page_count == 0)
+        return -1;
+
+    int id;
+    for (id = 0; id < SHM_MAX_OBJECTS && shm_objects[id] != (void*) 0; id++);
+    if (id == SHM_MAX_OBJECTS)
+        return -1;
+
+    shm_object_t* object = malloc(sizeof(shm_object_t));
+    if (object == (void*) 0)
+        return -1;
+    object->pages = malloc(sizeof(void*) * page_count);
+    if (object->pages == (void*) 0) {
+        free(object);
+        return -1;
+    }
+
+    // Pages are allocated separately so that each can be freed on its own
+    for (unsigned long long i = 0; i < page_count; i++) {
+        object->pages[i] = alloc_page(1);
+        if (object->pages[i] == (void*) 0) {
+            for (unsigned long long j = 0; j < i; j++) {
+                dealloc_page(object->pages[j]);
+            }
+            free(object->pages);
+            free(object);
+            return -1;
+        }
+    }
+
+    object->name = name != (void*) 0 ? strdup(name) : (void*) 0;
+    object->page_count = page_count;
+    shm_objects[id] = object;
+    return id;
+}
+
+// shm_open(char*, unsigned long long) -> int
+// Opens the shared memory object with the given name, creating it with the given size if it does not exist. Anonymous objects are created if the name is null. Returns the id of the object, or -1 on failure.
+int shm_open(char* name, unsigned long long size) {
+    if (name != (void*) 0) {
+        for (int id = 0; id < SHM_MAX_OBJECTS; id++) {
+            shm_object_t* object = shm_objects[id];
+            if (object != (void*) 0 && object->name != (void*) 0 && !strcmp(object->name, name)) {
+                if (size > object->page_count * PAGE_SIZE)
+                    return -1;
+                return id;
+            }
+        }
+    }
+
+    return shm_create(name, size);
+}
+
+// shm_map(process_t*, int, short) -> void*
+// Maps a shared memory object into the mmap region of a process with the given flags. Returns the address of the mapping, or null on failure.
+void* shm_map(process_t* process, int id, short flags) {
+    if (id < 0 || id >= SHM_MAX_OBJECTS || shm_objects[id] == (void*) 0)
+        return (void*) 0;
+
+    // Like mmap, mappings must stay below the top of user space
+    shm_object_t* object = shm_objects[id];
+    void* mapping = process->mmap_next;
+    if (object->page_count > ((unsigned long long) mmu_user_top() - (unsigned long long) mapping) / PAGE_SIZE)
+        return (void*) 0;
+    for (unsigned long long i = 0; i < object->page_count; i++) {
+        void* virtual = mapping + i * PAGE_SIZE;
+        char failed = page_get(object->pages[i]);
+        if (!failed && map_mmu(process->mmu_data, virtual, object->pages[i], MMU_FLAG_USER | flags)) {
+            dealloc_page(object->pages[i]);
+            failed = 1;
+        }
+
+        if (failed) {
+            for (unsigned long long j = 0; j < i; j++) {
+                unmap_mmu(process->mmu_data, mapping + j * PAGE_SIZE);
+            }
+            return (void*) 0;
+        }
+
+        // Mark the mapping as holding a reference so that unmapping it drops the reference
+        mmu_walk_entry(process->mmu_data, virtual, 0)->raw |= MMU_FLAG_ALLOCED;
+    }
+
+    process->mmap_next += object->page_count * PAGE_SIZE;
+    return mapping;
+}
+
+// shm_unlink(int) -> int
+// Removes a shared memory object. Its pages are freed once they are unmapped from every process. Returns 0 on success.
+int shm_unlink(int id) {
+    if (id < 0 || id >= SHM_MAX_OBJECTS || shm_objects[id] == (void*) 0)
+        return -1;
+
+    shm_object_t* object = shm_objects[id];
+    for (unsigned long long i = 0; i < object->page_count; i++) {
+        dealloc_page(object->pages[i]);
+    }
+
+    free(object->name);
+    free(object->pages);
+    free(object);
+    shm_objects[id] = (void*) 0;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef KERNEL_SHM_H
+#define KERNEL_SHM_H
+
+#include "process.h"
+
+// Maximum number of shared memory objects that can exist at once.
+#define SHM_MAX_OBJECTS 64
+
+// A shared memory object. Each page holds a reference for the object and one for each mapping of it.
+typedef struct {
+    char* name;
+    unsigned long long page_count;
+    void** pages;
+} shm_object_t;
+
+// shm_open(char*, unsigned long long) -> int
+// Opens the shared memory object with the given name, creating it with the given size if it does not exist. Anonymous objects are created if the name is null. Returns the id of the object, or -1 on failure.
+int shm_open(char* name, unsigned long long size);
+
+// shm_map(process_t*, int, short) -> void*
+// Maps a shared memory object into the mmap region of a process with the given flags. Returns the address of the mapping, or null on failure.
+void* shm_map(process_t* process, int id, short flags);
+
+// shm_unlink(int) -> int
+// Removes a shared memory object. Its pages are freed once they are unmapped from every process. Returns 0 on success.
+int shm_unlink(int id);
+
+#endif /* KERNEL_SHM_H */
@@ -0,0 +1,280 @@
+#include "swap.h"
+#include "process.h"
+#include "sched.h"
+#include "workingset.h"
+#include "zswap.h"
+#include "../drivers/console/console.h"
+#include "../smp.h"
+
+#define SWAP_SLOT_USED(slot) ((swap_slot_bitmap[(slot) / 64] >> ((slot) % 64)) & 1)
+
+// Swap entries hold either a disk slot or, if this bit is set, a compressed page handle
+#define SWAP_ENTRY_ZSWAP (1ull << 53)
+#define SWAP_ENTRY_PAYLOAD(raw) (((raw) >> 10) & ((1ull << 43) - 1))
+
+// Flags kept in a page table entry while its page is swapped out
+#define SWAP_KEPT_FLAGS (MMU_FLAG_READ | MMU_FLAG_WRITE | MMU_FLAG_EXEC | MMU_FLAG_USER | MMU_FLAG_ALLOCED)
+
+generic_block_t* swap_device = (void*) 0;
+unsigned long long swap_slot_count = 0;
+unsigned long long swap_slots_used = 0;
+unsigned long long swap_slot_cursor = 0;
+unsigned long long* swap_slot_bitmap = (void*) 0;
+
+// Bounce buffer for clustered writes
+void* swap_buffer = (void*) 0;
+
+// Pages gathered for the next clustered write
+struct {
+    mmu_entry_t* entries[SWAP_CLUSTER];
+    unsigned long long length;
+    unsigned long long freed;
+    unsigned long long wanted;
+    unsigned char min_age;
+} swap_cluster = { 0 };
+
+char swap_reclaiming = 0;
+
+// init_swap_device(generic_block_t*) -> char
+// Uses a block device as swap space. Returns 0 on success.
+static char init_swap_device(generic_block_t* block) {
+    unsigned long long slot_count = generic_block_capacity(block) / SWAP_SECTORS_PER_PAGE;
+    if (slot_count == 0)
+        return -1;
+
+    unsigned long long bitmap_size = (slot_count + 63) / 64 * sizeof(unsigned long long);
+    swap_slot_bitmap = malloc(bitmap_size);
+    swap_buffer = alloc_page(SWAP_CLUSTER);
+    if (swap_slot_bitmap == (void*) 0 || swap_buffer == (void*) 0) {
+        free(swap_slot_bitmap);
+        dealloc_page(swap_buffer);
+        return -1;
+    }
+    memset(swap_slot_bitmap, 0, bitmap_size);
+
+    swap_device = block;
+    swap_slot_count = slot_count;
+    console_printf("Using 0x%llx pages of disk swap\n", slot_count);
+    return 0;
+}
+
+// init_swap(generic_block_t*) -> char
+// Sets up compressed swap and, if a block device is given, disk swap behind it, then registers swap as the page reclaimer. Returns 0 if either is available.
+char init_swap(generic_block_t* block) {
+    char compressed = init_zswap();
+    char disk = block != (void*) 0 ? init_swap_device(block) : -1;
+    if (compressed && disk)
+        return -1;
+
+    register_page_reclaimer(swap_reclaim);
+    return 0;
+}
+
+// swap_alloc_slots(unsigned long long*) -> unsigned long long
+// Allocates up to the given number of consecutive swap slots and updates the count to the number actually allocated. Returns the first slot.
+static unsigned long long swap_alloc_slots(unsigned long long* count) {
+    for (unsigned long long n = 0; n < swap_slot_count; n++) {
+        unsigned long long start = (swap_slot_cursor + n) % swap_slot_count;
+        if (SWAP_SLOT_USED(start))
+            continue;
+
+        unsigned long long length = 1;
+        while (length < *count && start + length < swap_slot_count && !SWAP_SLOT_USED(start + length)) {
+            length++;
+        }
+
+        for (unsigned long long i = start; i < start + length; i++) {
+            swap_slot_bitmap[i / 64] |= 1ull << (i % 64);
+        }
+
+        swap_slots_used += length;
+        swap_slot_cursor = start + length;
+        *count = length;
+        return start;
+    }
+
+    *count = 0;
+    return 0;
+}
+
+// swap_free_slot(unsigned long long) -> void
+// Frees a swap slot.
+static void swap_free_slot(unsigned long long slot) {
+    if (slot < swap_slot_count && SWAP_SLOT_USED(slot)) {
+        swap_slot_bitmap[slot / 64] &= ~(1ull << (slot % 64));
+        swap_slots_used--;
+    }
+}
+
+// swap_kept_flags(mmu_entry_t*) -> unsigned long long
+// Returns the flags of a mapping to keep in its swap entry. Copy on write pages come back as private writable pages.
+static unsigned long long swap_kept_flags(mmu_entry_t* entry) {
+    unsigned long long flags = entry->raw & SWAP_KEPT_FLAGS;
+    if (entry->raw & MMU_FLAG_COW)
+        flags |= MMU_FLAG_WRITE;
+    return flags;
+}
+
+// swap_write_cluster() -> void
+// Writes the gathered pages to consecutive swap slots and replaces their mappings with swap entries.
+static void swap_write_cluster() {
+    unsigned long long written = 0;
+    while (written < swap_cluster.length) {
+        unsigned long long count = swap_cluster.length - written;
+        unsigned long long slot = swap_alloc_slots(&count);
+        if (count == 0)
+            break;
+
+        for (unsigned long long i = 0; i < count; i++) {
+            memcpy(swap_buffer + i * PAGE_SIZE, MMU_UNWRAP(*swap_cluster.entries[written + i]), PAGE_SIZE);
+        }
+
+        // One sequential write for the whole run of slots
+        if (generic_block_write(swap_device, swap_buffer, slot * SWAP_SECTORS_PER_PAGE, count * SWAP_SECTORS_PER_PAGE)) {
+            for (unsigned long long i = 0; i < count; i++) {
+                swap_free_slot(slot + i);
+            }
+            break;
+        }
+
+        for (unsigned long long i = 0; i < count; i++) {
+            mmu_entry_t* entry = swap_cluster.entries[written + i];
+            void* page = MMU_UNWRAP(*entry);
+            entry->raw = ((slot + i) << 10) | swap_kept_flags(entry) | MMU_FLAG_SWAPPED;
+            dealloc_page(page);
+        }
+
+        written += count;
+        swap_cluster.freed += count;
+    }
+
+    swap_cluster.length = 0;
+}
+
+// swap_consider_page(void*, mmu_entry_t*, void*) -> void
+// Compresses a cold anonymous user page, or adds it to the current cluster for disk swap if it does not compress.
+static void swap_consider_page(void* virtual, mmu_entry_t* entry, void* _) {
+    (void) virtual;
+    (void) _;
+    if (swap_cluster.freed + swap_cluster.length >= swap_cluster.wanted)
+        return;
+
+    unsigned long long needed = MMU_FLAG_VALID | MMU_FLAG_USER | MMU_FLAG_ALLOCED;
+    if ((entry->raw & needed) != needed || (entry->raw & MMU_FLAG_GLOBAL))
+        return;
+    // Swapping out one mapping of a shared page would not free it
+    void* page = MMU_UNWRAP(*entry);
+    if (page_references(page) != 1 || workingset_page_age(page) < swap_cluster.min_age)
+        return;
+
+    zswap_handle_t handle;
+    if (!zswap_store(page, &handle)) {
+        entry->raw = (((unsigned long long) handle) << 10) | SWAP_ENTRY_ZSWAP | swap_kept_flags(entry) | MMU_FLAG_SWAPPED;
+        dealloc_page(page);
+        swap_cluster.freed++;
+        return;
+    }
+
+    if (swap_device == (void*) 0)
+        return;
+
+    swap_cluster.entries[swap_cluster.length++] = entry;
+    if (swap_cluster.length == SWAP_CLUSTER)
+        swap_write_cluster();
+}
+
+// swap_reclaim_pages(unsigned long long) -> unsigned long long
+// Does the work of swap_reclaim().
+static unsigned long long swap_reclaim_pages(unsigned long long page_count) {
+    if (swap_reclaiming)
+        return 0;
+
+    swap_reclaiming = 1;
+    swap_cluster.length = 0;
+    swap_cluster.freed = 0;
+    swap_cluster.wanted = page_count > SWAP_CLUSTER ? page_count : SWAP_CLUSTER;
+
+    // The kernel may be in the middle of using the current process's memory, so leave it alone. Processes running on other harts or in a syscall are skipped too; see sched_can_remap().
+    mmu_entry_t* current = mmu_current_top();
+
+    // Prefer cold pages and only fall back to warmer ones if that is not enough
+    unsigned char ages[] = { WORKINGSET_COLD_AGE, 1, 0 };
+    for (unsigned int a = 0; a < sizeof(ages) && swap_cluster.freed < page_count; a++) {
+        swap_cluster.min_age = ages[a];
+
+        for (pid_t pid = next_live_process(0); pid != 0 && swap_cluster.freed + swap_cluster.length < swap_cluster.wanted; pid = next_live_process(pid)) {
+            process_t* process = fetch_process(pid);
+            if (process->mmu_data != current && sched_can_remap(process))
+                mmu_walk_leaves(process->mmu_data, swap_consider_page, (void*) 0);
+        }
+
+        if (swap_cluster.length != 0)
+            swap_write_cluster();
+    }
+
+    smp_flush_tlb();
+    swap_reclaiming = 0;
+    return swap_cluster.freed;
+}
+
+// swap_reclaim(unsigned long long) -> unsigned long long
+// Compresses cold anonymous user pages, or writes them out to disk swap in clusters if they do not compress, until at least the given number of pages have been freed. Returns the number of pages freed.
+unsigned long long swap_reclaim(unsigned long long page_count) {
+    // The cluster and page tables being walked are shared, so disk writes are polled rather than slept on
+    sched_atomic_enter();
+    unsigned long long freed = swap_reclaim_pages(page_count);
+    sched_atomic_exit();
+    return freed;
+}
+
+// swap_in_page(mmu_entry_t*) -> char
+// Does the work of swap_in().
+static char swap_in_page(mmu_entry_t* entry) {
+    if ((entry->raw & MMU_FLAG_VALID) || !(entry->raw & MMU_FLAG_SWAPPED))
+        return -1;
+
+    unsigned long long payload = SWAP_ENTRY_PAYLOAD(entry->raw);
+    void* page = alloc_page(1);
+    if (page == (void*) 0)
+        return -1;
+
+    if (entry->raw & SWAP_ENTRY_ZSWAP) {
+        if (zswap_load(payload, page)) {
+            dealloc_page(page);
+            return -1;
+        }
+        zswap_free(payload);
+    } else {
+        if (swap_device == (void*) 0 || generic_block_read(swap_device, page, payload * SWAP_SECTORS_PER_PAGE, SWAP_SECTORS_PER_PAGE)) {
+            dealloc_page(page);
+            return -1;
+        }
+        swap_free_slot(payload);
+    }
+
+    entry->raw = (((unsigned long long) page) >> 2) | (entry->raw & SWAP_KEPT_FLAGS) | MMU_FLAG_VALID | MMU_FLAG_ACCESSED;
+    workingset_reset_page(page);
+    return 0;
+}
+
+// swap_in(mmu_entry_t*) -> char
+// Reads a swapped out page back into memory and maps it in place of the swap entry. Returns 0 on success.
+char swap_in(mmu_entry_t* entry) {
+    // The entry could be swapped in or freed by someone else while sleeping on the read
+    sched_atomic_enter();
+    char result = swap_in_page(entry);
+    sched_atomic_exit();
+    return result;
+}
+
+// swap_release(mmu_entry_t*) -> void
+// Frees the swap slot referenced by a swap entry that is being unmapped.
+void swap_release(mmu_entry_t* entry) {
+    if ((entry->raw & MMU_FLAG_VALID) || !(entry->raw & MMU_FLAG_SWAPPED))
+        return;
+
+    if (entry->raw & SWAP_ENTRY_ZSWAP)
+        zswap_free(SWAP_ENTRY_PAYLOAD(entry->raw));
+    else
+        swap_free_slot(SWAP_ENTRY_PAYLOAD(entry->raw));
+}
@@ -0,0 +1,28 @@
+#ifndef KERNEL_SWAP_H
+#define KERNEL_SWAP_H
+
+#include "../drivers/generic_block.h"
+#include "mmu.h"
+
+// Maximum number of pages written out together in one sequential write.
+#define SWAP_CLUSTER 32
+
+#define SWAP_SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+// init_swap(generic_block_t*) -> char
+// Sets up compressed swap and, if a block device is given, disk swap behind it, then registers swap as the page reclaimer. Returns 0 if either is available.
+char init_swap(generic_block_t* block);
+
+// swap_reclaim(unsigned long long) -> unsigned long long
+// Compresses cold anonymous user pages, or writes them out to disk swap in clusters if they do not compress, until at least the given number of pages have been freed. Returns the number of pages freed.
+unsigned long long swap_reclaim(unsigned long long page_count);
+
+// swap_in(mmu_entry_t*) -> char
+// Reads a swapped out page back into memory and maps it in place of the swap entry. Returns 0 on success.
+char swap_in(mmu_entry_t* entry);
+
+// swap_release(mmu_entry_t*) -> void
+// Frees the swap slot referenced by a swap entry that is being unmapped.
+void swap_release(mmu_entry_t* entry);
+
+#endif /* KERNEL_SWAP_H */
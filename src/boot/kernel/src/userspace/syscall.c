@@ -2,241 +2,559 @@
 #include "../drivers/console/console.h"
 #include "../opensbi.h"
 #include "../drivers/filesystems/generic_file.h"
+#include "futex.h"
+#include "pagefault.h"
+#include "ksm.h"
+#include "sched.h"
+#include "shm.h"
+#include "timer.h"
+#include "uring.h"
+#include "workingset.h"
 
-// user_syscall(pid_t, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long) -> unsigned long long
-// Does a syscall for a user mode process.
-unsigned long long user_syscall(
-    pid_t pid,
-    unsigned long long syscall,
-    unsigned long long a0,
-    unsigned long long a1,
-    unsigned long long a2,
-    unsigned long long a3,
-    unsigned long long a4,
-    unsigned long long a5,
+//#define SYSCALL_DEBUG
+
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define PROT_EXEC 4
+
+// Parameters of every handler in the syscall table, matching syscall_handler_t. Handlers only use the arguments their syscall takes.
+#define SYSCALL_PARAMS                              \
+    __attribute__((unused)) pid_t pid,              \
+    __attribute__((unused)) unsigned long long a0,  \
+    __attribute__((unused)) unsigned long long a1,  \
+    __attribute__((unused)) unsigned long long a2,  \
+    __attribute__((unused)) unsigned long long a3,  \
+    __attribute__((unused)) unsigned long long a4,  \
+    __attribute__((unused)) unsigned long long a5,  \
+    __attribute__((unused)) trap_t* trap
+
+// Parameters of every handler in the fast syscall table.
+#define SYSCALL_FAST_PARAMS                         \
+    __attribute__((unused)) unsigned long long a0,  \
+    __attribute__((unused)) unsigned long long a1,  \
+    __attribute__((unused)) unsigned long long a2,  \
+    __attribute__((unused)) unsigned long long a3,  \
+    __attribute__((unused)) unsigned long long a4,  \
+    __attribute__((unused)) unsigned long long a5,  \
     trap_t* trap
-) {
-    switch (syscall) {
-        // unsigned long long read(int fd, void* buffer, unsigned long long count);
-        case 0: {
-            int fd = (int) a0;
-            void* buffer = (void*) a1;
-            unsigned long long count = a2;
-
-            if (fd > FILE_DESCRIPTOR_COUNT)
-                return -1;
 
-            process_t* process = fetch_process(pid);
+// Statistics for every syscall number. Only updated with the kernel lock held.
+syscall_stats_t syscall_stats[SYSCALL_MAX] = { 0 };
 
-            if (process->file_descriptors[fd] == (void*) 0)
-                return -1;
+// syscall_fast_getpid(unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, trap_t*) -> unsigned long long
+// pid_t getpid(void);
+static unsigned long long syscall_fast_getpid(SYSCALL_FAST_PARAMS) {
+    return trap->pid;
+}
 
-            return generic_file_read(process->file_descriptors[fd], buffer, count);
-        }
+// syscall_fast_getppid(unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, trap_t*) -> unsigned long long
+// pid_t getppid(void);
+static unsigned long long syscall_fast_getppid(SYSCALL_FAST_PARAMS) {
+    // The parent of a process never changes while it runs
+    return fetch_process(trap->pid)->parent_pid;
+}
 
-        // unsigned long long write(int fd, char* buffer, unsigned long long count);
-        case 1: {
-            int fd = (int) a0;
-            void* buffer = (void*) a1;
-            unsigned long long count = a2;
+unsigned long long (*syscall_fast_table[SYSCALL_FAST_MAX])(unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, trap_t*) = {
+    [39] = syscall_fast_getpid,
+    [110] = syscall_fast_getppid
+};
 
-            if (fd > FILE_DESCRIPTOR_COUNT)
-                return -1;
+// unsigned long long read(int fd, void* buffer, unsigned long long count);
+static unsigned long long syscall_read(SYSCALL_PARAMS) {
+    int fd = (int) a0;
+    void* buffer = (void*) a1;
+    unsigned long long count = a2;
 
-            process_t* process = fetch_process(pid);
+    if (fd > FILE_DESCRIPTOR_COUNT)
+        return -1;
 
-            if (process->file_descriptors[fd] == (void*) 0)
-                return -1;
+    process_t* process = fetch_process(pid);
 
-            return generic_file_write(process->file_descriptors[fd], buffer, count);
-        }
+    if (process->file_descriptors[fd] == (void*) 0)
+        return -1;
 
-        // int open(char* path, int flags, int mode);
-        case 2: {
-            char* path = (void*) a0;
+    // The kernel cannot take page faults on user memory
+    if (fault_in_user_range(process->mmu_data, buffer, count, 1))
+        return -1;
 
-            // TODO: use these
-            int flags = (int) a1;
-            int mode = (int) a2;
+    return generic_file_read(process->file_descriptors[fd], buffer, count);
+}
 
-            struct s_dir_entry entry = generic_dir_lookup(root, path);
-            if (entry.file == (void*) 0)
-                return -1;
+// unsigned long long write(int fd, char* buffer, unsigned long long count);
+static unsigned long long syscall_write(SYSCALL_PARAMS) {
+    int fd = (int) a0;
+    void* buffer = (void*) a1;
+    unsigned long long count = a2;
 
-            process_t* process = fetch_process(pid);
-            for (int i = 3; i < FILE_DESCRIPTOR_COUNT; i++) {
-                if (process->file_descriptors[i] == (void*) 0) {
-                    process->file_descriptors[i] = entry.file;
-                    return i;
-                }
-            }
-            return -1;
-        }
+    if (fd > FILE_DESCRIPTOR_COUNT)
+        return -1;
 
-        // int close(int fd)
-        case 3: {
-            int fd = (int) a0;
+    process_t* process = fetch_process(pid);
 
-            if (fd > FILE_DESCRIPTOR_COUNT)
-                return -1;
+    if (process->file_descriptors[fd] == (void*) 0)
+        return -1;
 
-            process_t* process = fetch_process(pid);
-            if (process->file_descriptors[fd] == (void*) 0)
-                return -1;
-            close_generic_file(process->file_descriptors[fd]);
-            process->file_descriptors[fd] = (void*) 0;
-            return 0;
-        }
+    if (fault_in_user_range(process->mmu_data, buffer, count, 0))
+        return -1;
 
-        // void* mmap(void* addr, unsigned long long length, int prot, int flags, int fd, unsigned long long offset);
-        case 9: {
-            // void* addr = (void*) a0;
-            unsigned long long length = a1;
-            int prot = (int) a2;
-            // int flags = (int) a3;
-            // int fd = (int) a4;
-            // unsigned long long offset = a5;
+    return generic_file_write(process->file_descriptors[fd], buffer, count);
+}
 
-#define PROT_READ 1
-#define PROT_WRITE 2
-#define PROT_EXEC 4
+// int open(char* path, int flags, int mode);
+static unsigned long long syscall_open(SYSCALL_PARAMS) {
+    char* path = (void*) a0;
 
-            // Write+exec is illegal for security reasons
-            if ((prot & PROT_WRITE) && (prot & PROT_EXEC))
-                return 0;
-
-            unsigned long long page_num = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-            void* alloced = alloc_page(page_num);
-            if (alloced == (void*) 0)
-                return 0;
-
-            short f = 0;
-            process_t* process = fetch_process(pid);
-            if (prot & PROT_READ)
-                f |= MMU_FLAG_READ;
-            if (prot & PROT_WRITE)
-                f |= MMU_FLAG_WRITE;
-            if (prot & PROT_EXEC)
-                f |= MMU_FLAG_EXEC;
-            for (unsigned long long i = 0; i < page_num; i++) {
-                mmu_protect(process->mmu_data, alloced + i * PAGE_SIZE, MMU_FLAG_USER | MMU_FLAG_ALLOCED | f, 1);
-            }
+    // TODO: use these
+    int flags = (int) a1;
+    int mode = (int) a2;
 
-            return (unsigned long long) alloced;
+    // Paths are limited to a page, so at most two pages need to be present
+    process_t* process = fetch_process(pid);
+    if (fault_in_user_range(process->mmu_data, path, PAGE_SIZE, 0))
+        return -1;
+
+    struct s_dir_entry entry = generic_dir_lookup(root, path);
+    if (entry.file == (void*) 0)
+        return -1;
+
+    for (int i = 3; i < FILE_DESCRIPTOR_COUNT; i++) {
+        if (process->file_descriptors[i] == (void*) 0) {
+            process->file_descriptors[i] = entry.file;
+            return i;
         }
+    }
+    return -1;
+}
 
-        // int mprotect(void* addr, unsigned long long length, int prot);
-        case 10: {
-            if (a0 & 0xfff)
-                return -1;
+// int close(int fd)
+static unsigned long long syscall_close(SYSCALL_PARAMS) {
+    int fd = (int) a0;
 
-            void* addr = (void*) a0;
-            unsigned long long size = a1;
-            int prot = (int) a2;
+    if (fd > FILE_DESCRIPTOR_COUNT)
+        return -1;
 
-            if ((prot & PROT_WRITE) && (prot & PROT_EXEC))
-                return -1;
+    process_t* process = fetch_process(pid);
+    if (process->file_descriptors[fd] == (void*) 0)
+        return -1;
+    close_generic_file(process->file_descriptors[fd]);
+    process->file_descriptors[fd] = (void*) 0;
+    return 0;
+}
 
-            unsigned long long page_num = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-            short f = 0;
-            process_t* process = fetch_process(pid);
-            if (prot & PROT_READ)
-                f |= MMU_FLAG_READ;
-            if (prot & PROT_WRITE)
-                f |= MMU_FLAG_WRITE;
-            if (prot & PROT_EXEC)
-                f |= MMU_FLAG_EXEC;
-            for (unsigned long long i = 0; i < page_num; i++) {
-                int r = mmu_protect(process->mmu_data, addr + i * PAGE_SIZE, MMU_FLAG_USER | f, 1);
-                if (r != 0)
-                    return -1;
+// void* mmap(void* addr, unsigned long long length, int prot, int flags, int fd, unsigned long long offset);
+static unsigned long long syscall_mmap(SYSCALL_PARAMS) {
+    // void* addr = (void*) a0;
+    unsigned long long length = a1;
+    int prot = (int) a2;
+    // int flags = (int) a3;
+    // int fd = (int) a4;
+    // unsigned long long offset = a5;
+
+    // Write+exec is illegal for security reasons
+    if ((prot & PROT_WRITE) && (prot & PROT_EXEC))
+        return 0;
+
+    unsigned long long page_num = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (page_num == 0)
+        return 0;
+
+    // The region only grows, since unmapped ranges are not reused, so stop once it reaches the top of user space
+    process_t* process = fetch_process(pid);
+    unsigned long long room = (unsigned long long) mmu_user_top() - (unsigned long long) process->mmap_next;
+    if (length > room || page_num > room / PAGE_SIZE)
+        return 0;
+
+    short f = 0;
+    if (prot & PROT_READ)
+        f |= MMU_FLAG_READ;
+    if (prot & PROT_WRITE)
+        f |= MMU_FLAG_WRITE;
+    if (prot & PROT_EXEC)
+        f |= MMU_FLAG_EXEC;
+
+    // Mappings are placed in their own region of the address space, so they never collide with each other or the executable
+    void* alloced = process->mmap_next;
+    for (unsigned long long i = 0; i < page_num; i++) {
+        if (alloc_page_mmu(process->mmu_data, alloced + i * PAGE_SIZE, MMU_FLAG_USER | f) == (void*) 0) {
+            for (unsigned long long j = 0; j < i; j++) {
+                unmap_mmu(process->mmu_data, alloced + j * PAGE_SIZE);
             }
             return 0;
         }
+    }
+    process->mmap_next += page_num * PAGE_SIZE;
 
-        // int munmap(void* addr, unsigned long long length);
-        case 11: {
-            void* addr = (void*) a0;
-            unsigned long long size = a1;
+    return (unsigned long long) alloced;
+}
 
-            unsigned long long page_num = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-            process_t* process = fetch_process(pid);
-            for (unsigned long long i = 0; i < page_num; i++) {
-                unmap_mmu(process->mmu_data, addr);
-            }
-            return 0;
-        }
+// int mprotect(void* addr, unsigned long long length, int prot);
+static unsigned long long syscall_mprotect(SYSCALL_PARAMS) {
+    if (a0 & 0xfff)
+        return -1;
+
+    void* addr = (void*) a0;
+    unsigned long long size = a1;
+    int prot = (int) a2;
+
+    if ((prot & PROT_WRITE) && (prot & PROT_EXEC))
+        return -1;
+
+    unsigned long long page_num = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    short f = 0;
+    process_t* process = fetch_process(pid);
+    if (prot & PROT_READ)
+        f |= MMU_FLAG_READ;
+    if (prot & PROT_WRITE)
+        f |= MMU_FLAG_WRITE;
+    if (prot & PROT_EXEC)
+        f |= MMU_FLAG_EXEC;
+    for (unsigned long long i = 0; i < page_num; i++) {
+        int r = mmu_protect(process->mmu_data, addr + i * PAGE_SIZE, MMU_FLAG_USER | f, 0);
+        if (r != 0)
+            return -1;
+    }
+    return 0;
+}
 
-        // pid_t getpid(void);
-        case 39:
-            return pid;
+// int munmap(void* addr, unsigned long long length);
+static unsigned long long syscall_munmap(SYSCALL_PARAMS) {
+    void* addr = (void*) a0;
+    unsigned long long size = a1;
 
-        // void exit(unsigned long long status);
-        case 60: {
-            // TODO: use this value
-            unsigned long long status = a0;
+    unsigned long long page_num = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    process_t* process = fetch_process(pid);
+    for (unsigned long long i = 0; i < page_num; i++) {
+        unmap_mmu(process->mmu_data, addr + i * PAGE_SIZE);
+    }
+    asm volatile("sfence.vma");
+    return 0;
+}
 
-            kill_process(pid);
-            sbi_set_timer(0);
-            return 0;
-        }
+// int pause(void);
+// There are no signals yet, so this blocks forever.
+static unsigned long long syscall_pause(SYSCALL_PARAMS) {
+    fetch_process(pid)->state = PROCESS_STATE_BLOCK;
+    sched_sleep();
+    return 0;
+}
 
-        // pid_t getppid(void);
-        case 110:
-            return fetch_process(pid)->parent_pid;
+// pid_t getpid(void);
+static unsigned long long syscall_getpid(SYSCALL_PARAMS) {
+    return pid;
+}
+
+// void exit(unsigned long long status);
+static unsigned long long syscall_exit(SYSCALL_PARAMS) {
+    // TODO: use this value
+    unsigned long long status = a0;
 
-        // pid_t spawn(char* path, char* argv[], char* envp[], int stdin, int stdout, int stderr);
-        case 314: {
-            char* path = (void*) a0;
+    // The process never runs again, so switch away rather than return to it
+    kill_process(pid);
+    sched_sleep();
+    return 0;
+}
 
-            // TODO: use these
-            char** argv = (void*) a1;
-            char** envp = (void*) a2;
+// pid_t getppid(void);
+static unsigned long long syscall_getppid(SYSCALL_PARAMS) {
+    return fetch_process(pid)->parent_pid;
+}
 
-            int stdin  = (int) a3;
-            int stdout = (int) a4;
-            int stderr = (int) a5;
+// int getpriority(int which, pid_t who);
+// Like Linux, this returns 20 - nice so that the result is never negative.
+static unsigned long long syscall_getpriority(SYSCALL_PARAMS) {
+    int which = (int) a0;
+    pid_t who = a1 ? a1 : pid;
+    if (which != 0 || who >= MAX_PID || fetch_process(who)->state == PROCESS_STATE_DEAD)
+        return -1;
+    return 20 - fetch_process(who)->sched.nice;
+}
 
-            // Create process
-            elf_t elf = load_executable_elf_from_file(root, path);
-            pid_t p = load_elf_as_process(pid, &elf, 1);
-            free_elf(&elf);
-            process_init_kernel_mmu(p);
+// int setpriority(int which, pid_t who, int nice);
+// Processes may only raise their own nice value; init may set any process's nice value.
+static unsigned long long syscall_setpriority(SYSCALL_PARAMS) {
+    int which = (int) a0;
+    pid_t who = a1 ? a1 : pid;
+    int nice = (int) a2;
+    if (which != 0 || who >= MAX_PID || fetch_process(who)->state == PROCESS_STATE_DEAD)
+        return -1;
+    if (pid != 1 && (who != pid || nice < fetch_process(who)->sched.nice))
+        return -1;
+    sched_set_nice(fetch_process(who), nice);
+    return 0;
+}
 
-            // Set file descriptors
-            process_t* process = fetch_process(pid);
-            process_t* child = fetch_process(p);
+// syscall_deadline(pid_t, timespec_t*, unsigned long long*) -> char
+// Turns a length of time passed in by a process into a deadline for the time CSR. Returns 0 on success.
+static char syscall_deadline(pid_t pid, timespec_t* timeout, unsigned long long* deadline) {
+    if (fault_in_user_range(fetch_process(pid)->mmu_data, timeout, sizeof(timespec_t), 0))
+        return -1;
+
+    timespec_t t = *timeout;
+    if (t.seconds < 0 || t.nanoseconds < 0 || t.nanoseconds >= 1000000000)
+        return -1;
+    *deadline = timer_now() + timer_ticks(t.seconds, t.nanoseconds);
+    return 0;
+}
 
-            if (stdin < FILE_DESCRIPTOR_COUNT && process->file_descriptors[stdin] != (void*) 0) {
-                child->file_descriptors[0] = malloc(sizeof(generic_file_t));
-                copy_generic_file(child->file_descriptors[0], process->file_descriptors[stdin]);
-            }
+// int nanosleep(timespec_t* request, timespec_t* remaining);
+// There are no signals yet, so sleeps always run to the end and nothing remains.
+static unsigned long long syscall_nanosleep(SYSCALL_PARAMS) {
+    timespec_t* remaining = (void*) a1;
+    unsigned long long deadline;
+    if (a0 == 0 || syscall_deadline(pid, (void*) a0, &deadline) || !sched_can_sleep())
+        return -1;
 
-            if (stdout < FILE_DESCRIPTOR_COUNT && process->file_descriptors[stdout] != (void*) 0) {
-                child->file_descriptors[1] = malloc(sizeof(generic_file_t));
-                copy_generic_file(child->file_descriptors[1], process->file_descriptors[stdout]);
-            }
+    while (timer_now() < deadline)
+        sched_block_until(deadline);
 
-            if (stderr < FILE_DESCRIPTOR_COUNT && process->file_descriptors[stderr] != (void*) 0) {
-                child->file_descriptors[1] = malloc(sizeof(generic_file_t));
-                copy_generic_file(child->file_descriptors[1], process->file_descriptors[stderr]);
-            }
+    if (remaining != (void*) 0 && !fault_in_user_range(fetch_process(pid)->mmu_data, remaining, sizeof(timespec_t), 1))
+        *remaining = (timespec_t) { 0, 0 };
+    return 0;
+}
 
-            // Add process to queue
-            add_process_to_queue(p);
-            return p;
-        }
+// int futex(unsigned int* address, int op, unsigned int value, timespec_t* timeout);
+// Waits while the futex holds value, for at most timeout if it is not null, or wakes up to value waiters.
+static unsigned long long syscall_futex(SYSCALL_PARAMS) {
+    unsigned int* address = (void*) a0;
+    unsigned int value = (unsigned int) a2;
+    unsigned long long deadline = TIMER_NEVER;
 
-        // Unknown syscall
+    switch ((int) a1) {
+        case FUTEX_WAIT:
+            if (a3 != 0 && syscall_deadline(pid, (void*) a3, &deadline))
+                return -1;
+            return futex_wait(fetch_process(pid), address, value, deadline);
+        case FUTEX_WAKE:
+            return futex_wake(fetch_process(pid), address, value);
         default:
-            console_printf("Called unknown syscall 0x%llx with arguments:\n", syscall);
-            console_printf("    a0: 0x%llx\n", a0);
-            console_printf("    a1: 0x%llx\n", a1);
-            console_printf("    a2: 0x%llx\n", a2);
-            console_printf("    a3: 0x%llx\n", a3);
-            console_printf("    a4: 0x%llx\n", a4);
-            console_printf("    a5: 0x%llx\n", a5);
             return -1;
     }
 }
 
+// pid_t spawn(char* path, char* argv[], char* envp[], int stdin, int stdout, int stderr);
+static unsigned long long syscall_spawn(SYSCALL_PARAMS) {
+    char* path = (void*) a0;
+
+    // TODO: use these
+    char** argv = (void*) a1;
+    char** envp = (void*) a2;
+
+    int stdin  = (int) a3;
+    int stdout = (int) a4;
+    int stderr = (int) a5;
+
+    if (fault_in_user_range(fetch_process(pid)->mmu_data, path, PAGE_SIZE, 0))
+        return -1;
+
+    // Create process
+    elf_t elf = load_executable_elf_from_file(root, path);
+    pid_t p = load_elf_as_process(pid, &elf, 1);
+    free_elf(&elf);
+    if (p == 0)
+        return -1;
+    process_init_kernel_mmu(p);
+
+    // Set file descriptors
+    process_t* process = fetch_process(pid);
+    process_t* child = fetch_process(p);
+
+    if (stdin < FILE_DESCRIPTOR_COUNT && process->file_descriptors[stdin] != (void*) 0) {
+        child->file_descriptors[0] = malloc(sizeof(generic_file_t));
+        copy_generic_file(child->file_descriptors[0], process->file_descriptors[stdin]);
+    }
+
+    if (stdout < FILE_DESCRIPTOR_COUNT && process->file_descriptors[stdout] != (void*) 0) {
+        child->file_descriptors[1] = malloc(sizeof(generic_file_t));
+        copy_generic_file(child->file_descriptors[1], process->file_descriptors[stdout]);
+    }
+
+    if (stderr < FILE_DESCRIPTOR_COUNT && process->file_descriptors[stderr] != (void*) 0) {
+        child->file_descriptors[1] = malloc(sizeof(generic_file_t));
+        copy_generic_file(child->file_descriptors[1], process->file_descriptors[stderr]);
+    }
+
+    // Add process to queue
+    add_process_to_queue(p);
+    return p;
+}
+
+// int workingset(pid_t pid, workingset_info_t* info);
+static unsigned long long syscall_workingset(SYSCALL_PARAMS) {
+    pid_t target = a0 ? a0 : pid;
+    workingset_info_t* info = (void*) a1;
+    if (info == (void*) 0 || fault_in_user_range(fetch_process(pid)->mmu_data, info, sizeof(workingset_info_t), 1))
+        return -1;
+    return workingset_info(target, info);
+}
+
+// int ksm_info(ksm_info_t* info);
+static unsigned long long syscall_ksm_info(SYSCALL_PARAMS) {
+    ksm_info_t* info = (void*) a0;
+    if (info == (void*) 0 || fault_in_user_range(fetch_process(pid)->mmu_data, info, sizeof(ksm_info_t), 1))
+        return -1;
+    ksm_info(info);
+    return 0;
+}
+
+// int shm_open(char* name, unsigned long long size);
+static unsigned long long syscall_shm_open(SYSCALL_PARAMS) {
+    char* name = (void*) a0;
+    unsigned long long size = a1;
+    if (name != (void*) 0 && fault_in_user_range(fetch_process(pid)->mmu_data, name, PAGE_SIZE, 0))
+        return -1;
+    return shm_open(name, size);
+}
+
+// void* shm_map(int id, int prot);
+static unsigned long long syscall_shm_map(SYSCALL_PARAMS) {
+    int id = (int) a0;
+    int prot = (int) a1;
+
+    if ((prot & PROT_WRITE) && (prot & PROT_EXEC))
+        return 0;
+
+    short f = 0;
+    if (prot & PROT_READ)
+        f |= MMU_FLAG_READ;
+    if (prot & PROT_WRITE)
+        f |= MMU_FLAG_WRITE;
+    if (prot & PROT_EXEC)
+        f |= MMU_FLAG_EXEC;
+    return (unsigned long long) shm_map(fetch_process(pid), id, f);
+}
+
+// int shm_unlink(int id);
+static unsigned long long syscall_shm_unlink(SYSCALL_PARAMS) {
+    return shm_unlink((int) a0);
+}
+
+// int syscall_info(unsigned long long syscall, syscall_info_t* info);
+static unsigned long long syscall_syscall_info(SYSCALL_PARAMS) {
+    syscall_info_t* info = (void*) a1;
+    if (info == (void*) 0 || fault_in_user_range(fetch_process(pid)->mmu_data, info, sizeof(syscall_info_t), 1))
+        return -1;
+    return syscall_info(a0, info);
+}
+
+// void* uring_setup(unsigned int entries, unsigned int flags);
+static unsigned long long syscall_uring_setup(SYSCALL_PARAMS) {
+    return (unsigned long long) uring_setup(fetch_process(pid), (unsigned int) a0, (unsigned int) a1);
+}
+
+// int uring_enter(unsigned int to_submit);
+static unsigned long long syscall_uring_enter(SYSCALL_PARAMS) {
+    return uring_enter(fetch_process(pid), (unsigned int) a0, trap);
+}
+
+// int irq_set_affinity(unsigned int irq, unsigned long long hart);
+// Pins a device interrupt to a hart, or lets it be balanced across harts again if hart is -1. Only init may move device interrupts.
+static unsigned long long syscall_irq_set_affinity(SYSCALL_PARAMS) {
+    if (pid != 1 || plic_set_affinity((unsigned int) a0, a1))
+        return -1;
+    return 0;
+}
+
+// Registered syscalls, indexed by number. Numbers without a handler are unknown.
+const syscall_entry_t syscall_table[SYSCALL_MAX] = {
+    [0] = { "read", 3, syscall_read },
+    [1] = { "write", 3, syscall_write },
+    [2] = { "open", 3, syscall_open },
+    [3] = { "close", 1, syscall_close },
+    [9] = { "mmap", 6, syscall_mmap },
+    [10] = { "mprotect", 3, syscall_mprotect },
+    [11] = { "munmap", 2, syscall_munmap },
+    [34] = { "pause", 0, syscall_pause },
+    [35] = { "nanosleep", 2, syscall_nanosleep },
+    [39] = { "getpid", 0, syscall_getpid },
+    [60] = { "exit", 1, syscall_exit },
+    [110] = { "getppid", 0, syscall_getppid },
+    [140] = { "getpriority", 2, syscall_getpriority },
+    [141] = { "setpriority", 3, syscall_setpriority },
+    [202] = { "futex", 4, syscall_futex },
+    [314] = { "spawn", 6, syscall_spawn },
+    [315] = { "workingset", 2, syscall_workingset },
+    [316] = { "ksm_info", 1, syscall_ksm_info },
+    [317] = { "shm_open", 2, syscall_shm_open },
+    [318] = { "shm_map", 2, syscall_shm_map },
+    [319] = { "shm_unlink", 1, syscall_shm_unlink },
+    [320] = { "syscall_info", 2, syscall_syscall_info },
+    [321] = { "uring_setup", 2, syscall_uring_setup },
+    [322] = { "uring_enter", 1, syscall_uring_enter },
+    [323] = { "irq_set_affinity", 2, syscall_irq_set_affinity },
+};
+
+// syscall_record(unsigned long long, unsigned long long) -> void
+// Adds the time a call to a syscall took to its latency histogram.
+static void syscall_record(unsigned long long syscall, unsigned long long time) {
+    syscall_stats_t* stats = &syscall_stats[syscall];
+    stats->total_time += time;
+    if (time > stats->max_time)
+        stats->max_time = time;
+
+    // Bucket i holds times below 2^i ticks, and the last one everything longer
+    unsigned int bucket = 0;
+    while (bucket < SYSCALL_HISTOGRAM_BUCKETS - 1 && (time >> bucket) != 0)
+        bucket++;
+    stats->histogram[bucket]++;
+}
+
+// user_syscall(pid_t, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long) -> unsigned long long
+// Does a syscall for a user mode process.
+unsigned long long user_syscall(
+    pid_t pid,
+    unsigned long long syscall,
+    unsigned long long a0,
+    unsigned long long a1,
+    unsigned long long a2,
+    unsigned long long a3,
+    unsigned long long a4,
+    unsigned long long a5,
+    trap_t* trap
+) {
+    const syscall_entry_t* entry = syscall < SYSCALL_MAX ? &syscall_table[syscall] : (void*) 0;
+    if (entry == (void*) 0 || entry->handler == (void*) 0) {
+        console_printf("Called unknown syscall 0x%llx with arguments:\n", syscall);
+        console_printf("    a0: 0x%llx\n", a0);
+        console_printf("    a1: 0x%llx\n", a1);
+        console_printf("    a2: 0x%llx\n", a2);
+        console_printf("    a3: 0x%llx\n", a3);
+        console_printf("    a4: 0x%llx\n", a4);
+        console_printf("    a5: 0x%llx\n", a5);
+        return -1;
+    }
+
+#ifdef SYSCALL_DEBUG
+    unsigned long long args[] = { a0, a1, a2, a3, a4, a5 };
+    console_printf("[syscall] %llu: %s(", pid, entry->name);
+    for (unsigned int i = 0; i < entry->arg_count; i++)
+        console_printf(i != 0 ? ", 0x%llx" : "0x%llx", args[i]);
+    console_printf(")\n");
+#endif
+
+    // Counted before the call since some syscalls never return
+    syscall_stats[syscall].count++;
+
+    unsigned long long start, end;
+    asm volatile("csrr %0, time" : "=r" (start));
+    unsigned long long result = entry->handler(pid, a0, a1, a2, a3, a4, a5, trap);
+    asm volatile("csrr %0, time" : "=r" (end));
+    syscall_record(syscall, end - start);
+    return result;
+}
+
+// syscall_info(unsigned long long, syscall_info_t*) -> int
+// Fills in the name, argument count, and statistics of a syscall. Returns 0 on success, or -1 if there is no syscall with the given number.
+int syscall_info(unsigned long long syscall, syscall_info_t* info) {
+    if (syscall >= SYSCALL_MAX || syscall_table[syscall].handler == (void*) 0)
+        return -1;
+
+    const syscall_entry_t* entry = &syscall_table[syscall];
+    *info = (syscall_info_t) {
+        .name = { 0 },
+        .arg_count = entry->arg_count,
+        .stats = syscall_stats[syscall]
+    };
+    for (unsigned int i = 0; i < sizeof(info->name) - 1 && entry->name[i]; i++)
+        info->name[i] = entry->name[i];
+    return 0;
+}
@@ -4,6 +4,43 @@
 #include "../interrupts.h"
 #include "process.h"
 
+// Syscalls below this number may have a fast handler. Must match the bound in interrupts_s.s.
+#define SYSCALL_FAST_MAX 128
+
+// Handlers for syscalls that are simple enough to skip the full trap path, or null for those that are not. They are called with only the registers the C calling convention does not preserve saved, without the kernel lock and with interrupts disabled, so they must not sleep, switch processes, or change shared state.
+extern unsigned long long (*syscall_fast_table[SYSCALL_FAST_MAX])(unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, trap_t*);
+
+// Number of entries in the syscall table. Syscall numbers must be below this.
+#define SYSCALL_MAX 512
+
+// Number of buckets in the latency histogram of each syscall.
+#define SYSCALL_HISTOGRAM_BUCKETS 24
+
+// Signature of a syscall handler. Arguments are passed in a0 to a5.
+typedef unsigned long long (*syscall_handler_t)(pid_t pid, unsigned long long a0, unsigned long long a1, unsigned long long a2, unsigned long long a3, unsigned long long a4, unsigned long long a5, trap_t* trap);
+
+// A registered syscall. The name and argument count are used for tracing and statistics.
+typedef struct {
+    const char* name;
+    unsigned int arg_count;
+    syscall_handler_t handler;
+} syscall_entry_t;
+
+// Call counts and latencies of a syscall in ticks of the time CSR. Bucket i of the histogram counts calls that took less than 2^i ticks and more than the previous bucket; the last bucket counts everything longer. Calls through the fast path are not counted.
+typedef struct {
+    unsigned long long count;
+    unsigned long long total_time;
+    unsigned long long max_time;
+    unsigned long long histogram[SYSCALL_HISTOGRAM_BUCKETS];
+} syscall_stats_t;
+
+// Syscall statistics as reported to userspace.
+typedef struct {
+    char name[16];
+    unsigned long long arg_count;
+    syscall_stats_t stats;
+} syscall_info_t;
+
 // user_syscall(unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long, unsigned long long) -> unsigned long long
 // Does a syscall for a user mode process.
 unsigned long long user_syscall(
@@ -18,4 +55,8 @@ unsigned long long user_syscall(
     trap_t* trap
 );
 
+// syscall_info(unsigned long long, syscall_info_t*) -> int
+// Fills in the name, argument count, and statistics of a syscall. Returns 0 on success, or -1 if there is no syscall with the given number.
+int syscall_info(unsigned long long syscall, syscall_info_t* info);
+
 #endif /* KERNEL_SYSCALL_H */
@@ -0,0 +1,244 @@
+#include "timer.h"
+#include "../drivers/console/console.h"
+#include "../drivers/devicetree/tree.h"
+#include "../lib/memory.h"
+#include "../lib/string.h"
+#include "../opensbi.h"
+#include "../smp.h"
+
+unsigned long long timer_frequency = TIMER_DEFAULT_FREQUENCY;
+char timer_sstc = 0;
+
+timer_queue_t timer_queues[SMP_MAX_HARTS] = { 0 };
+
+// timer_isa_has_extension(char*, unsigned long long, char*) -> char
+// Checks if an extension is in an ISA string such as rv64imac_zicsr_sstc, or in a list of extension names such as riscv,isa-extensions. Multi-letter extensions are separated by underscores and names are not case sensitive.
+static char timer_isa_has_extension(char* isa, unsigned long long len, char* extension) {
+    unsigned long long ext_len = strlen(extension);
+    unsigned long long start = 0;
+    for (unsigned long long i = 0; i <= len; i++) {
+        if (i != len && isa[i] != '_' && isa[i] != '\0')
+            continue;
+
+        if (i - start == ext_len) {
+            unsigned long long j = 0;
+            while (j < ext_len && (isa[start + j] | 0x20) == extension[j])
+                j++;
+            if (j == ext_len)
+                return 1;
+        }
+        start = i + 1;
+    }
+    return 0;
+}
+
+// timer_hart_has_sstc(fdt_t*, void*) -> char
+// Checks if a cpu node in the device tree lists the Sstc extension.
+static char timer_hart_has_sstc(fdt_t* devicetree, void* cpu) {
+    struct fdt_property extensions = fdt_get_property(devicetree, cpu, "riscv,isa-extensions");
+    if (extensions.data != (void*) 0)
+        return timer_isa_has_extension(extensions.data, extensions.len, "sstc");
+
+    struct fdt_property isa = fdt_get_property(devicetree, cpu, "riscv,isa");
+    return isa.data != (void*) 0 && timer_isa_has_extension(isa.data, strlen(isa.data), "sstc");
+}
+
+// init_timers(void*) -> void
+// Reads the timebase frequency from the device tree and checks if every hart has the Sstc extension.
+void init_timers(void* fdt) {
+    fdt_t devicetree = verify_fdt(fdt);
+    if (devicetree.header == (void*) 0)
+        return;
+
+    // timer_set() runs on every hart, so Sstc is only used if all of them have it
+    char sstc = 0;
+    void* cpu = (void*) 0;
+    while ((cpu = fdt_find(&devicetree, "cpu", cpu)) != (void*) 0) {
+        struct fdt_property reg = fdt_get_property(&devicetree, cpu, "reg");
+        struct fdt_property status = fdt_get_property(&devicetree, cpu, "status");
+        if (reg.data == (void*) 0 || (status.data != (void*) 0 && strcmp(status.data, "okay")))
+            continue;
+
+        if (!timer_hart_has_sstc(&devicetree, cpu)) {
+            sstc = 0;
+            break;
+        }
+        sstc = 1;
+    }
+    timer_sstc = sstc;
+    console_printf("Timers are programmed %s\n", timer_sstc ? "through stimecmp" : "through the SBI");
+
+    // The frequency is usually on /cpus, but may be given on each cpu instead
+    struct fdt_property frequency = fdt_get_property(&devicetree, fdt_path(&devicetree, "/cpus", (void*) 0), "timebase-frequency");
+    if (frequency.data == (void*) 0)
+        frequency = fdt_get_property(&devicetree, fdt_find(&devicetree, "cpu", (void*) 0), "timebase-frequency");
+    if (frequency.data == (void*) 0 || be_to_le(8 * frequency.len, frequency.data) == 0) {
+        console_printf("No timebase frequency in the device tree; assuming %llu Hz\n", timer_frequency);
+        return;
+    }
+
+    timer_frequency = be_to_le(8 * frequency.len, frequency.data);
+    console_printf("Timebase frequency is %llu Hz\n", timer_frequency);
+}
+
+// timer_set(unsigned long long) -> void
+// Programs the current hart's timer to go off once the time CSR reaches the given value.
+void timer_set(unsigned long long deadline) {
+    // stimecmp is written by number since older assemblers do not know its name
+    if (timer_sstc)
+        asm volatile("csrw 0x14d, %0" : : "r" (deadline));
+    else
+        sbi_set_timer(deadline);
+}
+
+// timer_now() -> unsigned long long
+// Reads the time CSR.
+unsigned long long timer_now() {
+    unsigned long long time;
+    asm volatile("csrr %0, time" : "=r" (time));
+    return time;
+}
+
+// timer_ticks(unsigned long long, unsigned long long) -> unsigned long long
+// Converts a length of time into ticks of the time CSR, rounding up.
+unsigned long long timer_ticks(unsigned long long seconds, unsigned long long nanoseconds) {
+    // Whole seconds are converted separately so that this does not overflow
+    seconds += nanoseconds / 1000000000;
+    nanoseconds %= 1000000000;
+    return seconds * timer_frequency + (nanoseconds * timer_frequency + 999999999) / 1000000000;
+}
+
+// timer_init(ktimer_t*, void (*)(ktimer_t*, void*), void*) -> void
+// Initialises a timer that is not pending.
+void timer_init(ktimer_t* timer, void (*callback)(ktimer_t*, void*), void* data) {
+    *timer = (ktimer_t) {
+        .deadline = TIMER_NEVER,
+        .callback = callback,
+        .data = data,
+        .queue = (void*) 0,
+        .heap_index = 0
+    };
+}
+
+// timer_queue_set(timer_queue_t*, unsigned long long, ktimer_t*) -> void
+// Puts a timer at a position in the heap.
+static void timer_queue_set(timer_queue_t* queue, unsigned long long i, ktimer_t* timer) {
+    queue->heap[i] = timer;
+    timer->heap_index = i;
+}
+
+// timer_queue_sift_up(timer_queue_t*, unsigned long long) -> void
+// Moves a timer up the heap until its parent has an earlier deadline.
+static void timer_queue_sift_up(timer_queue_t* queue, unsigned long long i) {
+    ktimer_t* timer = queue->heap[i];
+    while (i > 0) {
+        unsigned long long parent = (i - 1) / 2;
+        if (timer->deadline >= queue->heap[parent]->deadline)
+            break;
+        timer_queue_set(queue, i, queue->heap[parent]);
+        i = parent;
+    }
+    timer_queue_set(queue, i, timer);
+}
+
+// timer_queue_sift_down(timer_queue_t*, unsigned long long) -> void
+// Moves a timer down the heap until its children have later deadlines.
+static void timer_queue_sift_down(timer_queue_t* queue, unsigned long long i) {
+    ktimer_t* timer = queue->heap[i];
+    while (1) {
+        unsigned long long child = 2 * i + 1;
+        if (child >= queue->length)
+            break;
+        if (child + 1 < queue->length && queue->heap[child + 1]->deadline < queue->heap[child]->deadline)
+            child++;
+        if (queue->heap[child]->deadline >= timer->deadline)
+            break;
+        timer_queue_set(queue, i, queue->heap[child]);
+        i = child;
+    }
+    timer_queue_set(queue, i, timer);
+}
+
+// timer_reprogram(timer_queue_t*) -> void
+// Programs the current hart's timer for whichever comes first of the end of the time slice and the next pending timer.
+static void timer_reprogram(timer_queue_t* queue) {
+    unsigned long long deadline = queue->slice_end;
+    if (queue->length != 0 && queue->heap[0]->deadline < deadline)
+        deadline = queue->heap[0]->deadline;
+    timer_set(deadline);
+}
+
+// timer_add(ktimer_t*, unsigned long long) -> char
+// Arms a timer on the current hart, moving it if it was already pending. Returns 0 on success.
+char timer_add(ktimer_t* timer, unsigned long long deadline) {
+    timer_cancel(timer);
+
+    timer_queue_t* queue = &timer_queues[current_hartid()];
+    if (queue->length == queue->capacity) {
+        unsigned long long capacity = queue->capacity != 0 ? queue->capacity * 2 : 64;
+        ktimer_t** heap = malloc(capacity * sizeof(ktimer_t*));
+        if (heap == (void*) 0)
+            return -1;
+        memcpy(heap, queue->heap, queue->length * sizeof(ktimer_t*));
+        free(queue->heap);
+        queue->heap = heap;
+        queue->capacity = capacity;
+    }
+
+    timer->deadline = deadline;
+    timer->queue = queue;
+    timer_queue_set(queue, queue->length++, timer);
+    timer_queue_sift_up(queue, queue->length - 1);
+
+    // Only an earlier deadline than the one the hart is waiting for needs the timer to move
+    if (timer->heap_index == 0 && deadline < queue->slice_end)
+        timer_set(deadline);
+    return 0;
+}
+
+// timer_cancel(ktimer_t*) -> char
+// Disarms a timer. Returns 0 if the timer was pending.
+char timer_cancel(ktimer_t* timer) {
+    timer_queue_t* queue = timer->queue;
+    if (queue == (void*) 0)
+        return -1;
+
+    // Fill the hole with the last timer and restore the heap order around it. The hart's timer may go off early, which is harmless.
+    unsigned long long i = timer->heap_index;
+    ktimer_t* last = queue->heap[--queue->length];
+    if (i != queue->length) {
+        timer_queue_set(queue, i, last);
+        timer_queue_sift_up(queue, i);
+        timer_queue_sift_down(queue, last->heap_index);
+    }
+
+    timer->queue = (void*) 0;
+    return 0;
+}
+
+// timer_program(unsigned long long) -> void
+// Records when the time slice of the process picked for the current hart ends and programs the hart's timer for whichever comes first of that and the next pending timer.
+void timer_program(unsigned long long slice_end) {
+    timer_queue_t* queue = &timer_queues[current_hartid()];
+    queue->slice_end = slice_end;
+    timer_reprogram(queue);
+}
+
+// timer_tick() -> char
+// Called when the timer of the current hart goes off. Runs the callbacks of expired timers and reprograms the timer. Returns true if the time slice is over, in which case the timer is reprogrammed when the next process is picked.
+char timer_tick() {
+    timer_queue_t* queue = &timer_queues[current_hartid()];
+    unsigned long long now = timer_now();
+
+    // Callbacks may add timers, so each expired timer is taken off before its callback runs
+    while (queue->length != 0 && queue->heap[0]->deadline <= now) {
+        ktimer_t* timer = queue->heap[0];
+        timer_cancel(timer);
+        timer->callback(timer, timer->data);
+    }
+
+    if (queue->slice_end <= now)
+        return 1;
+    timer_reprogram(queue);
+    return 0;
+}
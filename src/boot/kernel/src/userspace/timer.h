@@ -0,0 +1,77 @@
+#ifndef KERNEL_TIMER_H
+#define KERNEL_TIMER_H
+
+// Timebase frequency used if the device tree does not give one, which is that of QEMU's virt machine.
+#define TIMER_DEFAULT_FREQUENCY 10000000
+
+// Deadline that never passes.
+#define TIMER_NEVER ((unsigned long long) -1)
+
+struct s_timer_queue;
+
+// A deadline in ticks of the time CSR and the function to call once it has passed. Callbacks run with the kernel lock held on the hart the timer was added on, and must not sleep.
+typedef struct s_ktimer {
+    unsigned long long deadline;
+    void (*callback)(struct s_ktimer*, void*);
+    void* data;
+    struct s_timer_queue* queue;
+    unsigned long long heap_index;
+} ktimer_t;
+
+// Pending timers of a hart ordered by deadline in a binary min heap, and the end of the running process's time slice. Both share the hart's one timer.
+typedef struct s_timer_queue {
+    ktimer_t** heap;
+    unsigned long long length;
+    unsigned long long capacity;
+    unsigned long long slice_end;
+} timer_queue_t;
+
+// A length of time as passed in by userspace.
+typedef struct {
+    long long seconds;
+    long long nanoseconds;
+} timespec_t;
+
+// Ticks of the time CSR per second.
+extern unsigned long long timer_frequency;
+
+// Whether every hart has the Sstc extension, so that stimecmp can be written directly instead of going through the SBI.
+extern char timer_sstc;
+
+// init_timers(void*) -> void
+// Reads the timebase frequency from the device tree and checks if every hart has the Sstc extension.
+void init_timers(void* fdt);
+
+// timer_set(unsigned long long) -> void
+// Programs the current hart's timer to go off once the time CSR reaches the given value.
+void timer_set(unsigned long long deadline);
+
+// timer_now() -> unsigned long long
+// Reads the time CSR.
+unsigned long long timer_now();
+
+// timer_ticks(unsigned long long, unsigned long long) -> unsigned long long
+// Converts a length of time into ticks of the time CSR, rounding up.
+unsigned long long timer_ticks(unsigned long long seconds, unsigned long long nanoseconds);
+
+// timer_init(ktimer_t*, void (*)(ktimer_t*, void*), void*) -> void
+// Initialises a timer that is not pending.
+void timer_init(ktimer_t* timer, void (*callback)(ktimer_t*, void*), void* data);
+
+// timer_add(ktimer_t*, unsigned long long) -> char
+// Arms a timer on the current hart, moving it if it was already pending. Returns 0 on success.
+char timer_add(ktimer_t* timer, unsigned long long deadline);
+
+// timer_cancel(ktimer_t*) -> char
+// Disarms a timer. Returns 0 if the timer was pending.
+char timer_cancel(ktimer_t* timer);
+
+// timer_program(unsigned long long) -> void
+// Records when the time slice of the process picked for the current hart ends and programs the hart's timer for whichever comes first of that and the next pending timer.
+void timer_program(unsigned long long slice_end);
+
+// timer_tick() -> char
+// Called when the timer of the current hart goes off. Runs the callbacks of expired timers and reprograms the timer. Returns true if the time slice is over, in which case the timer is reprogrammed when the next process is picked.
+char timer_tick();
+
+#endif /* KERNEL_TIMER_H */
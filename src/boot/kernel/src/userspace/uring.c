@@ -0,0 +1,146 @@
+#include "uring.h"
+#include "syscall.h"
+
+// uring_op_allowed(unsigned long long) -> char
+// Checks if a syscall may be submitted through a ring. Only I/O and memory mapping calls that always return are allowed.
+static char uring_op_allowed(unsigned long long opcode) {
+    switch (opcode) {
+        case 0:     // read
+        case 1:     // write
+        case 2:     // open
+        case 3:     // close
+        case 9:     // mmap
+        case 11:    // munmap
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// uring_setup(process_t*, unsigned int, unsigned int) -> void*
+// Creates a ring with the given number of submission entries, which must be a power of two, and maps it into the mmap region of a process. Returns the address of the mapping, or null on failure.
+void* uring_setup(process_t* process, unsigned int entries, unsigned int flags) {
+    if (process->uring != (void*) 0 || entries == 0 || entries > URING_MAX_ENTRIES || (entries & (entries - 1)) || process->mmap_next >= mmu_user_top())
+        return (void*) 0;
+
+    uring_t* ring = malloc(sizeof(uring_t));
+    if (ring == (void*) 0)
+        return (void*) 0;
+    void* page = alloc_page(1);
+    if (page == (void*) 0) {
+        free(ring);
+        return (void*) 0;
+    }
+
+    // The kernel keeps its own reference to the page and the mapping holds another, so it is never swapped or merged
+    void* mapping = process->mmap_next;
+    if (page_get(page)) {
+        dealloc_page(page);
+        free(ring);
+        return (void*) 0;
+    }
+    if (map_mmu(process->mmu_data, mapping, page, MMU_FLAG_USER | MMU_FLAG_READ | MMU_FLAG_WRITE)) {
+        dealloc_page(page);
+        dealloc_page(page);
+        free(ring);
+        return (void*) 0;
+    }
+    mmu_walk_entry(process->mmu_data, mapping, 0)->raw |= MMU_FLAG_ALLOCED;
+    process->mmap_next += PAGE_SIZE;
+
+    uring_header_t* header = page;
+    *header = (uring_header_t) {
+        .sq_head = 0,
+        .sq_tail = 0,
+        .sq_mask = entries - 1,
+        .cq_head = 0,
+        .cq_tail = 0,
+        .cq_mask = 2 * entries - 1,
+        .flags = flags,
+        .reserved = 0,
+        .sq_offset = sizeof(uring_header_t),
+        .cq_offset = sizeof(uring_header_t) + entries * sizeof(uring_sqe_t)
+    };
+
+    *ring = (uring_t) {
+        .page = page,
+        .header = header,
+        .sqes = page + header->sq_offset,
+        .cqes = page + header->cq_offset,
+        .entries = entries,
+        .flags = flags,
+        .sq_head = 0,
+        .cq_tail = 0
+    };
+    process->uring = ring;
+    return mapping;
+}
+
+// uring_submit(process_t*, unsigned int, trap_t*) -> unsigned int
+// Does up to the given number of queued submissions. Stops early rather than dropping completions if the completion ring is full. Returns the number of submissions done.
+static unsigned int uring_submit(process_t* process, unsigned int limit, trap_t* trap) {
+    uring_t* ring = process->uring;
+    volatile uring_header_t* header = ring->header;
+    unsigned int sq_mask = ring->entries - 1;
+    unsigned int cq_mask = 2 * ring->entries - 1;
+
+    // A ring never holds more than its size, whatever the process wrote to its indices
+    if (limit == 0 || limit > ring->entries)
+        limit = ring->entries;
+
+    unsigned int done = 0;
+    while (done < limit && ring->sq_head != header->sq_tail && ring->cq_tail - header->cq_head <= cq_mask) {
+        asm volatile("fence r, r" : : : "memory");
+
+        // The process can still write to the entry, so it is copied before being looked at
+        uring_sqe_t sqe = ring->sqes[ring->sq_head & sq_mask];
+        ring->sq_head++;
+        header->sq_head = ring->sq_head;
+
+        long long result = -1;
+        if (uring_op_allowed(sqe.opcode))
+            result = user_syscall(process->pid, sqe.opcode, sqe.args[0], sqe.args[1], sqe.args[2], sqe.args[3], sqe.args[4], sqe.args[5], trap);
+
+        uring_cqe_t* cqe = &ring->cqes[ring->cq_tail & cq_mask];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        asm volatile("fence w, w" : : : "memory");
+        ring->cq_tail++;
+        header->cq_tail = ring->cq_tail;
+        done++;
+    }
+
+    return done;
+}
+
+// uring_enter(process_t*, unsigned int, trap_t*) -> int
+// Does up to the given number of queued submissions of a process, or all that fit if it is 0, and posts their completions. Returns the number of submissions done, or -1 if the process has no ring.
+int uring_enter(process_t* process, unsigned int to_submit, trap_t* trap) {
+    if (process->uring == (void*) 0)
+        return -1;
+    return uring_submit(process, to_submit, trap);
+}
+
+// uring_poll(process_t*, trap_t*) -> void
+// Called on the timer ticks of a process. Does a batch of its queued submissions if its ring is polled.
+void uring_poll(process_t* process, trap_t* trap) {
+    uring_t* ring = process->uring;
+    if (ring == (void*) 0 || !(ring->flags & URING_SETUP_POLL))
+        return;
+
+    // Ticks are not syscalls, so nothing here sleeps; block I/O is polled instead
+    uring_submit(process, URING_POLL_BATCH, trap);
+}
+
+// uring_release(process_t*) -> void
+// Frees the ring of a process that is being killed.
+void uring_release(process_t* process) {
+    uring_t* ring = process->uring;
+    if (ring == (void*) 0)
+        return;
+
+    // The mapping's reference is dropped when the process's page table is cleaned
+    dealloc_page(ring->page);
+    free(ring);
+    process->uring = (void*) 0;
+}
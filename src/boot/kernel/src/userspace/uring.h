@@ -0,0 +1,71 @@
+#ifndef KERNEL_URING_H
+#define KERNEL_URING_H
+
+#include "process.h"
+
+// Largest number of entries in a submission ring. The completion ring has twice as many, and both fit in one page with the header.
+#define URING_MAX_ENTRIES 32
+
+// Largest number of submissions picked up from a polled ring on each timer tick.
+#define URING_POLL_BATCH 8
+
+// Setup flags
+// The kernel picks up submissions on the process's timer ticks, so the process does not need to enter.
+#define URING_SETUP_POLL 1
+
+// Header at the start of a ring page, shared with the process. The kernel writes sq_head and cq_tail, and the process writes sq_tail and cq_head. Offsets are from the start of the page.
+typedef struct {
+    unsigned int sq_head;
+    unsigned int sq_tail;
+    unsigned int sq_mask;
+    unsigned int cq_head;
+    unsigned int cq_tail;
+    unsigned int cq_mask;
+    unsigned int flags;
+    unsigned int reserved;
+    unsigned long long sq_offset;
+    unsigned long long cq_offset;
+} uring_header_t;
+
+// A submission. The opcode is the number of the syscall to do with the given arguments.
+typedef struct {
+    unsigned long long opcode;
+    unsigned long long user_data;
+    unsigned long long args[6];
+} uring_sqe_t;
+
+// A completion, holding the user data of its submission and the result of the syscall.
+typedef struct {
+    unsigned long long user_data;
+    long long result;
+} uring_cqe_t;
+
+// Kernel side state of a ring. The kernel keeps its own copies of the indices it writes so that the process cannot make it skip or repeat work.
+typedef struct {
+    void* page;
+    uring_header_t* header;
+    uring_sqe_t* sqes;
+    uring_cqe_t* cqes;
+    unsigned int entries;
+    unsigned int flags;
+    unsigned int sq_head;
+    unsigned int cq_tail;
+} uring_t;
+
+// uring_setup(process_t*, unsigned int, unsigned int) -> void*
+// Creates a ring with the given number of submission entries, which must be a power of two, and maps it into the mmap region of a process. Returns the address of the mapping, or null on failure.
+void* uring_setup(process_t* process, unsigned int entries, unsigned int flags);
+
+// uring_enter(process_t*, unsigned int, trap_t*) -> int
+// Does up to the given number of queued submissions of a process, or all that fit if it is 0, and posts their completions. Returns the number of submissions done, or -1 if the process has no ring.
+int uring_enter(process_t* process, unsigned int to_submit, trap_t* trap);
+
+// uring_poll(process_t*, trap_t*) -> void
+// Called on the timer ticks of a process. Does a batch of its queued submissions if its ring is polled.
+void uring_poll(process_t* process, trap_t* trap);
+
+// uring_release(process_t*) -> void
+// Frees the ring of a process that is being killed.
+void uring_release(process_t* process);
+
+#endif /* KERNEL_URING_H */
@@ -0,0 +1,29 @@
+#include "vdso.h"
+#include "timer.h"
+
+extern char vdso_start;
+
+// vdso_init_hart() -> void
+// Lets user mode read the time CSR on the current hart.
+void vdso_init_hart() {
+    unsigned long long tm = 0x2;
+    asm volatile("csrs scounteren, %0" : : "r" (tm));
+}
+
+// vdso_map(process_t*) -> int
+// Maps the vdso into a process and fills in its data page. Returns 0 on success.
+int vdso_map(process_t* process) {
+    // The data page is the process's own and is freed with its page table
+    vdso_data_t* data = alloc_page_mmu(process->mmu_data, (void*) VDSO_DATA_ADDRESS, MMU_FLAG_USER | MMU_FLAG_READ);
+    if (data == (void*) 0)
+        return -1;
+
+    *data = (vdso_data_t) {
+        .pid = process->pid,
+        .parent_pid = process->parent_pid,
+        .timebase_frequency = timer_frequency
+    };
+
+    // The code page is part of the kernel image and shared by every process
+    return map_mmu(process->mmu_data, (void*) VDSO_CODE_ADDRESS, &vdso_start, MMU_FLAG_USER | MMU_FLAG_READ | MMU_FLAG_EXEC);
+}
@@ -0,0 +1,25 @@
+#ifndef KERNEL_VDSO_H
+#define KERNEL_VDSO_H
+
+#include "process.h"
+
+// Where the vdso is mapped in every process. The data page comes first and the code page right after it.
+#define VDSO_DATA_ADDRESS 0x1000
+#define VDSO_CODE_ADDRESS 0x2000
+
+// Contents of the vdso data page. The layout is shared with the routines in vdso.s and with userspace.
+typedef struct {
+    unsigned long long pid;
+    unsigned long long parent_pid;
+    unsigned long long timebase_frequency;
+} vdso_data_t;
+
+// vdso_init_hart() -> void
+// Lets user mode read the time CSR on the current hart.
+void vdso_init_hart();
+
+// vdso_map(process_t*) -> int
+// Maps the vdso into a process and fills in its data page. Returns 0 on success.
+int vdso_map(process_t* process);
+
+#endif /* KERNEL_VDSO_H */
@@ -0,0 +1,67 @@
+#include "waitqueue.h"
+#include "sched.h"
+
+// wait_queue_sleep(wait_queue_t*) -> void
+// Blocks the current process on a wait queue until it is woken up. Only call this if sched_can_sleep() is true; the condition being waited on should be checked again afterwards.
+void wait_queue_sleep(wait_queue_t* queue) {
+    wait_queue_sleep_until(queue, TIMER_NEVER);
+}
+
+// wait_queue_sleep_until(wait_queue_t*, unsigned long long) -> char
+// Blocks the current process on a wait queue until it is woken up or the time CSR reaches the deadline. Only call this if sched_can_sleep() is true. Returns 0 if woken up, or -1 if the deadline passed first.
+char wait_queue_sleep_until(wait_queue_t* queue, unsigned long long deadline) {
+    process_t* process = sched_current_process();
+    process->wait_next = (void*) 0;
+    if (queue->tail != (void*) 0)
+        queue->tail->wait_next = process;
+    else
+        queue->head = process;
+    queue->tail = process;
+
+    sched_block_until(deadline);
+
+    // Wakers take the process off the queue, so still being on it means the deadline passed
+    return wait_queue_remove(queue, process) ? 0 : -1;
+}
+
+// wait_queue_wake_one(wait_queue_t*) -> char
+// Wakes up the process that has been waiting the longest. Returns 0 if a process was woken up.
+char wait_queue_wake_one(wait_queue_t* queue) {
+    process_t* process = queue->head;
+    if (process == (void*) 0)
+        return -1;
+
+    queue->head = process->wait_next;
+    if (queue->head == (void*) 0)
+        queue->tail = (void*) 0;
+    process->wait_next = (void*) 0;
+    sched_wakeup(process);
+    return 0;
+}
+
+// wait_queue_wake_all(wait_queue_t*) -> void
+// Wakes up every process in a wait queue.
+void wait_queue_wake_all(wait_queue_t* queue) {
+    while (!wait_queue_wake_one(queue));
+}
+
+// wait_queue_remove(wait_queue_t*, process_t*) -> char
+// Takes a process out of a wait queue without waking it up. Returns 0 if the process was in the queue.
+char wait_queue_remove(wait_queue_t* queue, process_t* process) {
+    process_t* last = (void*) 0;
+    for (process_t* p = queue->head; p != (void*) 0; last = p, p = p->wait_next) {
+        if (p != process)
+            continue;
+
+        if (last != (void*) 0)
+            last->wait_next = p->wait_next;
+        else
+            queue->head = p->wait_next;
+        if (queue->tail == p)
+            queue->tail = last;
+        p->wait_next = (void*) 0;
+        return 0;
+    }
+
+    return -1;
+}
@@ -0,0 +1,32 @@
+#ifndef KERNEL_WAITQUEUE_H
+#define KERNEL_WAITQUEUE_H
+
+#include "process.h"
+
+// Processes sleeping until some event happens, in the order they went to sleep. Zero initialised queues are empty.
+typedef struct {
+    process_t* head;
+    process_t* tail;
+} wait_queue_t;
+
+// wait_queue_sleep(wait_queue_t*) -> void
+// Blocks the current process on a wait queue until it is woken up. Only call this if sched_can_sleep() is true; the condition being waited on should be checked again afterwards.
+void wait_queue_sleep(wait_queue_t* queue);
+
+// wait_queue_sleep_until(wait_queue_t*, unsigned long long) -> char
+// Blocks the current process on a wait queue until it is woken up or the time CSR reaches the deadline. Only call this if sched_can_sleep() is true. Returns 0 if woken up, or -1 if the deadline passed first.
+char wait_queue_sleep_until(wait_queue_t* queue, unsigned long long deadline);
+
+// wait_queue_wake_one(wait_queue_t*) -> char
+// Wakes up the process that has been waiting the longest. Returns 0 if a process was woken up.
+char wait_queue_wake_one(wait_queue_t* queue);
+
+// wait_queue_wake_all(wait_queue_t*) -> void
+// Wakes up every process in a wait queue.
+void wait_queue_wake_all(wait_queue_t* queue);
+
+// wait_queue_remove(wait_queue_t*, process_t*) -> char
+// Takes a process out of a wait queue without waking it up. Returns 0 if the process was in the queue.
+char wait_queue_remove(wait_queue_t* queue, process_t* process);
+
+#endif /* KERNEL_WAITQUEUE_H */
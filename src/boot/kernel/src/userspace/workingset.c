@@ -0,0 +1,135 @@
+#include "workingset.h"
+#include "../lib/memory.h"
+#include "../smp.h"
+
+// Number of scans since each physical page was last accessed, saturating at 255.
+unsigned char* page_ages = (void*) 0;
+
+unsigned long long workingset_ticks = 0;
+pid_t workingset_cursor = 0;
+
+// init_workingset() -> void
+// Initialises the page age table used by the accessed/dirty bit scanner.
+void init_workingset() {
+    page_ages = malloc(heap_page_count());
+    if (page_ages != (void*) 0)
+        memset(page_ages, 0, heap_page_count());
+}
+
+// workingset_tick() -> void
+// Called on every timer tick. Scans the next process every WORKINGSET_SCAN_TICKS ticks.
+void workingset_tick() {
+    if (++workingset_ticks < WORKINGSET_SCAN_TICKS)
+        return;
+    workingset_ticks = 0;
+
+    workingset_cursor = next_live_process(workingset_cursor);
+    if (workingset_cursor == 0)
+        workingset_cursor = next_live_process(0);
+    if (workingset_cursor != 0)
+        workingset_scan(workingset_cursor);
+}
+
+// atomic_and_d(volatile unsigned long long*, unsigned long long) -> unsigned long long
+// Atomically ands a double word. Returns the old value.
+static inline unsigned long long atomic_and_d(volatile unsigned long long* ptr, unsigned long long value) {
+    unsigned long long old;
+    asm volatile("amoand.d %0, %2, (%1)" : "=r" (old) : "r" (ptr), "r" (value) : "memory");
+    return old;
+}
+
+// workingset_scan_leaf(void*, mmu_entry_t*, void*) -> void
+// Samples and clears the accessed and dirty bits of a single page.
+static void workingset_scan_leaf(void* virtual, mmu_entry_t* entry, void* data) {
+    (void) virtual;
+    process_workingset_t* ws = data;
+    if ((entry->raw & (MMU_FLAG_VALID | MMU_FLAG_USER)) != (MMU_FLAG_VALID | MMU_FLAG_USER))
+        return;
+
+    // The process may be running on another hart, whose page table walker sets these bits atomically too
+    unsigned long long raw = atomic_and_d(&entry->raw, ~(MMU_FLAG_ACCESSED | MMU_FLAG_DIRTY));
+
+    ws->resident++;
+    unsigned long long i = page_index(MMU_UNWRAP(*entry));
+    if (raw & MMU_FLAG_ACCESSED) {
+        ws->accessed++;
+        if (i < heap_page_count())
+            page_ages[i] = 0;
+    } else if (i < heap_page_count() && page_ages[i] != 0xff) {
+        page_ages[i]++;
+    }
+
+    if (raw & MMU_FLAG_DIRTY)
+        ws->dirtied++;
+}
+
+// workingset_scan(pid_t) -> void
+// Samples and clears the accessed and dirty bits of every user page of a process and updates its estimates.
+void workingset_scan(pid_t pid) {
+    process_t* process = fetch_process(pid);
+    if (page_ages == (void*) 0 || process->state == PROCESS_STATE_DEAD || process->mmu_data == (void*) 0)
+        return;
+
+    process_workingset_t* ws = &process->workingset;
+    ws->resident = 0;
+    ws->accessed = 0;
+    ws->dirtied = 0;
+    mmu_walk_leaves(process->mmu_data, workingset_scan_leaf, ws);
+
+    // Cached translations on any hart would otherwise keep the bits from being set again
+    smp_flush_tlb();
+
+    // Exponentially weighted moving averages with a weight of 1/4 on the newest sample
+    if (ws->scans == 0) {
+        ws->working_set = ws->accessed << WORKINGSET_SHIFT;
+        ws->dirty_rate = ws->dirtied << WORKINGSET_SHIFT;
+    } else {
+        ws->working_set = (3 * ws->working_set + (ws->accessed << WORKINGSET_SHIFT)) / 4;
+        ws->dirty_rate = (3 * ws->dirty_rate + (ws->dirtied << WORKINGSET_SHIFT)) / 4;
+    }
+
+    unsigned long long time;
+    asm volatile("csrr %0, time" : "=r" (time));
+    if (ws->scans != 0)
+        ws->interval = time - ws->last_scan;
+    ws->last_scan = time;
+    ws->scans++;
+}
+
+// workingset_page_age(void*) -> unsigned char
+// Returns the number of scans since a physical page was last seen accessed.
+unsigned char workingset_page_age(void* physical) {
+    unsigned long long i = page_index(physical);
+    if (page_ages == (void*) 0 || i >= heap_page_count())
+        return 0;
+    return page_ages[i];
+}
+
+// workingset_reset_page(void*) -> void
+// Marks a physical page as recently used, for instance after it is brought back in.
+void workingset_reset_page(void* physical) {
+    unsigned long long i = page_index(physical);
+    if (page_ages != (void*) 0 && i < heap_page_count())
+        page_ages[i] = 0;
+}
+
+// workingset_info(pid_t, workingset_info_t*) -> int
+// Fills in the working set statistics of a process. Returns 0 on success.
+int workingset_info(pid_t pid, workingset_info_t* info) {
+    if (pid == 0 || pid >= MAX_PID)
+        return -1;
+
+    process_t* process = fetch_process(pid);
+    if (process->state == PROCESS_STATE_DEAD)
+        return -1;
+
+    process_workingset_t* ws = &process->workingset;
+    *info = (workingset_info_t) {
+        .resident_pages = ws->resident,
+        .working_set_pages = (ws->working_set + (1 << (WORKINGSET_SHIFT - 1))) >> WORKINGSET_SHIFT,
+        .dirty_pages_per_scan = (ws->dirty_rate + (1 << (WORKINGSET_SHIFT - 1))) >> WORKINGSET_SHIFT,
+        .scan_interval = ws->interval,
+        .scans = ws->scans
+    };
+    return 0;
+}
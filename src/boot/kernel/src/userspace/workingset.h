@@ -0,0 +1,48 @@
+#ifndef KERNEL_WORKINGSET_H
+#define KERNEL_WORKINGSET_H
+
+#include "process.h"
+
+// Number of fractional bits in the working set averages.
+#define WORKINGSET_SHIFT 8
+
+// Number of timer ticks between scanning steps. Each step scans one process.
+#define WORKINGSET_SCAN_TICKS 64
+
+// Pages that have not been accessed for this many scans of their process are considered cold.
+#define WORKINGSET_COLD_AGE 4
+
+// Working set statistics as reported to userspace.
+typedef struct {
+    unsigned long long resident_pages;
+    unsigned long long working_set_pages;
+    unsigned long long dirty_pages_per_scan;
+    unsigned long long scan_interval;
+    unsigned long long scans;
+} workingset_info_t;
+
+// init_workingset() -> void
+// Initialises the page age table used by the accessed/dirty bit scanner.
+void init_workingset();
+
+// workingset_tick() -> void
+// Called on every timer tick. Scans the next process every WORKINGSET_SCAN_TICKS ticks.
+void workingset_tick();
+
+// workingset_scan(pid_t) -> void
+// Samples and clears the accessed and dirty bits of every user page of a process and updates its estimates.
+void workingset_scan(pid_t pid);
+
+// workingset_page_age(void*) -> unsigned char
+// Returns the number of scans since a physical page was last seen accessed.
+unsigned char workingset_page_age(void* physical);
+
+// workingset_reset_page(void*) -> void
+// Marks a physical page as recently used, for instance after it is brought back in.
+void workingset_reset_page(void* physical);
+
+// workingset_info(pid_t, workingset_info_t*) -> int
+// Fills in the working set statistics of a process. Returns 0 on success.
+int workingset_info(pid_t pid, workingset_info_t* info);
+
+#endif /* KERNEL_WORKINGSET_H */
@@ -0,0 +1,195 @@
+#include "zswap.h"
+#include "../drivers/console/console.h"
+#include "../lib/lz4.h"
+#include "../lib/memory.h"
+
+#define ZSWAP_NONE 0xffff
+#define ZSWAP_NO_OBJECT 0xff
+
+// Slab metadata for a page of the arena. Each page holds objects of a single size class.
+typedef struct {
+    unsigned char class;
+    unsigned char used;
+    unsigned char free;
+    unsigned short prev;
+    unsigned short next;
+} zswap_page_t;
+
+void* zswap_arena = (void*) 0;
+zswap_page_t* zswap_pages = (void*) 0;
+
+// Pages with free objects for each size class, and pages not assigned to any class
+unsigned short zswap_partial[ZSWAP_CLASS_COUNT];
+unsigned short zswap_empty = ZSWAP_NONE;
+
+// Compression output, which may overrun the largest object before compression gives up
+unsigned char zswap_buffer[ZSWAP_MAX_SIZE];
+
+// init_zswap() -> char
+// Allocates the arena for compressed pages. Returns 0 on success.
+char init_zswap() {
+    zswap_pages = malloc(sizeof(zswap_page_t) * ZSWAP_ARENA_PAGES);
+    zswap_arena = alloc_page(ZSWAP_ARENA_PAGES);
+    if (zswap_pages == (void*) 0 || zswap_arena == (void*) 0) {
+        free(zswap_pages);
+        dealloc_page(zswap_arena);
+        zswap_arena = (void*) 0;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < ZSWAP_CLASS_COUNT; i++) {
+        zswap_partial[i] = ZSWAP_NONE;
+    }
+
+    for (unsigned int i = 0; i < ZSWAP_ARENA_PAGES; i++) {
+        zswap_pages[i] = (zswap_page_t) {
+            .next = i + 1 < ZSWAP_ARENA_PAGES ? i + 1 : ZSWAP_NONE,
+            .prev = ZSWAP_NONE
+        };
+    }
+    zswap_empty = 0;
+
+    console_printf("Using 0x%x pages for compressed swap\n", ZSWAP_ARENA_PAGES);
+    return 0;
+}
+
+// zswap_object_size(unsigned char) -> unsigned long long
+// Returns the size of the objects of a size class.
+static unsigned long long zswap_object_size(unsigned char class) {
+    return (class + 1) * ZSWAP_GRANULE;
+}
+
+// zswap_object(unsigned short, unsigned char) -> unsigned char*
+// Returns a pointer to an object in the arena.
+static unsigned char* zswap_object(unsigned short page, unsigned char object) {
+    return zswap_arena + page * PAGE_SIZE + object * zswap_object_size(zswap_pages[page].class);
+}
+
+// zswap_unlink(unsigned short*, unsigned short) -> void
+// Removes an arena page from a list of pages.
+static void zswap_unlink(unsigned short* head, unsigned short page) {
+    zswap_page_t* meta = zswap_pages + page;
+    if (meta->prev != ZSWAP_NONE)
+        zswap_pages[meta->prev].next = meta->next;
+    else
+        *head = meta->next;
+    if (meta->next != ZSWAP_NONE)
+        zswap_pages[meta->next].prev = meta->prev;
+    meta->prev = ZSWAP_NONE;
+    meta->next = ZSWAP_NONE;
+}
+
+// zswap_push(unsigned short*, unsigned short) -> void
+// Adds an arena page to the front of a list of pages.
+static void zswap_push(unsigned short* head, unsigned short page) {
+    zswap_pages[page].prev = ZSWAP_NONE;
+    zswap_pages[page].next = *head;
+    if (*head != ZSWAP_NONE)
+        zswap_pages[*head].prev = page;
+    *head = page;
+}
+
+// zswap_alloc(unsigned char) -> zswap_handle_t
+// Allocates an object of the given size class. Returns ZSWAP_ZERO_HANDLE if the arena is full.
+static zswap_handle_t zswap_alloc(unsigned char class) {
+    unsigned short page = zswap_partial[class];
+
+    // Carve a fresh arena page into objects if there are no partially used pages
+    if (page == ZSWAP_NONE) {
+        page = zswap_empty;
+        if (page == ZSWAP_NONE)
+            return ZSWAP_ZERO_HANDLE;
+        zswap_unlink(&zswap_empty, page);
+
+        zswap_page_t* meta = zswap_pages + page;
+        meta->class = class;
+        meta->used = 0;
+        meta->free = 0;
+
+        // Free objects store the index of the next free object in their first byte
+        unsigned char count = PAGE_SIZE / zswap_object_size(class);
+        for (unsigned char i = 0; i < count; i++) {
+            *zswap_object(page, i) = i + 1 < count ? i + 1 : ZSWAP_NO_OBJECT;
+        }
+        zswap_push(&zswap_partial[class], page);
+    }
+
+    zswap_page_t* meta = zswap_pages + page;
+    unsigned char object = meta->free;
+    meta->free = *zswap_object(page, object);
+    meta->used++;
+    if (meta->free == ZSWAP_NO_OBJECT)
+        zswap_unlink(&zswap_partial[class], page);
+
+    return (page << 8) | object;
+}
+
+// zswap_store(void*, zswap_handle_t*) -> char
+// Compresses a page into the arena. Returns 0 on success, or -1 if the page does not compress well or the arena is full.
+char zswap_store(void* page, zswap_handle_t* handle) {
+    if (zswap_arena == (void*) 0)
+        return -1;
+
+    // Zero filled pages are common enough to not bother compressing
+    unsigned long long* words = page;
+    unsigned long long i;
+    for (i = 0; i < PAGE_SIZE / sizeof(unsigned long long) && words[i] == 0; i++);
+    if (i == PAGE_SIZE / sizeof(unsigned long long)) {
+        *handle = ZSWAP_ZERO_HANDLE;
+        return 0;
+    }
+
+    // Objects start with the compressed size
+    unsigned long int size = lz4_compress(page, PAGE_SIZE, zswap_buffer, ZSWAP_MAX_SIZE - sizeof(unsigned short));
+    if (size == 0)
+        return -1;
+
+    unsigned char class = (size + sizeof(unsigned short) - 1) / ZSWAP_GRANULE;
+    zswap_handle_t h = zswap_alloc(class);
+    if (h == ZSWAP_ZERO_HANDLE)
+        return -1;
+
+    unsigned char* object = zswap_object(h >> 8, h & 0xff);
+    *(unsigned short*) object = size;
+    memcpy(object + sizeof(unsigned short), zswap_buffer, size);
+    *handle = h;
+    return 0;
+}
+
+// zswap_load(zswap_handle_t, void*) -> char
+// Decompresses a stored page into the given page. Returns 0 on success.
+char zswap_load(zswap_handle_t handle, void* page) {
+    if (handle == ZSWAP_ZERO_HANDLE) {
+        memset(page, 0, PAGE_SIZE);
+        return 0;
+    }
+
+    unsigned char* object = zswap_object(handle >> 8, handle & 0xff);
+    if (lz4_decompress(object + sizeof(unsigned short), *(unsigned short*) object, page, PAGE_SIZE) != PAGE_SIZE)
+        return -1;
+    return 0;
+}
+
+// zswap_free(zswap_handle_t) -> void
+// Frees a stored page.
+void zswap_free(zswap_handle_t handle) {
+    if (handle == ZSWAP_ZERO_HANDLE)
+        return;
+
+    unsigned short page = handle >> 8;
+    unsigned char object = handle & 0xff;
+    zswap_page_t* meta = zswap_pages + page;
+    unsigned char class = meta->class;
+
+    if (meta->free == ZSWAP_NO_OBJECT)
+        zswap_push(&zswap_partial[class], page);
+    *zswap_object(page, object) = meta->free;
+    meta->free = object;
+    meta->used--;
+
+    // Give completely free pages back so that other size classes can use them
+    if (meta->used == 0) {
+        zswap_unlink(&zswap_partial[class], page);
+        zswap_push(&zswap_empty, page);
+    }
+}
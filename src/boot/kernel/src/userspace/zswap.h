@@ -0,0 +1,37 @@
+#ifndef KERNEL_ZSWAP_H
+#define KERNEL_ZSWAP_H
+
+// Number of pages set aside for compressed pages.
+#define ZSWAP_ARENA_PAGES 2048
+
+// Compressed pages are stored in objects whose sizes are multiples of this.
+#define ZSWAP_GRANULE 64
+
+// Pages that do not compress to at most this many bytes are left for disk swap.
+#define ZSWAP_MAX_SIZE 3072
+
+#define ZSWAP_CLASS_COUNT (ZSWAP_MAX_SIZE / ZSWAP_GRANULE)
+
+// Handle of a page filled with zeroes, which takes no space in the arena.
+#define ZSWAP_ZERO_HANDLE 0xffffffff
+
+// Refers to a compressed page: the arena page in the upper bits and the object in that page in the lower eight.
+typedef unsigned int zswap_handle_t;
+
+// init_zswap() -> char
+// Allocates the arena for compressed pages. Returns 0 on success.
+char init_zswap();
+
+// zswap_store(void*, zswap_handle_t*) -> char
+// Compresses a page into the arena. Returns 0 on success, or -1 if the page does not compress well or the arena is full.
+char zswap_store(void* page, zswap_handle_t* handle);
+
+// zswap_load(zswap_handle_t, void*) -> char
+// Decompresses a stored page into the given page. Returns 0 on success.
+char zswap_load(zswap_handle_t handle, void* page);
+
+// zswap_free(zswap_handle_t) -> void
+// Frees a stored page.
+void zswap_free(zswap_handle_t handle);
+
+#endif /* KERNEL_ZSWAP_H */
@@ -0,0 +1,65 @@
+.section .text
+.global vdso_start
+.global vdso_end
+
+# Code of the vdso, which is mapped into every process right after its data page. Offsets of the routines from the start of the page are fixed, since userspace calls them directly:
+#   0x00 vdso_getpid() -> pid_t
+#   0x10 vdso_getppid() -> pid_t
+#   0x20 vdso_time() -> unsigned long long
+#   0x30 vdso_timebase_frequency() -> unsigned long long
+#   0x40 vdso_time_ns() -> unsigned long long
+# auipc with -1 gives the address in the data page at the same offset as the instruction, so loads subtract the routine's offset.
+.option push
+.option norvc
+.option norelax
+.balign 4096
+vdso_start:
+
+# vdso_getpid() -> pid_t
+vdso_getpid:
+    auipc a0, 0xfffff
+    ld a0, 0x000(a0)
+    ret
+
+# vdso_getppid() -> pid_t
+.org vdso_start + 0x10
+vdso_getppid:
+    auipc a0, 0xfffff
+    ld a0, -0x008(a0)
+    ret
+
+# vdso_time() -> unsigned long long
+# Returns the value of the time CSR.
+.org vdso_start + 0x20
+vdso_time:
+    rdtime a0
+    ret
+
+# vdso_timebase_frequency() -> unsigned long long
+# Returns the number of ticks of the time CSR per second.
+.org vdso_start + 0x30
+vdso_timebase_frequency:
+    auipc a0, 0xfffff
+    ld a0, -0x020(a0)
+    ret
+
+# vdso_time_ns() -> unsigned long long
+# Returns the value of the time CSR in nanoseconds. Whole seconds are converted separately so that this does not overflow.
+.org vdso_start + 0x40
+vdso_time_ns:
+    auipc t0, 0xfffff
+    ld t0, -0x030(t0)
+    rdtime t1
+    divu a0, t1, t0
+    remu t1, t1, t0
+    li t2, 1000000000
+    mul a0, a0, t2
+    mul t1, t1, t2
+    divu t1, t1, t0
+    add a0, a0, t1
+    ret
+
+# Nothing else may share the page, since it is readable by every process
+.balign 4096
+vdso_end:
+.option pop
@@ -9,6 +9,100 @@ pub fn write(fd: u32, buffer: []const u8, size: usize) void {
     );
 }
 
+// The kernel maps a read only page with these fields at this address into every process.
+const vdso_data_address: usize = 0x1000;
+const vdso_pid: usize = 0x00;
+const vdso_parent_pid: usize = 0x08;
+const vdso_timebase_frequency: usize = 0x10;
+
+fn vdsoRead(offset: usize) u64 {
+    return @intToPtr(*const volatile u64, vdso_data_address + offset).*;
+}
+
+pub fn getpid() u64 {
+    return vdsoRead(vdso_pid);
+}
+
+pub fn getppid() u64 {
+    return vdsoRead(vdso_parent_pid);
+}
+
+pub fn timebaseFrequency() u64 {
+    return vdsoRead(vdso_timebase_frequency);
+}
+
+pub fn time() u64 {
+    return asm volatile ("rdtime %[ret]"
+        : [ret] "=r" (-> u64)
+    );
+}
+
+pub fn timeNs() u64 {
+    const frequency = timebaseFrequency();
+    const ticks = time();
+    return ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency;
+}
+
+pub const Timespec = extern struct {
+    seconds: i64,
+    nanoseconds: i64,
+};
+
+pub fn nanosleep(seconds: i64, nanoseconds: i64) i64 {
+    const nanosleep_syscall: u64 = 35;
+    const request = Timespec{ .seconds = seconds, .nanoseconds = nanoseconds };
+    return asm volatile ("ecall"
+        : [ret] "={a0}" (-> i64)
+        : [nanosleep_syscall] "{a7}" (nanosleep_syscall),
+          [request] "{a0}" (&request),
+          [remaining] "{a1}" (@as(u64, 0))
+        : "memory"
+    );
+}
+
+pub fn futexWait(address: *const u32, expected: u32) i64 {
+    const futex_syscall: u64 = 202;
+    const futex_wait: u64 = 0;
+    return asm volatile ("ecall"
+        : [ret] "={a0}" (-> i64)
+        : [futex_syscall] "{a7}" (futex_syscall),
+          [address] "{a0}" (address),
+          [op] "{a1}" (futex_wait),
+          [expected] "{a2}" (expected)
+        : "memory"
+    );
+}
+
+pub fn futexWake(address: *const u32, count: u32) i64 {
+    const futex_syscall: u64 = 202;
+    const futex_wake: u64 = 1;
+    return asm volatile ("ecall"
+        : [ret] "={a0}" (-> i64)
+        : [futex_syscall] "{a7}" (futex_syscall),
+          [address] "{a0}" (address),
+          [op] "{a1}" (futex_wake),
+          [count] "{a2}" (count)
+        : "memory"
+    );
+}
+
+// A lock that only enters the kernel when contended. The state is 0 when unlocked, 1 when locked, and 2 when locked with possible waiters.
+pub const Mutex = struct {
+    state: u32 = 0,
+
+    pub fn lock(self: *Mutex) void {
+        if (@cmpxchgStrong(u32, &self.state, 0, 1, .Acquire, .Monotonic) == null)
+            return;
+        while (@atomicRmw(u32, &self.state, .Xchg, 2, .Acquire) != 0)
+            _ = futexWait(&self.state, 2);
+    }
+
+    pub fn unlock(self: *Mutex) void {
+        if (@atomicRmw(u32, &self.state, .Xchg, 0, .Release) == 2)
+            _ = futexWake(&self.state, 1);
+    }
+};
+
 extern fn main() void;
 
 pub fn _start() callconv(.Naked) noreturn {
@@ -12,6 +12,10 @@ int main(int argc, char** argv) {
     syscall_wrapper(1, 1, (unsigned long long) "Init process started\n", 21, 0, 0, 0);
     syscall_wrapper(314, (unsigned long long) "/bin/lil", 0, 0, 0, 1, 2);
     syscall_wrapper(1, 1, (unsigned long long) "Spawned lil\n", 12, 0, 0, 0);
-    while (1);
+
+    // Sleep instead of spinning; pause only returns if interrupted
+    while (1) {
+        syscall_wrapper(34, 0, 0, 0, 0, 0, 0);
+    }
 }
 